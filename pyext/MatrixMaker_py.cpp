@@ -220,6 +220,8 @@ static PyObject *MatrixMaker_add_ice_sheet(PyMatrixMaker *self, PyObject *args,
 		if (mask2_py) sheet->mask2.reset(new blitz::Array<int,1>(
 			giss::py_to_blitz<int,1>(mask2_py, "mask2", {n2})));
 
+		// A view of the caller's array: changes made to it in place
+		// are found by IceSheet::check_elev2_mask2()
 		sheet->elev2.reference(giss::py_to_blitz<double,1>(elev2_py, "elev2", {n2}));
 		// ====================================================
 		int ice_sheet_num = self->maker->add_ice_sheet(std::move(sheet));
@@ -282,7 +284,7 @@ static PyObject *MatrixMaker_hp_to_iceinterp(PyMatrixMaker *self, PyObject *args
 		}
 
 		// Get the hp_to_iceinterp matrix from it
-		auto ret_c(sheet->hp_to_iceinterp(dest));
+		auto ret_c(self->maker->hp_to_iceinterp(sheet, dest));
 
 		// Create an output tuple of Numpy arrays
 		ret_py = giss::VectorSparseMatrix_to_py(*ret_c);
@@ -328,14 +330,14 @@ static PyObject *MatrixMaker_iceinterp_to_atm(PyMatrixMaker *self, PyObject *arg
 		}
 
 		// Get the ice_to_atm matrix from it
-		giss::SparseAccumulator<int,double> area1_m, area1_m_inv;
-		auto ret_c(sheet->iceinterp_to_projatm(area1_m, src));
+		giss::DenseAccumulator<int,double> area1_m(maker->n1()), area1_m_inv;
+		giss::VectorSparseMatrix ret_c(*maker->iceinterp_to_projatm(sheet, area1_m, src));
 		if (maker->correct_area1)
 			sheet->atm_proj_correct(area1_m, ProjCorrect::PROJ_TO_NATIVE);
-		divide_by(*ret_c, area1_m, area1_m_inv);
+		divide_by(ret_c, area1_m, area1_m_inv);
 
 		// Create an output tuple of Numpy arrays
-		ret_py = giss::VectorSparseMatrix_to_py(*ret_c);
+		ret_py = giss::VectorSparseMatrix_to_py(ret_c);
 		return ret_py;
 	} catch(...) {
 		if (ret_py) Py_DECREF(ret_py);
@@ -379,12 +381,13 @@ static PyObject *MatrixMaker_atm_to_hp(PyMatrixMaker *self, PyObject *args, PyOb
 
 		PyObject *f1_py;
 		int force_lambda = 0;	// false
-		static char const *keyword_list[] = {"f1", "force_lambda", NULL};
+		const char *algorithm_py = "QP";
+		static char const *keyword_list[] = {"f1", "force_lambda", "algorithm", NULL};
 
 		if (!PyArg_ParseTupleAndKeywords(
-			args, kwds, "O|i",
+			args, kwds, "O|is",
 			const_cast<char **>(keyword_list),
-			&f1_py, &force_lambda))
+			&f1_py, &force_lambda, &algorithm_py))
 		{
 			// Throw an exception...
 			PyErr_SetString(PyExc_ValueError,
@@ -395,8 +398,10 @@ static PyObject *MatrixMaker_atm_to_hp(PyMatrixMaker *self, PyObject *args, PyOb
 		int dims[1] = {self->maker->n1()};
 		auto f1(giss::py_to_blitz<double,1>(f1_py, "f1", 1, dims));
 
+		auto algorithm(giss::parse_enum<AtmToHPAlgorithm>(algorithm_py));
+
 		// Call!
-		giss::CooVector<int, double> f3(self->maker->atm_to_hp(f1, force_lambda));
+		giss::CooVector<int, double> f3(self->maker->atm_to_hp(f1, force_lambda, algorithm));
 
 		// Copy output for return
 		blitz::Array<double,1> ret(self->maker->n3());
@@ -427,13 +432,14 @@ printf("BEGIN MatrixMaker_ice_to_hp()\n");
 		PyObject *initial_py;		// array[n3]
 		const char *src_py = "ICE";
 		const char *qp_algorithm_py = "SINGLE_QP";
-		static char const *keyword_list[] = {"f2s", "initial3", "src", "qp_algorithm", NULL};
+		int nthread = 1;
+		static char const *keyword_list[] = {"f2s", "initial3", "src", "qp_algorithm", "nthread", NULL};
 
 		if (!PyArg_ParseTupleAndKeywords(
-			args, kwds, "O|Oss",
+			args, kwds, "O|Ossi",
 			const_cast<char **>(keyword_list),
 			&f2s_py,
-			&initial_py, &src_py, &qp_algorithm_py)) {
+			&initial_py, &src_py, &qp_algorithm_py, &nthread)) {
 			// Throw an exception...
 			PyErr_SetString(PyExc_ValueError,
 				"Bad arguments for ice_to_hp().");
@@ -482,7 +488,7 @@ printf("MatrixMaker_ice_to_hp(): Adding %s\n", sheetname_py);
 
 		// Call!
 		giss::CooVector<int, double> f3(
-			self->maker->iceinterp_to_hp(f2s, initial, src, qp_algorithm));
+			self->maker->iceinterp_to_hp(f2s, initial, src, qp_algorithm, nthread));
 
 		// Copy output for return
 		blitz::Array<double,1> ret(self->maker->n3());
@@ -568,7 +574,7 @@ printf("BEGIN MatrixMaker_area1()\n");
 		std::string const ice_sheet_name(ice_sheet_name_py);
 		IceSheet *sheet = (*maker)[ice_sheet_name];
 
-		giss::SparseAccumulator<int,double> area1_m;
+		giss::DenseAccumulator<int,double> area1_m(maker->n1());
 		sheet->accum_areas(area1_m);
 
 		blitz::Array<double,1> ret(maker->n1());
@@ -587,6 +593,38 @@ printf("BEGIN MatrixMaker_area1()\n");
 	}
 }
 
+/** Tells the MatrixMaker that an ice sheet's elev2 and/or mask2
+arrays (as passed to add_ice_sheet()) have been changed in place.
+(It would find out anyway, by checksum; but this is cheaper.) */
+static PyObject *MatrixMaker_elev2_mask2_changed(PyMatrixMaker *self, PyObject *args, PyObject *kwds)
+{
+	try {
+		// Get arguments
+		const char *ice_sheet_name_py;
+		static char const *keyword_list[] = {"sheetname", NULL};
+
+		if (!PyArg_ParseTupleAndKeywords(
+			args, kwds, "s",
+			const_cast<char **>(keyword_list),
+			&ice_sheet_name_py))
+		{
+			// Throw an exception...
+			PyErr_SetString(PyExc_ValueError,
+				"Bad arguments for elev2_mask2_changed().");
+			return 0;
+		}
+
+		glint2::MatrixMaker *maker = self->maker.get();
+		IceSheet *sheet = (*maker)[std::string(ice_sheet_name_py)];
+		sheet->elev2_mask2_changed();
+
+		Py_RETURN_NONE;
+	} catch(...) {
+		PyErr_SetString(PyExc_ValueError, "Error in MatrixMaker_elev2_mask2_changed()");
+		return 0;
+	}
+}
+
 static PyObject *MatrixMaker_set_interp_grid(PyMatrixMaker *self, PyObject *args, PyObject *kwds)
 {
 	PyObject *ret_py = NULL;
@@ -612,6 +650,7 @@ static PyObject *MatrixMaker_set_interp_grid(PyMatrixMaker *self, PyObject *args
 			IceSheet_L0 *sheet0 = dynamic_cast<IceSheet_L0 *>(&*sheet);
 			if (sheet0) sheet0->interp_grid = interp_grid;
 		}
+		maker->invalidate_matrices();	// interp_grid is not fingerprinted
 
 		return Py_None;
 	} catch(...) {
@@ -736,6 +775,8 @@ static PyMethodDef MatrixMaker_methods[] = {
 		""},
 	{"area1",  (PyCFunction)MatrixMaker_area1, METH_KEYWORDS,
 		""},
+	{"elev2_mask2_changed",  (PyCFunction)MatrixMaker_elev2_mask2_changed, METH_KEYWORDS,
+		""},
 	{"set_interp_grid",  (PyCFunction)MatrixMaker_set_interp_grid, METH_KEYWORDS,
 		""},
 	{"set_interp_style",  (PyCFunction)MatrixMaker_set_interp_style, METH_KEYWORDS,
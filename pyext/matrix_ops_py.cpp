@@ -104,12 +104,94 @@ printf("nancount = %d\n", nancount);
 }
 
 
+/** Like coo_matvec_py(), but for many fields at once: xx[ncol, nfield]
+and yy[nrow, nfield].  Each element of mat is read once for all fields. */
+PyObject *coo_multivec_py(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	try {
+		PyObject *mat_py = NULL;
+		PyObject *xx_py = NULL;
+		PyObject *yy_py = NULL;
+		int ignore_nan = 0;
+
+		static char const *keyword_list[] =
+			{"mat", "xx", "yy", "ignore_nan", NULL};
+		if (!PyArg_ParseTupleAndKeywords(
+			args, kwds, "OOO|i",
+			const_cast<char **>(keyword_list),
+			&mat_py, &xx_py, &yy_py, &ignore_nan))
+		{
+			PyErr_SetString(PyExc_ValueError,
+				"coo_multivec_py() called with invalid arguments.");
+			return NULL;
+		}
+
+		// Cast and typecheck arguments
+		giss::BlitzSparseMatrix mat(giss::py_to_BlitzSparseMatrix(mat_py, "mat"));
+		auto xx(giss::py_to_blitz<double,2>(xx_py, "xx", {mat.ncol, -1}));
+		int const nfield = xx.extent(1);
+		auto yy(giss::py_to_blitz<double,2>(yy_py, "yy", {mat.nrow, nfield}));
+
+		// Fields of each row must be adjacent
+		if (xx.stride(1) != 1 || yy.stride(1) != 1) {
+			PyErr_SetString(PyExc_ValueError,
+				"coo_multivec_py(): xx and yy must be C-contiguous along the field dimension.");
+			return NULL;
+		}
+		double const *X = xx.data();
+		double *Y = yy.data();
+		int const xstride = xx.stride(0);
+		int const ystride = yy.stride(0);
+
+		// Keep track of which items we've written to.  With ignore_nan,
+		// that is per (row, field): as in coo_matvec_py(), an output is
+		// left alone if all of its inputs are NaN.
+		std::vector<char> written((size_t)mat.nrow * (ignore_nan != 0 ? nfield : 1), 0);
+
+		// Do the multiplication, and we're done!
+		int nnz = mat.size();
+		for (int n=0; n<nnz; ++n) {
+			int row = mat.rows()(n);
+			int col = mat.cols()(n);
+			double val = mat.vals()(n);
+			double const *x = X + (size_t)col * xstride;
+			double *y = Y + (size_t)row * ystride;
+
+			// Just do Snowdrift-style "REPLACE".  "MERGE" was never used.
+			if (ignore_nan != 0) {
+				// Ignore NaN in input vector, field by field
+				char *w = &written[(size_t)row * nfield];
+				for (int f=0; f<nfield; ++f) {
+					if (std::isnan(x[f])) continue;
+					if (!w[f]) {
+						y[f] = 0;
+						w[f] = 1;
+					}
+					y[f] += val * x[f];
+				}
+			} else {
+				if (!written[row]) {
+					for (int f=0; f<nfield; ++f) y[f] = 0;
+					written[row] = 1;
+				}
+				giss::axpy_fields(nfield, val, x, y);
+			}
+		}
+	} catch(...) {
+		return NULL;	// Error
+	}
+	return Py_BuildValue("i", 0);
+}
+
 
 
 PyMethodDef matrix_ops_functions[] = {
 	{"coo_matvec", (PyCFunction)coo_matvec_py, METH_KEYWORDS,
 		"Compute M*x, taking care with unspecified elements in M"},
 
+	{"coo_multivec", (PyCFunction)coo_multivec_py, METH_KEYWORDS,
+		"Compute M*X for a block of fields X[ncol, nfield], taking care with unspecified elements in M"},
+
 	{NULL}     /* Sentinel - marks the end of this structure */
 };
 
@@ -271,6 +271,45 @@ class Glint2Tests(unittest.TestCase) :
 
 
 
+	# --------------------------------------------------------
+	def new_maker(self, hpdefs, elev2) :
+		mm = glint2.MatrixMaker()
+		mm.init(self.grid1_fname, 'MODELE', hpdefs)
+		mm.add_ice_sheet(self.grid2_fname, self.exgrid_fname,
+			elev2, mask2=self.mask2, name='greenland')
+		mm.realize()
+		return mm
+
+	def assertSameMatrix(self, a, b, epsilon) :
+		(nrow_a, ncol_a, rows_a, cols_a, vals_a) = a
+		(nrow_b, ncol_b, rows_b, cols_b, vals_b) = b
+		self.assertEqual((nrow_a, ncol_a), (nrow_b, ncol_b))
+		da = dict(zip(zip(rows_a, cols_a), vals_a))
+		db = dict(zip(zip(rows_b, cols_b), vals_b))
+		# Same structure: no leftover (roundoff) entries
+		self.assertEqual(set(da.keys()), set(db.keys()))
+		scale = np.max(np.abs(vals_b))
+		for key in db :
+			self.assertTrue(abs(da[key] - db[key]) <= epsilon * scale)
+
+	def test_patch_hp_to_atm(self) :
+		"""hp_to_atm(), patched repeatedly for changes in elev2 (made in
+		place, without calling elev2_mask2_changed()), must match a
+		fresh build."""
+		hpdefs = np.array(range(0,40))*100.0 - 50.0
+		elev2 = np.array(self.elev2, dtype='d')		# mm keeps a view of this
+		mm = self.new_maker(hpdefs, elev2)
+		mm.hp_to_atm()
+
+		np.random.seed(1)
+		for step in range(0,5) :
+			i2s = np.random.randint(0, len(elev2), 2000)
+			elev2[i2s] += np.random.uniform(-300., 300., len(i2s))
+			patched = mm.hp_to_atm()
+
+			fresh = self.new_maker(hpdefs, elev2.copy()).hp_to_atm()
+			self.assertSameMatrix(patched, fresh, 1e-12)
+
 	def test_remap_proj(self) :
 		self.mytest_remap(False)
 
@@ -0,0 +1,59 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <string>
+#include <netcdfcpp.h>
+#include <boost/filesystem.hpp>
+#include <glint2/MatrixMaker.hpp>
+#include <glint2/GridDomain.hpp>
+#include <glint2/Bundle.hpp>
+
+using namespace glint2;
+
+/** Precomputes the matrices needed by a GCM from a GLINT2 config
+file, and stores them in a bundle that glint2_modele_new() can
+memory-map instead of recomputing them on every rank.  (Each rank
+still reads the config file itself; see Bundle.hpp.)
+Usage: mkbundle <glint2-config.nc> <maker-vname> [<output.bundle>]
+The output defaults to <glint2-config.nc>.bundle */
+int main(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <glint2-config.nc> <maker-vname> [<output.bundle>]\n", argv[0]);
+		return 1;
+	}
+	std::string config_fname(boost::filesystem::canonical(argv[1]).string());
+	std::string maker_vname(argv[2]);
+	std::string out_fname(argc > 3 ? argv[3] : config_fname + ".bundle");
+
+	// Read and realize the whole MatrixMaker (no domain decomposition)
+	std::unique_ptr<GridDomain> domain(new GridDomain_Identity());
+	MatrixMaker maker(true, std::move(domain));
+
+	printf("------------- Reading %s\n", config_fname.c_str());
+	NcFile nc(config_fname.c_str(), NcFile::ReadOnly);
+	maker.read_from_netcdf(nc, maker_vname);
+	nc.close();
+	maker.realize();
+
+	printf("------------- Writing %s\n", out_fname.c_str());
+	write_maker_bundle(maker, out_fname,
+		bundle_source_stamp(config_fname, maker_vname));
+	return 0;
+}
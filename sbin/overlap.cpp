@@ -23,6 +23,7 @@
 #include <netcdfcpp.h>
 #include <string>
 #include <glint2/ExchangeGrid.hpp>
+#include <glint2/exgrid_cache.hpp>
 
 static const double km = 1000.0;
 
@@ -32,6 +33,7 @@ int main(int argc, char **argv)
 {
 	std::string fname1(argv[1]);
 	std::string fname2(argv[2]);
+	int nthread = (argc > 3 ? atoi(argv[3]) : 1);	// Optional
 
 	printf("------------- Set up the projection\n");
 	double proj_lon_0 = -39;
@@ -53,11 +55,12 @@ int main(int argc, char **argv)
 	nc2.close();
 
 	printf("--------------- Overlapping\n");
-	ExchangeGrid exch(*grid1, *grid2);
-	exch.sort_renumber_vertices();
+	// Cached if GLINT2_EXGRID_CACHE is set
+	auto exch(cached_exchange_grid(*grid1, *grid2, "", "", nthread));
+	exch->sort_renumber_vertices();
 
 	printf("--------------- Writing Out\n");
 	std::string fname = grid1->name + "-" + grid2->name + ".nc";
 //	NcFile nc(fname.c_str(), NcFile::Replace);
-	exch.to_netcdf(fname);
+	exch->to_netcdf(fname);
 }
@@ -17,11 +17,17 @@
  */
 
 #include <iostream>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <tuple>
 #include <blitz/array.h>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
 #include <boost/random/uniform_real_distribution.hpp>
 #include <giss/SparseMatrix.hpp>
+#include <giss/IndexTranslator2.hpp>
 
 blitz::Array<double,2> random_matrix(int m, int n)
 {
@@ -87,8 +93,251 @@ void print(giss::VectorSparseMatrix const &cc_s)
 	printf("-------------- END Sparse\n");
 }
 
+/** @return Largest absolute difference between a dense and sparse matrix */
+double max_diff(blitz::Array<double,2> const &cc, giss::VectorSparseMatrix const &cc_s)
+{
+	blitz::Array<double,2> dd(cc.extent(0), cc.extent(1));
+	dd = 0;
+	for (auto ii=cc_s.begin(); ii != cc_s.end(); ++ii)
+		dd(ii.row(), ii.col()) += ii.val();
+
+	double ret = 0;
+	for (int i=0; i<cc.extent(0); ++i) {
+	for (int k=0; k<cc.extent(1); ++k) {
+		ret = std::max(ret, std::abs(dd(i,k) - cc(i,k)));
+	}}
+	return ret;
+}
+
+/** Compares the old row-by-column product against the sparse
+accumulator product, for correctness and speed.
+Usage: smulttest compare [m n p] */
+int compare(int argc, char **argv)
+{
+	int size[3] = {200, 300, 250};
+	if (argc >= 5) for (int i=0; i<3; ++i) size[i] = atoi(argv[i+2]);
+
+	auto aa(random_matrix(size[0], size[1]));
+	auto bb(random_matrix(size[1], size[2]));
+	auto cc(multiply(aa,bb));
+
+	// Use duplicate entries, to make sure they're summed correctly
+	auto aa_s(dense_to_sparse(aa,2));
+	auto bb_s(dense_to_sparse(bb,3));
+
+	clock_t t0 = clock();
+	auto cc_new(giss::multiply_giss_algorithm(aa_s, bb_s));
+	clock_t t1 = clock();
+	auto cc_old(giss::multiply_rowcol_algorithm(aa_s, bb_s));
+	clock_t t2 = clock();
+
+	double diff_new = max_diff(cc, *cc_new);
+	double diff_old = max_diff(cc, *cc_old);
+	printf("(%d x %d) * (%d x %d): nnz = %ld * %ld\n",
+		size[0], size[1], size[1], size[2], aa_s.size(), bb_s.size());
+	printf("    multiply_giss_algorithm:   nnz=%ld, max_diff=%g, %g s\n",
+		cc_new->size(), diff_new, (double)(t1-t0) / CLOCKS_PER_SEC);
+	printf("    multiply_rowcol_algorithm: nnz=%ld, max_diff=%g, %g s\n",
+		cc_old->size(), diff_old, (double)(t2-t1) / CLOCKS_PER_SEC);
+
+	// Values are up to 5e4, so products sum to ~1e9 * size[1]
+	double const epsilon = 1e-6 * size[1];
+	if (diff_new > epsilon || diff_old > epsilon) {
+		fprintf(stderr, "smulttest: sparse products disagree with dense product!\n");
+		return 1;
+	}
+	return 0;
+}
+
+/** Checks IndexTranslator2 when only some of the indices of space A
+are present (eg: fields for just sheet 1 of two ice sheets).
+Usage: smulttest translate */
+int translate(int argc, char **argv)
+{
+	static boost::random::mt19937 gen;
+
+	std::map<int, size_t> size_a;
+	size_a[1] = 100;
+	size_a[3] = 7;
+	size_a[4] = 300;
+	int const indices[3] = {1, 3, 4};
+
+	boost::random::uniform_int_distribution<> kdist(0, 2);
+	std::vector<std::pair<int,int>> used_a;
+	std::set<std::pair<int,int>> used_set;
+	for (int i=0; i<150; ++i) {
+		int index = indices[kdist(gen)];
+		boost::random::uniform_int_distribution<> idist(0, size_a[index]-1);
+		std::pair<int,int> a(index, idist(gen));
+		used_a.push_back(a);
+		used_set.insert(a);
+	}
+
+	giss::IndexTranslator2 trans("translate");
+	trans.init(size_a, used_a);
+
+	// Space B is space A, in order, without the unused elements
+	int nerr = 0;
+	if (trans.nb() != used_set.size()) ++nerr;
+	int ib = 0;
+	for (auto a = used_set.begin(); a != used_set.end(); ++a, ++ib) {
+		if (trans.a2b(*a) != ib || trans.b2a(ib) != *a) ++nerr;
+	}
+	if (trans.na(0) != 0 || trans.na(3) != 7) ++nerr;
+
+	// Sheet 2 was never given to init()
+	bool thrown = false;
+	try {
+		trans.a2b(std::make_pair(2, 0));
+	} catch(std::exception const &e) {
+		thrown = true;
+	}
+	if (!thrown) ++nerr;
+
+	// Just one sheet, not sheet 0
+	std::map<int, size_t> size_one;
+	size_one[1] = 10;
+	std::vector<std::pair<int,int>> used_one;
+	used_one.push_back(std::make_pair(1, 9));
+	used_one.push_back(std::make_pair(1, 2));
+	giss::IndexTranslator2 trans_one("translate_one");
+	trans_one.init(size_one, used_one);
+	if (trans_one.nb() != 2 || trans_one.a2b(std::make_pair(1,2)) != 0 ||
+		trans_one.b2a(1) != std::make_pair(1,9)) ++nerr;
+
+	if (nerr > 0) {
+		fprintf(stderr, "smulttest: IndexTranslator2 failed %d checks!\n", nerr);
+		return 1;
+	}
+	printf("IndexTranslator2: OK\n");
+	return 0;
+}
+
+/** Sorts (and optionally sums duplicates in) a coordinate-format
+matrix the slow, obvious way: stable sort, then merge.  (The sort is
+stable, so duplicates are summed in their original order.) */
+static giss::VectorSparseMatrix reference_sort(
+	giss::VectorSparseMatrix const &mat,
+	giss::SparseMatrix::SortOrder sort_order, bool sum_duplicates)
+{
+	bool const row_major = (sort_order == giss::SparseMatrix::SortOrder::ROW_MAJOR);
+	std::vector<std::tuple<int,int,double>> elements;
+	for (size_t i=0; i<mat.size(); ++i) {
+		int row = mat.rows()[i];
+		int col = mat.cols()[i];
+		elements.push_back(row_major ?
+			std::make_tuple(row, col, mat.vals()[i]) :
+			std::make_tuple(col, row, mat.vals()[i]));
+	}
+	std::stable_sort(elements.begin(), elements.end(),
+		[](std::tuple<int,int,double> const &a, std::tuple<int,int,double> const &b)
+		{ return std::make_pair(std::get<0>(a), std::get<1>(a)) < std::make_pair(std::get<0>(b), std::get<1>(b)); });
+
+	std::vector<int> indx, jndx;
+	std::vector<double> val;
+	for (auto ii = elements.begin(); ii != elements.end(); ++ii) {
+		int major = std::get<0>(*ii);
+		int minor = std::get<1>(*ii);
+		if (sum_duplicates && val.size() > 0 &&
+			(row_major ? indx.back() == major && jndx.back() == minor
+			           : jndx.back() == major && indx.back() == minor))
+		{
+			val.back() += std::get<2>(*ii);
+			continue;
+		}
+		indx.push_back(row_major ? major : minor);
+		jndx.push_back(row_major ? minor : major);
+		val.push_back(std::get<2>(*ii));
+	}
+	return giss::VectorSparseMatrix(mat,
+		std::move(indx), std::move(jndx), std::move(val));
+}
+
+/** Random coordinate-format matrix, with raw indices (before
+index_base) in [row0, row0+nrow) x [col0, col0+ncol). */
+static giss::VectorSparseMatrix random_coo(size_t n,
+	int row0, int nrow, int col0, int ncol)
+{
+	static boost::random::mt19937 gen;
+	boost::random::uniform_int_distribution<> rdist(row0, row0 + nrow - 1);
+	boost::random::uniform_int_distribution<> cdist(col0, col0 + ncol - 1);
+	boost::random::uniform_real_distribution<> vdist(-1.0, 1.0);
+
+	std::vector<int> indx(n), jndx(n);
+	std::vector<double> val(n);
+	for (size_t i=0; i<n; ++i) {
+		indx[i] = rdist(gen);
+		jndx[i] = cdist(gen);
+		val[i] = vdist(gen);
+	}
+	// index_base is not used by the sort, so any value will do
+	return giss::VectorSparseMatrix(giss::SparseDescr(nrow, ncol, row0),
+		std::move(indx), std::move(jndx), std::move(val));
+}
+
+static bool same_elements(giss::VectorSparseMatrix const &a, giss::VectorSparseMatrix const &b)
+	{ return a.rows() == b.rows() && a.cols() == b.cols() && a.vals() == b.vals(); }
+
+/** Checks VectorSparseMatrix::sort() and sum_duplicates() (a radix
+sort) against std::stable_sort plus a merge.
+Usage: smulttest sort */
+int sort(int argc, char **argv)
+{
+	struct Case {
+		char const *name;
+		size_t n;
+		int row0, nrow, col0, ncol;
+	};
+	Case const cases[] = {
+		{"duplicates",          20000,      0,     30,     0,      30},
+		{"negative indices",    20000,    -50,    100,  -1000,    200},
+		{"offset indices",      20000, 100000,    500,  50000,  70000},
+		{"single row",          5000,       7,      1,     0,    1000},
+		{"single column",       5000,       0,   1000,    -3,       1},
+		{"single element",      1,          5,      1,     5,       1},
+		{"threaded",            (1<<20) + 12345, 0, 200000, 0, 300000},
+		{"threaded, duplicates", (1<<20) + 1,   -10,  1000, 0,    1000},
+	};
+
+	int nerr = 0;
+	for (size_t c=0; c < sizeof(cases)/sizeof(cases[0]); ++c) {
+		Case const &cs(cases[c]);
+		giss::VectorSparseMatrix const mat(random_coo(cs.n, cs.row0, cs.nrow, cs.col0, cs.ncol));
+
+		for (int order=0; order<2; ++order) {
+			auto sort_order(order == 0 ?
+				giss::SparseMatrix::SortOrder::ROW_MAJOR :
+				giss::SparseMatrix::SortOrder::COLUMN_MAJOR);
+		for (int sum=0; sum<2; ++sum) {
+			giss::VectorSparseMatrix sorted(mat);
+			if (sum) sorted.sum_duplicates(sort_order);
+			else sorted.sort(sort_order);
+
+			bool ok = same_elements(sorted, reference_sort(mat, sort_order, sum));
+			if (!ok) ++nerr;
+			printf("    %-22s %s %s: %s\n", cs.name,
+				order == 0 ? "ROW_MAJOR   " : "COLUMN_MAJOR",
+				sum ? "sum_duplicates()" : "sort()          ",
+				ok ? "OK" : "FAILED");
+		}}
+	}
+
+	if (nerr > 0) {
+		fprintf(stderr, "smulttest: radix sort failed %d checks!\n", nerr);
+		return 1;
+	}
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
+	if (argc >= 2 && strcmp(argv[1], "compare") == 0)
+		return compare(argc, argv);
+	if (argc >= 2 && strcmp(argv[1], "translate") == 0)
+		return translate(argc, argv);
+	if (argc >= 2 && strcmp(argv[1], "sort") == 0)
+		return sort(argc, argv);
+
 	int size[3] = {3,4,5};
 
 	auto aa(random_matrix(size[0], size[1]));
@@ -21,3 +21,38 @@
 #include "qpt_c.hpp"
 
 extern "C" bool eqp_solve_simple(galahad::qpt_problem_f &p, double infinity);
+
+namespace galahad {
+	class eqp_solver_f;		// Fortran type, opaque
+}
+
+/** @see eqp_f.f90 */
+extern "C" galahad::eqp_solver_f *eqp_solver_new_c();
+/** @see eqp_f.f90 */
+extern "C" bool eqp_solver_solve_c(galahad::eqp_solver_f *self, galahad::qpt_problem_f &p);
+/** @see eqp_f.f90 */
+extern "C" void eqp_solver_delete_c(galahad::eqp_solver_f *self);
+
+namespace galahad {
+
+/** Persistent GALAHAD EQP workspace.  The first solve() factorizes
+the KKT system of the problem; later calls to solve() on the same
+problem, in which only G, f and C have changed, reuse that
+factorization (via EQP_resolve).
+@see eqp_x::eqp_solver_type */
+class eqp_solver_c {
+	eqp_solver_f *self;
+
+	eqp_solver_c(eqp_solver_c const &);				// Not copyable
+	eqp_solver_c &operator=(eqp_solver_c const &);
+public:
+	eqp_solver_c() : self(eqp_solver_new_c()) {}
+	~eqp_solver_c() { eqp_solver_delete_c(self); }
+
+	/** Solves qpt, leaving the answer in qpt.X.
+	@return true on success. */
+	bool solve(qpt_problem_c &qpt)
+		{ return eqp_solver_solve_c(self, qpt.this_f); }
+};
+
+}	// namespace galahad
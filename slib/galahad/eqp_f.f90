@@ -168,3 +168,87 @@ print *,'H%m,H%n,H%ne',p%H%m,p%H%n,p%H%ne
 	call flush(6)
 
 end function eqp_solve_simple
+! -------------------------------------------------------------------
+!> Holds GALAHAD EQP's workspace between calls.  The KKT system is
+!! factorized by the first solve; later solves with the same H and A
+!! (only G, f and C changed) go through EQP_resolve, which reuses it.
+module eqp_x
+USE GALAHAD_EQP_double
+IMPLICIT NONE
+
+	type eqp_solver_type
+		TYPE ( EQP_data_type ) :: data
+		TYPE ( EQP_control_type ) :: control
+		TYPE ( EQP_inform_type ) :: inform
+		logical :: factorized
+	end type eqp_solver_type
+
+end module eqp_x
+! -------------------------------------------------------------------
+!> Allocates a new persistent EQP solver.
+!! Meant to be called from C++.
+!! @return Pointer to the allocated eqp_solver_type.
+function eqp_solver_new_c() bind(C)
+use iso_c_binding
+use eqp_x
+IMPLICIT NONE
+type(c_ptr) :: eqp_solver_new_c
+
+	type(eqp_solver_type), pointer :: self
+
+	allocate(self)
+	CALL EQP_initialize(self%data, self%control, self%inform)
+	self%control%print_level = 1
+	self%control%SBLS_control%preconditioner = 1	! See eqp_solve_simple()
+	self%factorized = .FALSE.
+	eqp_solver_new_c = c_loc(self)
+end function eqp_solver_new_c
+! -------------------------------------------------------------------
+!> Solves an equality-constrained QP.  The first (successful) call
+!! factorizes; later calls assume only p%G, p%f and p%C have changed.
+!! Meant to be called from C++.
+function eqp_solver_solve_c(self_c, p_c) bind(C)
+use iso_c_binding
+use qpt_x
+use eqp_x
+IMPLICIT NONE
+type(c_ptr), value :: self_c		! eqp_solver_type
+type(c_ptr), value :: p_c		! QPT_problem_type
+logical(kind=c_bool) :: eqp_solver_solve_c
+
+	type(eqp_solver_type), pointer :: self
+	type(QPT_problem_type), pointer :: p
+
+	call c_f_pointer(self_c, self)
+	call c_f_pointer(p_c, p)
+
+	if (self%factorized) then
+		CALL EQP_resolve(p, self%data, self%control, self%inform)
+	else
+		p%new_problem_structure = .TRUE.
+		CALL EQP_solve(p, self%data, self%control, self%inform)
+		self%factorized = (self%inform%status == 0)
+	end if
+
+	IF ( self%inform%status /= 0 ) THEN	! Error
+		WRITE( 6, "( ' EQP_solve exit status = ', I6 ) " ) self%inform%status
+		eqp_solver_solve_c = .false.
+	else
+		eqp_solver_solve_c = .true.
+	end if
+end function eqp_solver_solve_c
+! -------------------------------------------------------------------
+!> De-allocates a solver previously allocated via eqp_solver_new_c().
+!! Meant to be called from C++.
+subroutine eqp_solver_delete_c(self_c) bind(C)
+use iso_c_binding
+use eqp_x
+IMPLICIT NONE
+type(c_ptr), value :: self_c
+
+	type(eqp_solver_type), pointer :: self
+
+	call c_f_pointer(self_c, self)
+	CALL EQP_terminate(self%data, self%control, self%inform) ! delete internal workspace
+	deallocate(self)
+end subroutine eqp_solver_delete_c
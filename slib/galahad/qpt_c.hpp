@@ -102,6 +102,44 @@ public :
 	void alloc_A(int A_ne)
 		{ qpt_problem_alloc_a(this, A_ne); }
 
+	/** Allocates H and fills it in bulk from coordinate arrays.
+	Elements above the diagonal are mirrored into the lower triangle,
+	as GALAHAD requires.
+	@see zd11_c::fill_coo() */
+	void set_H(int H_ne, int const *rows, int const *cols, double const *vals,
+		int index_base = 0)
+	{
+		alloc_H(H_ne);
+		H.fill_coo(0, H_ne, rows, cols, vals, index_base, true);
+	}
+
+	/** Allocates H and fills it in bulk from a CSR matrix.
+	@see zd11_c::fill_csr() */
+	void set_H_csr(int const *row_start, int const *cols, double const *vals,
+		int index_base = 0)
+	{
+		alloc_H(row_start[n]);
+		H.fill_csr(0, n, row_start, cols, vals, index_base, true);
+	}
+
+	/** Allocates A and fills it in bulk from coordinate arrays.
+	@see zd11_c::fill_coo() */
+	void set_A(int A_ne, int const *rows, int const *cols, double const *vals,
+		int index_base = 0)
+	{
+		alloc_A(A_ne);
+		A.fill_coo(0, A_ne, rows, cols, vals, index_base);
+	}
+
+	/** Allocates A and fills it in bulk from a CSR matrix.
+	@see zd11_c::fill_csr() */
+	void set_A_csr(int const *row_start, int const *cols, double const *vals,
+		int index_base = 0)
+	{
+		alloc_A(row_start[m]);
+		A.fill_csr(0, m, row_start, cols, vals, index_base);
+	}
+
 
 	/** Deallocates the underlying istance of qpt_x::qpt_problem_type. */
 	~qpt_problem_c();
@@ -16,6 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <climits>
+#include <algorithm>
 #include <boost/bind.hpp>
 #include <netcdfcpp.h>
 #include <giss/ncutil.hpp>
@@ -34,6 +36,106 @@ static void netcdf_write(zd11_c const *mat, NcFile *nc, std::string const &vname
 }
 
 
+/** Checks that a batch of n elements fits at k0, with rows in
+[0,nrow_max) and cols in [0,ncol_max) once index_base is removed. */
+static void check_batch(zd11_c const &mat, char const *fn, int k0, int n,
+	int row_min, int row_max, int col_min, int col_max)
+{
+	if (k0 < 0 || n < 0 || k0 + n > mat.ne) {
+		fprintf(stderr, "zd11_c::%s(): %d elements at %d don't fit in ne=%d\n", fn, n, k0, mat.ne);
+		throw std::exception();
+	}
+	if (n == 0) return;
+	if (row_min < 0 || row_max >= mat.m) {
+		fprintf(stderr, "zd11_c::%s(): rows [%d, %d] out of range for m=%d\n", fn, row_min, row_max, mat.m);
+		throw std::exception();
+	}
+	if (col_min < 0 || col_max >= mat.n) {
+		fprintf(stderr, "zd11_c::%s(): cols [%d, %d] out of range for n=%d\n", fn, col_min, col_max, mat.n);
+		throw std::exception();
+	}
+}
+
+void zd11_c::fill_coo(int k0, int n,
+	int const *rows, int const *cols, double const *vals,
+	int index_base, bool lower)
+{
+	// Validate the batch
+	int row_min = INT_MAX, row_max = INT_MIN;
+	int col_min = INT_MAX, col_max = INT_MIN;
+	for (int i=0; i<n; ++i) {
+		row_min = std::min(row_min, rows[i]);
+		row_max = std::max(row_max, rows[i]);
+		col_min = std::min(col_min, cols[i]);
+		col_max = std::max(col_max, cols[i]);
+	}
+	check_batch(*this, "fill_coo", k0, n,
+		row_min - index_base, row_max - index_base,
+		col_min - index_base, col_max - index_base);
+
+	// Copy, converting to 1-based indices
+	int const shift = 1 - index_base;
+	int * const row_out = row + k0;
+	int * const col_out = col + k0;
+	if (lower) {
+		for (int i=0; i<n; ++i) {
+			row_out[i] = std::max(rows[i], cols[i]) + shift;
+			col_out[i] = std::min(rows[i], cols[i]) + shift;
+		}
+	} else {
+		for (int i=0; i<n; ++i) {
+			row_out[i] = rows[i] + shift;
+			col_out[i] = cols[i] + shift;
+		}
+	}
+	std::copy(vals, vals + n, val + k0);
+}
+
+void zd11_c::fill_csr(int k0, int nrow, int const *row_start,
+	int const *cols, double const *vals,
+	int index_base, bool lower)
+{
+	int const nnz = (nrow > 0 ? row_start[nrow] : 0);
+
+	// Validate the batch
+	if (nrow > 0 && row_start[0] != 0) {
+		fprintf(stderr, "zd11_c::fill_csr(): row_start[0]=%d, must be 0\n", row_start[0]);
+		throw std::exception();
+	}
+	for (int r=0; r<nrow; ++r) {
+		if (row_start[r+1] < row_start[r]) {
+			fprintf(stderr, "zd11_c::fill_csr(): row_start decreases at row %d\n", r);
+			throw std::exception();
+		}
+	}
+	int col_min = INT_MAX, col_max = INT_MIN;
+	for (int i=0; i<nnz; ++i) {
+		col_min = std::min(col_min, cols[i]);
+		col_max = std::max(col_max, cols[i]);
+	}
+	check_batch(*this, "fill_csr", k0, nnz,
+		0, nrow-1, col_min - index_base, col_max - index_base);
+
+	// Copy, converting to 1-based indices
+	int const shift = 1 - index_base;
+	int * const row_out = row + k0;
+	int * const col_out = col + k0;
+	for (int r=0; r<nrow; ++r) {
+		int const r1 = r + 1;
+		for (int i=row_start[r]; i<row_start[r+1]; ++i) {
+			int const c1 = cols[i] + shift;
+			if (lower && c1 > r1) {
+				row_out[i] = c1;
+				col_out[i] = r1;
+			} else {
+				row_out[i] = r1;
+				col_out[i] = c1;
+			}
+		}
+	}
+	std::copy(vals, vals + nnz, val + k0);
+}
+
 boost::function<void()> zd11_c::netcdf_define(NcFile &nc, std::string const &vname)
 {
 	auto oneDim = giss::get_or_add_dim(nc, "one", 1);
@@ -64,6 +64,27 @@ public :
 	int put_type(std::string const &str)
 		{ return zd11_put_type_c(main, str.c_str(), str.length()); }
 
+	/** Fills elements [k0, k0+n) in bulk, from coordinate arrays.
+	The whole batch is validated once, up front (indices in range,
+	enough room); after that, elements are copied without checks.
+	@param index_base Index base of rows and cols (0 for C++ arrays).
+	    They are converted to Fortran (1-based) indices.
+	@param lower Mirror elements above the diagonal into the lower
+	    triangle (GALAHAD's Hessian is stored that way). */
+	void fill_coo(int k0, int n,
+		int const *rows, int const *cols, double const *vals,
+		int index_base = 0, bool lower = false);
+
+	/** Fills elements [k0, k0+nnz) in bulk, from a CSR matrix.
+	Validated once, as with fill_coo().
+	@param nrow Number of rows in the CSR matrix.
+	@param row_start Offset of each row in cols/vals [nrow+1],
+	    starting from 0; nnz = row_start[nrow].
+	@param index_base Index base of cols (rows are numbered from 0). */
+	void fill_csr(int k0, int nrow, int const *row_start,
+		int const *cols, double const *vals,
+		int index_base = 0, bool lower = false);
+
 	/** Used to write this data structure to a netCDF file.
 	Defines the required variables.  Call the returned boost::function
 	later to write the data.
@@ -0,0 +1,189 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <boost/thread.hpp>
+#include <giss/CsrSparseMatrix.hpp>
+
+namespace giss {
+
+CsrSparseMatrix::CsrSparseMatrix(VectorSparseMatrix const &mat) :
+	SparseMatrix1<CsrSparseMatrix0>(mat)
+{
+	index_base = 0;
+	std::vector<int> const &rows(mat.rows());
+	std::vector<int> const &cols(mat.cols());
+	std::vector<double> const &vals(mat.vals());
+	int const base = mat.index_base;
+	size_t const nnz = mat.size();
+
+	// Count elements in each row
+	for (size_t i=0; i<nnz; ++i) {
+		int const r = rows[i] - base;
+		if (r < 0 || r >= nrow) {
+			fprintf(stderr, "CsrSparseMatrix: row=%d out of range [0, %d)\n", r, nrow);
+			throw std::exception();
+		}
+		++_row_start[r+1];
+	}
+	for (int r=0; r<nrow; ++r) _row_start[r+1] += _row_start[r];
+
+	// Place each element
+	std::vector<int> next(_row_start.begin(), _row_start.end()-1);
+	_cols.resize(nnz);
+	_vals.resize(nnz);
+	for (size_t i=0; i<nnz; ++i) {
+		int const k = next[rows[i] - base]++;
+		_cols[k] = cols[i] - base;
+		_vals[k] = vals[i];
+	}
+
+	for (_last_row = nrow-1; _last_row > 0 && _row_start[_last_row] == nnz; --_last_row) ;
+}
+
+std::unique_ptr<CsrSparseMatrix> CsrSparseMatrix::transpose() const
+{
+	std::unique_ptr<CsrSparseMatrix> ret(new CsrSparseMatrix(SparseDescr(ncol, nrow)));
+	std::vector<int> &start(ret->_row_start);
+	size_t const nnz = size();
+
+	for (size_t i=0; i<nnz; ++i) ++start[_cols[i]+1];
+	for (int c=0; c<ncol; ++c) start[c+1] += start[c];
+
+	// Visiting our rows in order leaves each row of the result sorted
+	std::vector<int> next(start.begin(), start.end()-1);
+	ret->_cols.resize(nnz);
+	ret->_vals.resize(nnz);
+	for (int r=0; r<nrow; ++r) {
+		for (int i=_row_start[r]; i<_row_start[r+1]; ++i) {
+			int const k = next[_cols[i]]++;
+			ret->_cols[k] = r;
+			ret->_vals[k] = _vals[i];
+		}
+	}
+
+	for (ret->_last_row = ncol-1; ret->_last_row > 0 && start[ret->_last_row] == nnz; --ret->_last_row) ;
+	return ret;
+}
+
+/** y[r] (+)= A(r,:) x, for rows [r0, r1) */
+static void csr_multiply_rows(int r0, int r1,
+	int const *row_start, int const *cols, double const *vals,
+	double const *x, double *y, bool clear_y)
+{
+	for (int r=r0; r<r1; ++r) {
+		double sum = 0;
+		for (int i=row_start[r]; i<row_start[r+1]; ++i)
+			sum += vals[i] * x[cols[i]];
+		if (clear_y) y[r] = sum;
+		else y[r] += sum;
+	}
+}
+
+std::vector<int> CsrSparseMatrix::split_rows(int nthread) const
+{
+	size_t const nnz = size();
+	std::vector<int> bounds;
+	bounds.push_back(0);
+	for (int t=1; t<nthread; ++t) {
+		int const target = (int)((nnz * t) / nthread);
+		bounds.push_back(std::lower_bound(
+			_row_start.begin() + bounds.back(), _row_start.end() - 1, target)
+			- _row_start.begin());
+	}
+	bounds.push_back(nrow);
+	return bounds;
+}
+
+void CsrSparseMatrix::multiply(double const * x, double *y, bool clear_y, int nthread) const
+{
+	int const *row_start = &_row_start[0];
+	int const *cols = (_cols.size() > 0 ? &_cols[0] : 0);
+	double const *vals = (_vals.size() > 0 ? &_vals[0] : 0);
+
+	if (nthread <= 1 || nrow < 2*nthread) {
+		csr_multiply_rows(0, nrow, row_start, cols, vals, x, y, clear_y);
+		return;
+	}
+
+	// Split the rows so each thread gets about the same number of elements
+	std::vector<int> bounds(split_rows(nthread));
+	boost::thread_group threads;
+	for (int t=0; t<nthread; ++t) {
+		threads.create_thread(boost::bind(&csr_multiply_rows, bounds[t], bounds[t+1],
+			row_start, cols, vals, x, y, clear_y));
+	}
+	threads.join_all();
+}
+
+/** Y[r,:] (+)= A(r,:) X, for rows [r0, r1) */
+static void csr_multiply_multi_rows(int r0, int r1,
+	int const *row_start, int const *cols, double const *vals,
+	double const *X, double *Y, int nfield, bool clear_y)
+{
+	for (int r=r0; r<r1; ++r) {
+		double * const y = Y + (size_t)r * nfield;
+		if (clear_y) for (int f=0; f<nfield; ++f) y[f] = 0;
+		for (int i=row_start[r]; i<row_start[r+1]; ++i)
+			axpy_fields(nfield, vals[i], X + (size_t)cols[i] * nfield, y);
+	}
+}
+
+void CsrSparseMatrix::multiply_multi(double const *X, double *Y, int nfield, bool clear_y, int nthread) const
+{
+	int const *row_start = &_row_start[0];
+	int const *cols = (_cols.size() > 0 ? &_cols[0] : 0);
+	double const *vals = (_vals.size() > 0 ? &_vals[0] : 0);
+
+	if (nthread <= 1 || nrow < 2*nthread) {
+		csr_multiply_multi_rows(0, nrow, row_start, cols, vals, X, Y, nfield, clear_y);
+		return;
+	}
+
+	std::vector<int> bounds(split_rows(nthread));
+	boost::thread_group threads;
+	for (int t=0; t<nthread; ++t) {
+		threads.create_thread(boost::bind(&csr_multiply_multi_rows, bounds[t], bounds[t+1],
+			row_start, cols, vals, X, Y, nfield, clear_y));
+	}
+	threads.join_all();
+}
+
+void CsrSparseMatrix::multiplyT(double const * x, double *y, bool clear_y) const
+{
+	if (clear_y) for (int c=0; c<ncol; ++c) y[c] = 0;
+	for (int r=0; r<nrow; ++r) {
+		double const xr = x[r];
+		for (int i=_row_start[r]; i<_row_start[r+1]; ++i)
+			y[_cols[i]] += _vals[i] * xr;
+	}
+}
+
+std::unique_ptr<VectorSparseMatrix> CsrSparseMatrix::to_vector() const
+{
+	size_t const nnz = size();
+	std::vector<int> indx(nnz);
+	for (int r=0; r<nrow; ++r)
+		for (int i=_row_start[r]; i<_row_start[r+1]; ++i) indx[i] = r;
+
+	return std::unique_ptr<VectorSparseMatrix>(new VectorSparseMatrix(
+		SparseDescr(nrow, ncol),
+		std::move(indx), std::vector<int>(_cols), std::vector<double>(_vals)));
+}
+
+}	// namespace giss
@@ -0,0 +1,228 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <giss/SparseMatrix.hpp>
+
+namespace giss {
+
+// ====================================================================
+/** Mix-in, not part of the API. */
+class CsrSparseMatrix0 : public SparseMatrix
+{
+protected:
+	std::vector<int> _row_start;	// Beginning of each row in _cols/_vals [nrow+1]
+	std::vector<int> _cols;			// Column of each element (base=0)
+	std::vector<double> _vals;
+
+	int _last_row;		// Last row with an element so far (for _set())
+
+	CsrSparseMatrix0(SparseDescr const &descr) :
+		SparseMatrix(descr), _row_start(descr.nrow+1, 0), _last_row(0)
+	{ index_base = 0; }
+
+	/** @return Row of the element at position i in _cols/_vals (by
+	binary search, skipping empty rows); nrow if i is past the end. */
+	int row_of(int i) const {
+		return std::upper_bound(_row_start.begin(), _row_start.end(), i)
+			- _row_start.begin() - 1;
+	}
+
+public:
+
+	// --------------------------------------------------
+	/** Standard STL-type iterator for iterating through a CsrSparseMatrix.
+	Visits elements row by row. */
+	class iterator {
+	protected:
+		CsrSparseMatrix0 *parent;
+		int i;		// Position in _cols/_vals
+		int r;		// Row of element i
+		void skip_empty()
+			{ while (r < parent->nrow && i >= parent->_row_start[r+1]) ++r; }
+		iterator(CsrSparseMatrix0 *p, int _i, int _r) : parent(p), i(_i), r(_r) {}
+		friend class CsrSparseMatrix0;
+	public:
+		int position() const { return i; }
+		iterator(CsrSparseMatrix0 *p, int _i) : parent(p), i(_i), r(p->row_of(_i)) {}
+		bool operator==(iterator const &rhs) const { return i == rhs.i; }
+		bool operator!=(iterator const &rhs) const { return i != rhs.i; }
+		void operator++() { ++i; skip_empty(); }
+		int row() const { return r; }
+		int col() const { return parent->_cols[i]; }
+		double &val() { return parent->_vals[i]; }
+		double &value() { return val(); }
+	};
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, _vals.size(), nrow); }
+	// --------------------------------------------------
+	class const_iterator {
+	protected:
+		CsrSparseMatrix0 const *parent;
+		int i;
+		int r;
+		void skip_empty()
+			{ while (r < parent->nrow && i >= parent->_row_start[r+1]) ++r; }
+		const_iterator(CsrSparseMatrix0 const *p, int _i, int _r) : parent(p), i(_i), r(_r) {}
+		friend class CsrSparseMatrix0;
+	public:
+		int position() const { return i; }
+		const_iterator(CsrSparseMatrix0 const *p, int _i) : parent(p), i(_i), r(p->row_of(_i)) {}
+		bool operator==(const_iterator const &rhs) const { return i == rhs.i; }
+		bool operator!=(const_iterator const &rhs) const { return i != rhs.i; }
+		void operator++() { ++i; skip_empty(); }
+		int row() const { return r; }
+		int col() const { return parent->_cols[i]; }
+		double const &val() { return parent->_vals[i]; }
+		double const &value() { return val(); }
+	};
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, _vals.size(), nrow); }
+	// --------------------------------------------------
+
+	void clear() {
+		std::fill(_row_start.begin(), _row_start.end(), 0);
+		_cols.clear();
+		_vals.clear();
+		_last_row = 0;
+	}
+
+	size_t size() const { return _vals.size(); }
+
+protected :
+	/** Internal set() function without any error checking or adjustments
+	for index_base.  Elements may only be added in row order; and
+	each new one costs O(nrow), so this is only meant for small matrices.
+	With DuplicatePolicy::REPLACE, an element already in the row is
+	overwritten (O(row length)); with ADD, a duplicate is appended. */
+	void _set(int row, int col, double const val, DuplicatePolicy dups)
+	{
+		if (row < _last_row) {
+			fprintf(stderr, "CsrSparseMatrix: Elements must be added in row order (row %d after row %d)\n", row, _last_row);
+			throw std::exception();
+		}
+		if (dups == DuplicatePolicy::REPLACE && row == _last_row) {
+			for (int i = _row_start[row]; i < (int)_cols.size(); ++i) {
+				if (_cols[i] == col) {
+					_vals[i] = val;
+					return;
+				}
+			}
+		}
+		_last_row = row;
+		_cols.push_back(col);
+		_vals.push_back(val);
+		for (int r=row+1; r <= nrow; ++r) ++_row_start[r];
+	}
+};
+
+/** A SparseMatrix in compressed sparse row (CSR) format.  Gives fast,
+cache-friendly products with vectors (row-parallel for A x), and an
+O(nnz) transpose.  Usually made from a VectorSparseMatrix, after which
+it is generally used read-only.  It may also be filled with set() /
+add() (slowly), as long as elements come in row order.  Duplicate
+elements (from add()) are allowed, and are summed by the products.  Always has index_base=0. */
+class CsrSparseMatrix : public SparseMatrix1<CsrSparseMatrix0>
+{
+public:
+	/** Construct a new, empty sparse matrix to the given specifications. */
+	explicit CsrSparseMatrix(SparseDescr const &descr) :
+		SparseMatrix1<CsrSparseMatrix0>(descr) {}
+
+	/** Converts from coordinate format, by a (stable) counting sort on
+	rows.  Within each row, elements stay in the order they were in mat. */
+	explicit CsrSparseMatrix(VectorSparseMatrix const &mat);
+
+	/** Beginning of each row in cols() and vals() [nrow+1] */
+	std::vector<int> const &row_start() const { return _row_start; }
+	std::vector<int> const &cols() const { return _cols; }
+	std::vector<double> const &vals() const { return _vals; }
+
+	/** @return The transpose of this matrix (O(nnz), by counting sort).
+	Its rows come out with columns in increasing order. */
+	std::unique_ptr<CsrSparseMatrix> transpose() const;
+
+	/** Computes y = A * x, one row at a time, so each row is a
+	gather / dot product; rows are split between threads.
+	@param nthread Number of threads to use. */
+	void multiply(double const * x, double *y, bool clear_y, int nthread) const;
+
+	void multiply(double const * x, double *y, bool clear_y = true) const
+		{ multiply(x, y, clear_y, 1); }
+
+	/** Computes Y = A * X for nfield vectors at once, reading each
+	element of A once for all fields; rows are split between threads.
+	@see SparseMatrix::multiply_multi() */
+	void multiply_multi(double const *X, double *Y, int nfield, bool clear_y, int nthread) const;
+
+	void multiply_multi(double const *X, double *Y, int nfield, bool clear_y = true) const
+		{ multiply_multi(X, Y, nfield, clear_y, 1); }
+
+	/** Computes y = A^T * x by scattering each row.  To do this many
+	times, or in parallel, use multiply() on transpose() instead. */
+	void multiplyT(double const * x, double *y, bool clear_y = true) const;
+
+	/** Converts back to coordinate format (row-major order). */
+	std::unique_ptr<VectorSparseMatrix> to_vector() const;
+
+protected:
+	/** Splits rows into nthread ranges of about equal numbers of
+	elements: thread t gets rows [ret[t], ret[t+1]). */
+	std::vector<int> split_rows(int nthread) const;
+};
+// ====================================================================
+/** Compressed sparse column (CSC) view of a matrix B.  The CSC arrays
+of B are the same as the CSR arrays of B^T; so this just presents a
+CsrSparseMatrix holding B^T (eg: from CsrSparseMatrix::transpose())
+with rows and columns swapped.  Does not own its storage. */
+class CscView {
+	CsrSparseMatrix const &BT;
+public:
+	/** Number of rows in B */
+	int const nrow;
+	/** Number of columns in B */
+	int const ncol;
+
+	explicit CscView(CsrSparseMatrix const &_BT) :
+		BT(_BT), nrow(_BT.ncol), ncol(_BT.nrow) {}
+
+	/** Beginning of each column in row_indices() and vals() [ncol+1] */
+	std::vector<int> const &col_start() const { return BT.row_start(); }
+	std::vector<int> const &row_indices() const { return BT.cols(); }
+	std::vector<double> const &vals() const { return BT.vals(); }
+	size_t size() const { return BT.size(); }
+
+	/** Computes y = B * x (scatters each column). */
+	void multiply(double const * x, double *y, bool clear_y = true) const
+		{ BT.multiplyT(x, y, clear_y); }
+
+	/** Computes y = B^T * x (row-parallel on B^T). */
+	void multiplyT(double const * x, double *y, bool clear_y = true, int nthread = 1) const
+		{ BT.multiply(x, y, clear_y, nthread); }
+
+	/** Computes Y = B * X, for nfield vectors at once. */
+	void multiply_multi(double const *X, double *Y, int nfield, bool clear_y = true) const
+		{ BT.multiplyT_multi(X, Y, nfield, clear_y); }
+
+	/** Computes Y = B^T * X, for nfield vectors at once (row-parallel on B^T). */
+	void multiplyT_multi(double const *X, double *Y, int nfield, bool clear_y = true, int nthread = 1) const
+		{ BT.multiply_multi(X, Y, nfield, clear_y, nthread); }
+};
+
+}	// namespace giss
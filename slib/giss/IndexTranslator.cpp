@@ -16,22 +16,64 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdint>
 #include <giss/IndexTranslator.hpp>
 
 namespace giss {
 
-/** @param n Size of space a (runs [0...n-1])
-@param used Set of indices that are used in space a */
-void IndexTranslator::init(int size_a, std::set<int> const &used)
+/** Lists shorter than n / SPARSE_RATIO are compacted by sorting, and
+get a binary-search translator; longer ones use bitmaps / dense
+lookup tables over all of [0, n). */
+static size_t const SPARSE_RATIO = 32;
+
+void compact_indices(int n, std::vector<int> &used)
 {
+	if (used.size() * SPARSE_RATIO < (size_t)n) {
+		std::sort(used.begin(), used.end());
+		used.erase(std::unique(used.begin(), used.end()), used.end());
+		return;
+	}
+
+	// Mark used indices in a bitmap
+	std::vector<uint64_t> bits((n + 63) / 64, 0);
+	for (auto ii = used.begin(); ii != used.end(); ++ii) {
+		int const a = *ii;
+		if (a < 0 || a >= n) {
+			fprintf(stderr, "compact_indices(): a=%d is out of range (%d, %d)\n", a, 0, n);
+			throw std::exception();
+		}
+		bits[a >> 6] |= ((uint64_t)1) << (a & 63);
+	}
+
+	// Count, then list them in order
+	size_t nused = 0;
+	for (auto w = bits.begin(); w != bits.end(); ++w)
+		nused += __builtin_popcountll(*w);
+	used.resize(nused);
+	size_t ib = 0;
+	for (size_t iw = 0; iw < bits.size(); ++iw) {
+		for (uint64_t w = bits[iw]; w != 0; w &= w - 1)
+			used[ib++] = iw * 64 + __builtin_ctzll(w);
+	}
+}
+
+void IndexTranslator::init(int size_a, std::vector<int> &&used)
+{
+	compact_indices(size_a, used);
 printf("IndexTranslator::init(%s, size_a=%d, size_b=%ld)\n", _name.c_str(), size_a, used.size());
-	_a2b.clear(); _a2b.resize(size_a, -1);
-	_b2a.clear(); _b2a.reserve(used.size());
-	for (auto ia_ptr = used.begin(); ia_ptr != used.end(); ++ia_ptr) {
-		int ib = _b2a.size();
-		_b2a.push_back(*ia_ptr);
-		_a2b[*ia_ptr] = ib;
+	if (used.size() > 0 && (used.front() < 0 || used.back() >= size_a)) {
+		fprintf(stderr, "%s: used indices [%d, %d] out of range (%d, %d)\n", _name.c_str(), used.front(), used.back(), 0, size_a);
+		throw std::exception();
+	}
+
+	_na = size_a;
+	_b2a = std::move(used);
+	_a2b.clear();
+	if (_b2a.size() * SPARSE_RATIO >= (size_t)size_a) {
+		_a2b.resize(size_a, -1);
+		for (int ib = 0; ib < (int)_b2a.size(); ++ib) _a2b[_b2a[ib]] = ib;
 	}
+	_a2b.shrink_to_fit();
 }
 
 
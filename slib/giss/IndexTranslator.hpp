@@ -20,29 +20,56 @@
 
 #include <vector>
 #include <set>
+#include <algorithm>
 #include <cstdio>
 #include <string>
 
 namespace giss {
 
+/** Sorts a list of used indices in [0, n), and removes repeats.
+Long lists are compacted through a bitmap over [0, n), scanned in
+order (a prefix sum gives each index its place); short ones are
+just sorted.  No tree or hash nodes are allocated, so this is much
+cheaper than collecting indices in a std::set<int>.
+@param used IN: Indices, in any order, with repeats.  OUT: Sorted, unique. */
+void compact_indices(int n, std::vector<int> &used);
+
 /** Used to translated row and column matrix indices between spaces related by removal of dimensions. */
 class IndexTranslator {
 	std::string _name;	// For debugging
-	std::vector<int> _a2b;
-	std::vector<int> _b2a;
+	int _na;
+	std::vector<int> _a2b;		// Dense lookup; empty if sparse
+	std::vector<int> _b2a;		// Sorted
+
+	/** Looks up a in _b2a, when there's no dense _a2b.
+	@return -1 if a is not used. */
+	int sparse_a2b(int a) const {
+		auto ii(std::lower_bound(_b2a.begin(), _b2a.end(), a));
+		return (ii != _b2a.end() && *ii == a ? ii - _b2a.begin() : -1);
+	}
+
 public:
 	/** @param name Arbitrary name of the index to be translated, used for error messages. */
-	IndexTranslator(std::string const &name) : _name(name) {}
+	IndexTranslator(std::string const &name) : _name(name), _na(0) {}
 
 	/** Set up the translation.
 	Translation is done between indices in space A and space B.
-	@param n Size of space A (indices run [0...n-1])
-	@param used Set of indices that are used in space A.
-	Indices in space B run [0...used.size()-1]. */
-	void init(int size_a, std::set<int> const &used);
+	If enough of space A is used, a2b() is a dense lookup table;
+	otherwise (eg: one small subproblem of a big grid), a binary
+	search of the used indices.
+	@param size_a Size of space A (indices run [0...size_a-1])
+	@param used Indices that are used in space A, in any order and
+	    with repeats (see compact_indices()); moved out of.
+	Indices in space B run [0...nused-1], in the order of space A. */
+	void init(int size_a, std::vector<int> &&used);
+
+	/** Set up the translation from a std::set.
+	@see init(int, std::vector<int> &&) */
+	void init(int size_a, std::set<int> const &used)
+		{ init(size_a, std::vector<int>(used.begin(), used.end())); }
 
 	/** Size of space A. */
-	int na() const { return _a2b.size(); }
+	int na() const { return _na; }
 
 	/** Size of space B. */
 	int nb() const { return _b2a.size(); }
@@ -54,6 +81,10 @@ public:
 	@return The value in space B corresponding to input index a.  Or -1 if such a value does not exist. */
 	int a2b(int a, bool check_result = true) const;
 
+	/** Convert an index from space A to B, without any checks.
+	For inner loops; a must be a used index of space A. */
+	int a2b_unchecked(int a) const
+		{ return (_a2b.size() > 0 ? _a2b[a] : sparse_a2b(a)); }
 
 	/** Convert an index from space B to A.
 	@param b The source index, in space B.
@@ -61,16 +92,19 @@ public:
 	@param check_result If true, then throw an exception on a negative return.
 	@return The value in space A corresponding to input index b.  Or -1 if such a value does not exist. */
 	int b2a(int b, bool check_result = true) const;
+
+	/** Convert an index from space B to A, without any checks. */
+	int b2a_unchecked(int b) const { return _b2a[b]; }
 };
 
 
 
 inline int IndexTranslator::a2b(int a, bool check_result) const {
-	if (a < 0 || a >= _a2b.size()) {
-		fprintf(stderr, "a=%d is out of range (%d, %d)\n", a, 0, _a2b.size());
+	if (a < 0 || a >= _na) {
+		fprintf(stderr, "a=%d is out of range (%d, %d)\n", a, 0, _na);
 		throw std::exception();
 	}
-	int b = _a2b[a];
+	int b = a2b_unchecked(a);
 	if (check_result && b < 0) {
 		fprintf(stderr, "%s: a=%d produces invalid b=%d\n", _name.c_str(), a, b);
 		throw std::exception();
@@ -20,42 +20,74 @@
 
 namespace giss {
 
-/** @param n Size of space a (runs [0...n-1])
-@param used_a Set of indices that are used in space a */
-void IndexTranslator2::init(std::map<int, size_t> *size_a, std::set<std::pair<int,int>> const &used_a)
+/** @param size_a Size of space a, for each index
+@param used_a Indices that are used in space a */
+void IndexTranslator2::init(std::map<int, size_t> const &size_a, std::vector<std::pair<int,int>> const &used_a)
 {
 
-printf("IndexTranslator2::init(%s, size_a=%d, size_b=%ld)\n", _name.c_str(), size_a->begin()->second, used_a.size());
+printf("IndexTranslator2::init(%s, nindex=%ld, size_b=%ld)\n", _name.c_str(), size_a.size(), used_a.size());
 
-	_size_a = size_a;
-	_a2b.clear();
-	_b2a.clear(); _b2a.reserve(used_a.size());
+	// Lay the indices of space A end to end, in order
+	_base.clear();
+	_size.clear();
+	_indices.clear();
+	if (size_a.size() > 0) {
+		if (size_a.begin()->first < 0) {
+			fprintf(stderr, "%s: index %d is negative\n", _name.c_str(), size_a.begin()->first);
+			throw std::exception();
+		}
+		_base.resize(size_a.rbegin()->first + 1, -1);
+		_size.resize(_base.size(), 0);
+	}
+	int na_flat = 0;
+	for (auto ii = size_a.begin(); ii != size_a.end(); ++ii) {
+		_base[ii->first] = na_flat;
+		_size[ii->first] = ii->second;
+		_indices.push_back(ii->first);
+		na_flat += ii->second;
+	}
+
+	std::vector<int> used_flat;
+	used_flat.reserve(used_a.size());
 	for (auto ia_ptr = used_a.begin(); ia_ptr != used_a.end(); ++ia_ptr) {
-		int ib = _b2a.size();
-		_b2a.push_back(*ia_ptr);
-		_a2b[*ia_ptr] = ib;
+		if (ia_ptr->second < 0 || ia_ptr->second >= na(ia_ptr->first)) {
+			fprintf(stderr, "%s: a=(%d,%d) is out of range\n", _name.c_str(), ia_ptr->first, ia_ptr->second);
+			throw std::exception();
+		}
+		used_flat.push_back(flatten(*ia_ptr));
+	}
+	_flat.init(na_flat, std::move(used_flat));
+
+	// Unflatten, for b2a()
+	_b2a.clear(); _b2a.reserve(_flat.nb());
+	int k = 0;		// Position in _indices
+	for (int ib=0; ib < _flat.nb(); ++ib) {
+		int const ia = _flat.b2a_unchecked(ib);
+		while (ia >= _base[_indices[k]] + _size[_indices[k]]) ++k;
+		int const index = _indices[k];
+		_b2a.push_back(std::make_pair(index, ia - _base[index]));
 	}
 }
 
 
 int IndexTranslator2::a2b(std::pair<int,int> a, bool check_result) const {
 	int aindex = a.first;
-	if (aindex < 0 || aindex >= nindex()) {
-		fprintf(stderr, "%s: aindex=%d is out of range (%d, %d)\n", _name.c_str(), aindex, 0, nindex());
+	if (aindex < 0 || aindex >= nindex() || _base[aindex] < 0) {
+		fprintf(stderr, "%s: aindex=%d is not in space A\n", _name.c_str(), aindex);
 		throw std::exception();
 	}
 
 	int agrid = a.second;
 	if (agrid < 0 || agrid >= na(aindex)) {
-		fprintf(stderr, "%s: a=%d is out of range (%d, %d)\n", _name.c_str(), a, 0, na(aindex));
+		fprintf(stderr, "%s: a=%d is out of range (%d, %d)\n", _name.c_str(), agrid, 0, na(aindex));
 		throw std::exception();
 	}
-	auto ib = _a2b.find(a);
-	if (check_result && ib == _a2b.end()) {
+	int ib = a2b_unchecked(a);
+	if (check_result && ib < 0) {
 		fprintf(stderr, "%s: a=(%d,%d) not found\n", _name.c_str(), a.first, a.second);
 		throw std::exception();
 	}
-	return ib->second;
+	return ib;
 }
 
 
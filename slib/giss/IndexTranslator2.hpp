@@ -23,8 +23,7 @@
 #include <set>
 #include <cstdio>
 #include <map>
-#include <unordered_map>
-#include <giss/hash.hpp>
+#include <giss/IndexTranslator.hpp>
 
 namespace giss {
 
@@ -35,25 +34,46 @@ B is one-dimensional (<i>i</i>).  Doing this with a template for the
 general case was not deemed worth the effort at the time. */
 class IndexTranslator2 {
 	std::string _name;	// For debugging
-	std::map<int, size_t> *_size_a;
-	std::unordered_map<std::pair<int,int>, int, giss::HashPair<int,int>> _a2b;
+	/** Space A, flattened: (index, i) --> _base[index] + i.
+	Indices not given to init() have _base = -1.
+	(The sizes are copied in here, so the translator does not depend
+	on the size_a map given to init() staying alive.) */
+	std::vector<int> _base;
+	std::vector<int> _size;
+	/** Indices given to init(), in order (and so in order of _base) */
+	std::vector<int> _indices;
+	IndexTranslator _flat;
 	std::vector<std::pair<int,int>> _b2a;
+
+	int flatten(std::pair<int,int> const &a) const
+		{ return _base[a.first] + a.second; }
 public:
-	IndexTranslator2(std::string const &name) : _name(name) {}
+	IndexTranslator2(std::string const &name) : _name(name), _flat(name) {}
 
 	/** Set up the translation.
 	Translation is done between indices in space A and space B.
-	@param n Size of space A (indices run [0...n-1])
-	@param used Set of indices that are used in space A.
-	Indices in space B run [0...used.size()-1]. */
+	@param size_a Size of space A, for each index.  Indices need not
+	    be contiguous (eg: just some of the ice sheets), but must be >= 0.
+	    Only read during init().
+	@param used_a Indices that are used in space A, in any order and
+	    with repeats.
+	Indices in space B run [0...nused-1], in the order of space A. */
+	void init(
+		std::map<int, size_t> const &size_a,
+		std::vector<std::pair<int,int>> const &used_a);
+
+	/** Set up the translation from a std::set. */
 	void init(
-		std::map<int, size_t> *size_a,
-		std::set<std::pair<int,int>> const &used_a);
+		std::map<int, size_t> const &size_a,
+		std::set<std::pair<int,int>> const &used_a)
+	{ init(size_a, std::vector<std::pair<int,int>>(used_a.begin(), used_a.end())); }
 
-	size_t nindex() const { return _size_a->size(); }
+	/** @return One more than the largest index of space A */
+	size_t nindex() const { return _base.size(); }
 
-	/** Size of space A. */
-	size_t na(int index) const { return _size_a->at(index); }
+	/** Size of space A for an index (0 if it was not given to init()). */
+	size_t na(int index) const
+		{ return (index < 0 || index >= nindex() ? 0 : _size[index]); }
 
 	/** Size of space B. */
 	size_t nb() const { return _b2a.size(); }
@@ -65,6 +85,11 @@ public:
 	@return The value in space B corresponding to input index a.  Or -1 if such a value does not exist. */
 	int a2b(std::pair<int,int> a, bool check_result = true) const;
 
+	/** Convert an index from space A to B, without any checks.
+	For inner loops; a must be a used index of space A. */
+	int a2b_unchecked(std::pair<int,int> const &a) const
+		{ return _flat.a2b_unchecked(flatten(a)); }
+
 	/** Convert an index from space B to A.
 	@param b The source index, in space B.
 	Input b must be in the range [0...nb()-1], or an exception will be thrown.
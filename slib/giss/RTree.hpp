@@ -28,6 +28,9 @@
 #include <math.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
 #include <boost/function.hpp>
 
 namespace giss {
@@ -42,7 +45,7 @@ namespace giss {
 #define RTREE_TEMPLATE template<class DATATYPE, class ELEMTYPE, int NUMDIMS, class ELEMTYPEREAL, int TMAXNODES, int TMINNODES>
 #define RTREE_QUAL RTree<DATATYPE, ELEMTYPE, NUMDIMS, ELEMTYPEREAL, TMAXNODES, TMINNODES>
 
-#define RTREE_DONT_USE_MEMPOOLS // This version does not contain a fixed memory allocator, fill in lines with EXAMPLE to implement one.
+//#define RTREE_DONT_USE_MEMPOOLS // Nodes are allocated from a pool of contiguous chunks (see AllocNode())
 #define RTREE_USE_SPHERICAL_VOLUME // Better split classification, may be slower on some systems
 
 // Fwd decl
@@ -96,6 +99,16 @@ public:
   /// \param a_max Max of bounding rect
   /// \param a_dataId Positive Id of data.  Maybe zero, but negative numbers not allowed.
   void Insert(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], const DATATYPE& a_dataId);
+
+  /// Replace the contents of the tree with a packed tree built in one pass
+  /// using Sort-Tile-Recursive (STR) bulk loading.  Much faster than
+  /// repeated Insert(), and the tree shape does not depend on the order
+  /// entries are given (except for ties).  Insert() and Remove() may
+  /// still be used afterwards.
+  /// \param a_min Min of bounding rects [a_dataId.size() * NUMDIMS]
+  /// \param a_max Max of bounding rects [a_dataId.size() * NUMDIMS]
+  /// \param a_dataId Ids of data.
+  void BulkLoad(std::vector<ELEMTYPE> const &a_min, std::vector<ELEMTYPE> const &a_max, std::vector<DATATYPE> const &a_dataId);
   
   /// Remove entry
   /// \param a_min Min of bounding rect
@@ -110,6 +123,30 @@ public:
   /// \param a_resultCallback Callback function to return result.  Callback should return 'true' to continue searching
   /// \return Returns the number of entries found
   int Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], RTree::Callback const &a_resultCallback);
+
+  /// Find all within search rectangle, calling any callable (lambda,
+  /// functor, boost::bind() result...) directly; it can be inlined,
+  /// unlike RTree::Callback.  Results come in the same order as the
+  /// boost::function version.
+  /// \param a_visitor Called as a_visitor(DATATYPE id).  Should return 'true' to continue searching
+  /// \return Returns the number of entries found
+  template<class Visitor>
+  int Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], Visitor &&a_visitor);
+
+  /// Run many searches at once.  Queries are run in the order given by
+  /// BatchOrder(), so consecutive queries touch nearby parts of the tree.
+  /// \param a_count Number of queries
+  /// \param a_min Min of search bounding rects [a_count * NUMDIMS]
+  /// \param a_max Max of search bounding rects [a_count * NUMDIMS]
+  /// \param a_visitor Called as a_visitor(int query, DATATYPE id).  Returning 'false' ends that query only.
+  /// \return Returns the total number of entries found
+  template<class Visitor>
+  long SearchBatch(int a_count, const ELEMTYPE* a_min, const ELEMTYPE* a_max, Visitor &&a_visitor);
+
+  /// Order in which SearchBatch() runs its queries: sorted along a
+  /// Z-order (Morton) curve through the centers of the query rects.
+  /// Ties keep their original order, so the result is deterministic.
+  static std::vector<int> BatchOrder(int a_count, const ELEMTYPE* a_min, const ELEMTYPE* a_max);
   
   /// Remove all entries from tree
   void RemoveAll();
@@ -372,17 +409,27 @@ protected:
   bool RemoveRectRec(Rect* a_rect, const DATATYPE& a_id, Node* a_node, ListNode** a_listNode);
   ListNode* AllocListNode();
   void FreeListNode(ListNode* a_listNode);
-  bool Overlap(Rect* a_rectA, Rect* a_rectB);
+  bool Overlap(const Rect* a_rectA, const Rect* a_rectB);
   void ReInsert(Node* a_node, ListNode** a_listNode);
-  bool Search(Node* a_node, Rect* a_rect, int& a_foundCount, RTree::Callback const &a_resultCallback);
+  template<class Visitor>
+  int SearchRect(const Rect& a_rect, Visitor& a_visitor);
   void RemoveAllRec(Node* a_node);
   void Reset();
   void CountRec(Node* a_node, int& a_count);
 
   bool SaveRec(Node* a_node, RTFileStream& a_stream);
   bool LoadRec(Node* a_node, RTFileStream& a_stream);
+
+  void StrOrder(Branch* a_branch, int a_count, int a_dim);
   
   Node* m_root;                                    ///< Root of tree
+
+#ifndef RTREE_DONT_USE_MEMPOOLS
+  enum { NODE_CHUNK = 1024 };                      ///< Nodes per pool chunk
+  std::vector<std::unique_ptr<Node[]>> m_nodeChunks; ///< Node pool
+  int m_nodeChunkUsed;                             ///< Nodes used in the last chunk
+  std::vector<Node*> m_freeNodes;                  ///< Nodes freed back to the pool
+#endif
   ELEMTYPEREAL m_unitSphereVolume;                 ///< Unit sphere constant for required number of dimensions
 };
 
@@ -488,6 +535,9 @@ RTREE_QUAL::RTree()
     0.082146f, 0.046622f, 0.025807f, // Dimension  18,19,20 
   };
 
+#ifndef RTREE_DONT_USE_MEMPOOLS
+  m_nodeChunkUsed = NODE_CHUNK;
+#endif
   m_root = AllocNode();
   m_root->m_level = 0;
   m_unitSphereVolume = (ELEMTYPEREAL)UNIT_SPHERE_VOLUMES[NUMDIMS];
@@ -523,6 +573,84 @@ void RTREE_QUAL::Insert(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMD
 }
 
 
+// Orders branches for STR packing: consecutive groups of MAXNODES
+// branches form tiles of nearby rectangles.
+RTREE_TEMPLATE
+void RTREE_QUAL::StrOrder(Branch* a_branch, int a_count, int a_dim)
+{
+  // Sort by center along this dimension
+  std::sort(a_branch, a_branch + a_count, [a_dim](Branch const &a, Branch const &b)
+    { return (a.m_rect.m_min[a_dim] + a.m_rect.m_max[a_dim]) < (b.m_rect.m_min[a_dim] + b.m_rect.m_max[a_dim]); });
+
+  if(a_dim == NUMDIMS-1 || a_count <= MAXNODES)
+  {
+    return;
+  }
+
+  // Cut into slabs, and tile each slab along the remaining dimensions
+  int numNodes = (a_count + MAXNODES - 1) / MAXNODES;
+  int numSlabs = (int)ceil(pow((double)numNodes, 1.0 / (double)(NUMDIMS - a_dim)));
+  int slabSize = MAXNODES * ((numNodes + numSlabs - 1) / numSlabs);
+  for(int index=0; index < a_count; index += slabSize)
+  {
+    StrOrder(a_branch + index, std::min(slabSize, a_count - index), a_dim+1);
+  }
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::BulkLoad(std::vector<ELEMTYPE> const &a_min, std::vector<ELEMTYPE> const &a_max, std::vector<DATATYPE> const &a_dataId)
+{
+  RemoveAll();
+  int count = a_dataId.size();
+  if(count == 0)
+  {
+    return;
+  }
+
+  // Data branches for the leaves
+  std::vector<Branch> branches(count);
+  for(int i=0; i<count; ++i)
+  {
+    for(int axis=0; axis<NUMDIMS; ++axis)
+    {
+      branches[i].m_rect.m_min[axis] = a_min[i*NUMDIMS + axis];
+      branches[i].m_rect.m_max[axis] = a_max[i*NUMDIMS + axis];
+    }
+    branches[i].m_data = a_dataId[i];
+  }
+
+  // Pack one level at a time, from the leaves up
+  FreeNode(m_root);
+  for(int level=0; ; ++level)
+  {
+    StrOrder(&branches[0], branches.size(), 0);
+
+    std::vector<Branch> parents;
+    parents.reserve((branches.size() + MAXNODES - 1) / MAXNODES);
+    for(size_t i=0; i < branches.size(); i += MAXNODES)
+    {
+      Node* node = AllocNode();
+      node->m_level = level;
+      node->m_count = std::min((size_t)MAXNODES, branches.size() - i);
+      std::copy(&branches[i], &branches[i] + node->m_count, node->m_branch);
+
+      Branch parent;
+      parent.m_rect = NodeCover(node);
+      parent.m_child = node;
+      parents.push_back(parent);
+    }
+
+    if(parents.size() == 1)
+    {
+      m_root = parents[0].m_child;
+      return;
+    }
+    branches.swap(parents);
+  }
+}
+
+
 RTREE_TEMPLATE
 void RTREE_QUAL::Remove(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], const DATATYPE& a_dataId)
 {
@@ -565,9 +693,93 @@ int RTREE_QUAL::Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDI
 
   // NOTE: May want to return search result another way, perhaps returning the number of found elements here.
 
-  int foundCount = 0;
-  Search(m_root, &rect, foundCount, a_resultCallback);
+  return SearchRect(rect, a_resultCallback);
+}
+
 
+RTREE_TEMPLATE
+template<class Visitor>
+int RTREE_QUAL::Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], Visitor &&a_visitor)
+{
+  Rect rect;
+  for(int axis=0; axis<NUMDIMS; ++axis)
+  {
+    rect.m_min[axis] = a_min[axis];
+    rect.m_max[axis] = a_max[axis];
+  }
+
+  return SearchRect(rect, a_visitor);
+}
+
+
+RTREE_TEMPLATE
+std::vector<int> RTREE_QUAL::BatchOrder(int a_count, const ELEMTYPE* a_min, const ELEMTYPE* a_max)
+{
+  enum { BITS = 63 / NUMDIMS };                   // Bits per dimension in Morton key
+
+  std::vector<int> order(a_count);
+  for(int i=0; i<a_count; ++i)
+  {
+    order[i] = i;
+  }
+  if(a_count == 0)
+  {
+    return order;
+  }
+
+  // Range of query centers
+  double lo[NUMDIMS], scale[NUMDIMS];
+  for(int axis=0; axis<NUMDIMS; ++axis)
+  {
+    double cmin = (double)a_min[axis] + (double)a_max[axis];
+    double cmax = cmin;
+    for(int i=1; i<a_count; ++i)
+    {
+      double c = (double)a_min[i*NUMDIMS + axis] + (double)a_max[i*NUMDIMS + axis];
+      cmin = std::min(cmin, c);
+      cmax = std::max(cmax, c);
+    }
+    lo[axis] = cmin;
+    scale[axis] = (cmax > cmin ? (double)((1ULL << BITS) - 1) / (cmax - cmin) : 0.);
+  }
+
+  // Interleave bits of the quantized centers
+  std::vector<unsigned long long> keys(a_count);
+  for(int i=0; i<a_count; ++i)
+  {
+    unsigned long long key = 0;
+    for(int axis=0; axis<NUMDIMS; ++axis)
+    {
+      double c = (double)a_min[i*NUMDIMS + axis] + (double)a_max[i*NUMDIMS + axis];
+      unsigned long long q = (unsigned long long)((c - lo[axis]) * scale[axis]);
+      for(int bit=0; bit<BITS; ++bit)
+      {
+        key |= ((q >> bit) & 1ULL) << (bit*NUMDIMS + axis);
+      }
+    }
+    keys[i] = key;
+  }
+
+  std::stable_sort(order.begin(), order.end(), [&keys](int a, int b)
+    { return keys[a] < keys[b]; });
+  return order;
+}
+
+
+RTREE_TEMPLATE
+template<class Visitor>
+long RTREE_QUAL::SearchBatch(int a_count, const ELEMTYPE* a_min, const ELEMTYPE* a_max, Visitor &&a_visitor)
+{
+  std::vector<int> order(BatchOrder(a_count, a_min, a_max));
+
+  long foundCount = 0;
+  for(auto ii = order.begin(); ii != order.end(); ++ii)
+  {
+    int const query = *ii;
+    auto visitor = [&a_visitor, query](DATATYPE id) -> bool
+      { return a_visitor(query, id); };
+    foundCount += Search(&a_min[query*NUMDIMS], &a_max[query*NUMDIMS], visitor);
+  }
   return foundCount;
 }
 
@@ -802,7 +1014,9 @@ void RTREE_QUAL::Reset()
   RemoveAllRec(m_root);
 #else // RTREE_DONT_USE_MEMPOOLS
   // Just reset memory pools.  We are not using complex types
-  // EXAMPLE
+  m_nodeChunks.clear();
+  m_nodeChunkUsed = NODE_CHUNK;
+  m_freeNodes.clear();
 #endif // RTREE_DONT_USE_MEMPOOLS
 }
 
@@ -831,7 +1045,20 @@ typename RTREE_QUAL::Node* RTREE_QUAL::AllocNode()
 #ifdef RTREE_DONT_USE_MEMPOOLS
   newNode = new Node;
 #else // RTREE_DONT_USE_MEMPOOLS
-  // EXAMPLE
+  if(!m_freeNodes.empty())
+  {
+    newNode = m_freeNodes.back();
+    m_freeNodes.pop_back();
+  }
+  else
+  {
+    if(m_nodeChunkUsed == NODE_CHUNK)
+    {
+      m_nodeChunks.push_back(std::unique_ptr<Node[]>(new Node[NODE_CHUNK]));
+      m_nodeChunkUsed = 0;
+    }
+    newNode = &m_nodeChunks.back()[m_nodeChunkUsed++];
+  }
 #endif // RTREE_DONT_USE_MEMPOOLS
   InitNode(newNode);
   return newNode;
@@ -846,7 +1073,7 @@ void RTREE_QUAL::FreeNode(Node* a_node)
 #ifdef RTREE_DONT_USE_MEMPOOLS
   delete a_node;
 #else // RTREE_DONT_USE_MEMPOOLS
-  // EXAMPLE
+  m_freeNodes.push_back(a_node);
 #endif // RTREE_DONT_USE_MEMPOOLS
 }
 
@@ -856,22 +1083,15 @@ void RTREE_QUAL::FreeNode(Node* a_node)
 RTREE_TEMPLATE
 typename RTREE_QUAL::ListNode* RTREE_QUAL::AllocListNode()
 {
-#ifdef RTREE_DONT_USE_MEMPOOLS
+  // Only used when removing; not worth pooling
   return new ListNode;
-#else // RTREE_DONT_USE_MEMPOOLS
-  // EXAMPLE
-#endif // RTREE_DONT_USE_MEMPOOLS
 }
 
 
 RTREE_TEMPLATE
 void RTREE_QUAL::FreeListNode(ListNode* a_listNode)
 {
-#ifdef RTREE_DONT_USE_MEMPOOLS
   delete a_listNode;
-#else // RTREE_DONT_USE_MEMPOOLS
-  // EXAMPLE
-#endif // RTREE_DONT_USE_MEMPOOLS
 }
 
 
@@ -1532,7 +1752,7 @@ bool RTREE_QUAL::RemoveRectRec(Rect* a_rect, const DATATYPE& a_id, Node* a_node,
 
 // Decide whether two rectangles overlap.
 RTREE_TEMPLATE
-bool RTREE_QUAL::Overlap(Rect* a_rectA, Rect* a_rectB)
+bool RTREE_QUAL::Overlap(const Rect* a_rectA, const Rect* a_rectB)
 {
   ASSERT(a_rectA && a_rectB);
 
@@ -1562,49 +1782,52 @@ void RTREE_QUAL::ReInsert(Node* a_node, ListNode** a_listNode)
 }
 
 
-// Search in an index tree or subtree for all data retangles that overlap the argument rectangle.
+// Search in an index tree, without recursion.  Children are pushed in
+// reverse so results come out in depth-first, left-to-right order.
 RTREE_TEMPLATE
-bool RTREE_QUAL::Search(Node* a_node, Rect* a_rect, int& a_foundCount, RTree::Callback const &a_resultCallback)
+template<class Visitor>
+int RTREE_QUAL::SearchRect(const Rect& a_rect, Visitor& a_visitor)
 {
-  ASSERT(a_node);
-  ASSERT(a_node->m_level >= 0);
-  ASSERT(a_rect);
+  // Depth is at most log_MINNODES(count); each level holds < MAXNODES pending
+  enum { STACK_SIZE = 64 * MAXNODES };
+  Node* stack[STACK_SIZE];
+  int top = 0;
+  int foundCount = 0;
 
-  if(a_node->IsInternalNode()) // This is an internal node in the tree
+  stack[top++] = m_root;
+  while(top > 0)
   {
-    for(int index=0; index < a_node->m_count; ++index)
+    Node* node = stack[--top];
+    ASSERT(node->m_level >= 0);
+
+    if(node->IsInternalNode()) // This is an internal node in the tree
     {
-      if(Overlap(a_rect, &a_node->m_branch[index].m_rect))
+      for(int index=node->m_count-1; index >= 0; --index)
       {
-        if(!Search(a_node->m_branch[index].m_child, a_rect, a_foundCount, a_resultCallback))
+        if(Overlap(&a_rect, &node->m_branch[index].m_rect))
         {
-          return false; // Don't continue searching
+          ASSERT(top < STACK_SIZE);
+          stack[top++] = node->m_branch[index].m_child;
         }
       }
     }
-  }
-  else // This is a leaf node
-  {
-    for(int index=0; index < a_node->m_count; ++index)
+    else // This is a leaf node
     {
-      if(Overlap(a_rect, &a_node->m_branch[index].m_rect))
+      for(int index=0; index < node->m_count; ++index)
       {
-        DATATYPE& id = a_node->m_branch[index].m_data;
-        
-        // NOTE: There are different ways to return results.  Here's where to modify
-        if(&a_resultCallback)
+        if(Overlap(&a_rect, &node->m_branch[index].m_rect))
         {
-          ++a_foundCount;
-          if(!a_resultCallback(id))
+          ++foundCount;
+          if(!a_visitor(node->m_branch[index].m_data))
           {
-            return false; // Don't continue searching
+            return foundCount; // Don't continue searching
           }
         }
       }
     }
   }
 
-  return true; // Continue searching
+  return foundCount;
 }
 
 
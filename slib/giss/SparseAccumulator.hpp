@@ -19,6 +19,9 @@
 #pragma once
 
 #include <unordered_map>
+#include <vector>
+#include <cstdio>
+#include <iostream>
 #include <giss/hash.hpp>
 
 namespace giss {
@@ -72,17 +75,122 @@ public :
 
 };
 
-template<class SparseMatrixT>
+/** A SparseAccumulator for integer indices with a known bound
+[0, n), such as GCM grid cells.  Instead of hashing, each index is
+looked up in a dense slot table; the <index, value> pairs themselves
+are kept in a list, in the order they were first touched.  So add()
+is O(1) without node allocations, while iteration, size() and clear()
+only cost as much as the number of touched indices.
+
+Has the same add() / set() / operator[] / iteration API as
+SparseAccumulator, so it may be used in its place.  The slot table
+grows on demand if an index beyond the bound is added.
+@see SparseAccumulator */
+template<class IndexT, class AccumT>
+class DenseAccumulator {
+	/** Touched <index, value> pairs */
+	std::vector<std::pair<IndexT, AccumT>> _entries;
+	/** index --> position in _entries, or -1 if not touched */
+	std::vector<int> _slot;
+
+	/** @return Position of index in _entries, or -1 if not there. */
+	int slot(IndexT const &index) const {
+		if (index < 0 || index >= _slot.size()) return -1;
+		return _slot[index];
+	}
+
+	/** Finds or creates the entry for an index, initialized to zero. */
+	std::pair<IndexT, AccumT> &touch(IndexT const &index) {
+		if (index < 0) {
+			fprintf(stderr, "DenseAccumulator: index=%ld is negative\n", (long)index);
+			throw std::exception();
+		}
+		if (index >= _slot.size()) _slot.resize(index+1, -1);
+		int &s(_slot[index]);
+		if (s < 0) {
+			s = _entries.size();
+			_entries.push_back(std::make_pair(index, AccumT()));
+		}
+		return _entries[s];
+	}
+
+public:
+	typedef std::pair<IndexT, AccumT> value_type;
+	typedef typename std::vector<value_type>::iterator iterator;
+	typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+	/** @param bound Indices are expected to lie in [0, bound) */
+	explicit DenseAccumulator(IndexT bound = 0) : _slot(bound, -1) {}
+
+	/** Inserts a new <index, value> pair to sparse vector.  If that
+	element was already non-zero, adds to it. */
+	void add(IndexT const &index, AccumT const &val)
+		{ touch(index).second += val; }
+
+	/** Inserts a new <index, value> pair to sparse vector.  If that
+	element was already non-zero, replaces to it. */
+	void set(IndexT const &index, AccumT const &val)
+		{ touch(index).second = val; }
+
+	/** Looks up a value in the sparse index by index.  Throws an
+	exception if the index does not exist. */
+	AccumT &operator[](IndexT const &index) {
+		int s = slot(index);
+		if (s < 0) {
+			std::cout << "DenseAccumulator[" << index << "] doesn't exist" << std::endl;
+			throw std::exception();
+		}
+		return _entries[s].second;
+	}
+
+	/** Looks up a value in the sparse index by index.  Throws an
+	exception if the index does not exist. */
+	AccumT const &operator[](IndexT const &index) const {
+		int s = slot(index);
+		if (s < 0) throw std::exception();
+		return _entries[s].second;
+	}
+
+	iterator find(IndexT const &index) {
+		int s = slot(index);
+		return (s < 0 ? end() : begin() + s);
+	}
+	const_iterator find(IndexT const &index) const {
+		int s = slot(index);
+		return (s < 0 ? end() : begin() + s);
+	}
+	size_t count(IndexT const &index) const
+		{ return (slot(index) < 0 ? 0 : 1); }
+
+	/** Number of touched indices */
+	size_t size() const { return _entries.size(); }
+	bool empty() const { return _entries.empty(); }
+
+	/** Removes all elements; O(size()), and keeps the slot table. */
+	void clear() {
+		for (auto ii = _entries.begin(); ii != _entries.end(); ++ii)
+			_slot[ii->first] = -1;
+		_entries.clear();
+	}
+
+	/** Iterates over touched elements, in the order first touched. */
+	iterator begin() { return _entries.begin(); }
+	iterator end() { return _entries.end(); }
+	const_iterator begin() const { return _entries.begin(); }
+	const_iterator end() const { return _entries.end(); }
+};
+
+template<class SparseMatrixT, class AccumulatorT>
 inline void accum_per_row(SparseMatrixT const &mat,
-	SparseAccumulator<int,double> &accum)
+	AccumulatorT &accum)
 {
 	for (auto ii = mat.begin(); ii != mat.end(); ++ii)
 		accum.add(ii.row(), ii.val());
 }
 
-template<class SparseMatrixT>
+template<class SparseMatrixT, class AccumulatorT>
 inline void accum_per_col(SparseMatrixT const &mat,
-	SparseAccumulator<int,double> &accum)
+	AccumulatorT &accum)
 {
 	for (auto ii = mat.begin(); ii != mat.end(); ++ii)
 		accum.add(ii.col(), ii.val());
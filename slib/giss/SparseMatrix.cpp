@@ -16,109 +16,279 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdint>
 #include <netcdfcpp.h>
+#include <boost/thread.hpp>
 #include <giss/SparseMatrix.hpp>
 
 namespace giss {
 
 
 // -------------------------------------------------------
-struct CmpIndex2 {
-	int *index1;
-	int *index2;
-public:
-	void init(int *_index1, int *_index2) {
-		index1 = _index1;
-		index2 = _index2;
+/** Appends a batch with the given index base (of rows and cols). */
+static void zd11_append_bulk(ZD11SparseMatrix0 &zmat, int &nnz_cur,
+	int n, int const *rows, int const *cols, double const *vals, int base)
+{
+	galahad::zd11_c &zd11(zmat.zd11());
+	switch(zmat.triangular_type) {
+		case SparseMatrix::TriangularType::UPPER : {
+			// Rare; validate the batch, then mirror one at a time
+			int k0 = nnz_cur;
+			zd11.fill_coo(k0, n, rows, cols, vals, base);
+			for (int k=k0; k<k0+n; ++k)
+				if (zd11.row[k] > zd11.col[k]) std::swap(zd11.row[k], zd11.col[k]);
+		} break;
+		case SparseMatrix::TriangularType::LOWER :
+			zd11.fill_coo(nnz_cur, n, rows, cols, vals, base, true);
+		break;
+		default :
+			zd11.fill_coo(nnz_cur, n, rows, cols, vals, base);
+		break;
 	}
-	bool operator()(int i, int j)
-	{
-		if (index1[i] < index1[j]) return true;
-		if (index1[i] > index1[j]) return false;
-		return (index2[i] < index2[j]);
+	nnz_cur += n;
+}
+
+void ZD11SparseMatrix0::append_bulk(int n, int const *rows, int const *cols, double const *vals)
+	{ zd11_append_bulk(*this, _nnz_cur, n, rows, cols, vals, 0); }
+
+void ZD11SparseMatrix0::append_bulk(VectorSparseMatrix const &mat)
+{
+	if (mat.nrow != nrow || mat.ncol != ncol) {
+		fprintf(stderr, "ZD11SparseMatrix::append_bulk() has wrong size argument (%d, %d) vs. (%d, %d) expected\n", mat.nrow, mat.ncol, nrow, ncol);
+		throw std::exception();
 	}
+	int n = mat.size();
+	if (n == 0) return;
+	zd11_append_bulk(*this, _nnz_cur, n,
+		&mat.rows()[0], &mat.cols()[0], &mat.vals()[0], mat.index_base);
+}
+
+// -------------------------------------------------------
+// Radix sort for VectorSparseMatrix::sort() and sum_duplicates()
+
+namespace {
+
+/** A matrix element, with (major, minor) index packed into one key */
+struct KeyVal {
+	uint64_t key;
+	double val;
 };
 
-void VectorSparseMatrix::sort(SparseMatrix::SortOrder sort_order)
+/** Widest digit for the radix sort: 8192 buckets, whose counts still
+fit in L2 cache.  Keys are split into as few digits as that allows. */
+int const MAX_DIGIT_BITS = 13;
+
+/** Below this many elements, sort on one thread */
+size_t const PARALLEL_SORT_MIN = 1 << 20;
+
+/** One scatter pass of LSD radix sort, from src to dst.
+@param offset Where each digit (of this pass) starts in dst, for
+    each thread's chunk of src [nthread][ndigit]; advanced as
+    elements are placed.  Chunks are placed in order, so the sort is
+    stable. */
+void radix_scatter(std::vector<KeyVal> const &src, std::vector<KeyVal> &dst,
+	int shift, uint64_t mask,
+	std::vector<size_t> const &chunk,
+	std::vector<std::vector<size_t>> &offset)
 {
-printf("VectorSparseMatrix::sort(%d, %ld)\n", sort_order, size());
-	// Decide on how we'll sort
-	CmpIndex2 cmp;
-	switch(sort_order) {
-		case SparseMatrix::SortOrder::COLUMN_MAJOR :
-			cmp.init(&jndx[0], &indx[0]);
-		break;
-		default :
-			cmp.init(&indx[0], &jndx[0]);
-		break;
+	int const nthread = chunk.size() - 1;
+	auto scatter = [&](int t) {
+		size_t *o = &offset[t][0];
+		for (size_t i=chunk[t]; i<chunk[t+1]; ++i)
+			dst[o[(src[i].key >> shift) & mask]++] = src[i];
+	};
+
+	if (nthread == 1) {
+		scatter(0);
+	} else {
+		boost::thread_group threads;
+		for (int t=0; t<nthread; ++t)
+			threads.create_thread(boost::bind<void>(scatter, t));
+		threads.join_all();
+	}
+}
+
+/** Turns digit counts into starting offsets: by digit, then by thread.
+@return false if all elements have the same digit (pass can be skipped). */
+bool counts_to_offsets(std::vector<std::vector<size_t>> &count, size_t n)
+{
+	int const nthread = count.size();
+	int const ndigit = count[0].size();
+	size_t pos = 0;
+	for (int d=0; d<ndigit; ++d) {
+		size_t total = 0;
+		for (int t=0; t<nthread; ++t) {
+			size_t const c = count[t][d];
+			count[t][d] = pos + total;
+			total += c;
+		}
+		if (total == n) return false;
+		pos += total;
+	}
+	return true;
+}
+
+/** LSD radix sort of kv by key; tmp is scratch space.
+@param key_bits Number of low bits of the keys that are used. */
+void radix_sort(std::vector<KeyVal> &kv, std::vector<KeyVal> &tmp,
+	int key_bits, int nthread)
+{
+	size_t const n = kv.size();
+	if (key_bits == 0) return;
+	int const npass = (key_bits + MAX_DIGIT_BITS - 1) / MAX_DIGIT_BITS;
+	int const digit_bits = (key_bits + npass - 1) / npass;
+	int const ndigit = 1 << digit_bits;
+	uint64_t const mask = ndigit - 1;
+	tmp.resize(n);
+
+	std::vector<size_t> chunk(nthread+1);
+	for (int t=0; t<=nthread; ++t) chunk[t] = (n * t) / nthread;
+
+	if (nthread == 1) {
+		// Histogram every digit in a single read of the keys
+		std::vector<std::vector<std::vector<size_t>>> count(npass,
+			std::vector<std::vector<size_t>>(1, std::vector<size_t>(ndigit, 0)));
+		for (size_t i=0; i<n; ++i) {
+			uint64_t const key = kv[i].key;
+			for (int p=0; p<npass; ++p)
+				++count[p][0][(key >> (p*digit_bits)) & mask];
+		}
+		for (int p=0; p<npass; ++p) {
+			if (!counts_to_offsets(count[p], n)) continue;
+			radix_scatter(kv, tmp, p*digit_bits, mask, chunk, count[p]);
+			kv.swap(tmp);
+		}
+		return;
 	}
 
-	// Generate a permuatation
-	int n = size();
-	std::vector<int> perm; perm.reserve(n);
-	for (int i=0; i<n; ++i) perm.push_back(i);
-	std::sort(perm.begin(), perm.end(), cmp);
+	// Parallel: each thread's chunk must be histogrammed anew for
+	// each pass, since the previous pass moved elements between chunks.
+	for (int p=0; p<npass; ++p) {
+		int const shift = p * digit_bits;
+		std::vector<std::vector<size_t>> count(nthread, std::vector<size_t>(ndigit, 0));
+		auto histogram = [&](int t) {
+			size_t *c = &count[t][0];
+			for (size_t i=chunk[t]; i<chunk[t+1]; ++i)
+				++c[(kv[i].key >> shift) & mask];
+		};
+		boost::thread_group threads;
+		for (int t=0; t<nthread; ++t)
+			threads.create_thread(boost::bind<void>(histogram, t));
+		threads.join_all();
 
-//for (int i=0; i<100; ++i) printf("%d, ", perm[i]); printf("\n");
+		if (!counts_to_offsets(count, n)) continue;
+		radix_scatter(kv, tmp, shift, mask, chunk, count);
+		kv.swap(tmp);
+	}
+}
 
-	// Apply permutation to val
-	std::vector<double> dtmp; dtmp.reserve(n);
-	for (int i=0; i<n; ++i) dtmp.push_back(val[perm[i]]);
-	val = std::move(dtmp);
+int nbits(uint64_t x)
+{
+	int n = 0;
+	for (; x != 0; x >>= 1) ++n;
+	return n;
+}
+
+}	// namespace (anonymous)
+
+/** Sorts a coordinate-format matrix (in place) by packing (major,
+minor) indices into 64-bit keys and LSD radix sorting them, with the
+values carried along.  Optionally sums duplicates while unpacking. */
+static void radix_sort_coo(
+	std::vector<int> &indx, std::vector<int> &jndx, std::vector<double> &val,
+	SparseMatrix::SortOrder sort_order, bool sum_duplicates)
+{
+	size_t const n = val.size();
+	if (n <= 1) return;
 
-	// Apply permutation to indx
-	std::vector<int> itmp; itmp.reserve(n);
-	for (int i=0; i<n; ++i) itmp.push_back(indx[perm[i]]);
-	std::swap(itmp, indx);
+	std::vector<int> &major(sort_order == SparseMatrix::SortOrder::COLUMN_MAJOR ? jndx : indx);
+	std::vector<int> &minor(sort_order == SparseMatrix::SortOrder::COLUMN_MAJOR ? indx : jndx);
 
-	// Apply permutation to jndx
-	itmp.clear();
-	for (int i=0; i<n; ++i) itmp.push_back(jndx[perm[i]]);
-	jndx = std::move(itmp);	
+	// Key layout: only as many bits as the index ranges need
+	// (Differences taken in 64 bits, so any int indices fit)
+	int64_t const major0 = *std::min_element(major.begin(), major.end());
+	int64_t const minor0 = *std::min_element(minor.begin(), minor.end());
+	int const minor_bits = nbits((uint64_t)(*std::max_element(minor.begin(), minor.end()) - minor0));
+	int const key_bits = minor_bits + nbits((uint64_t)(*std::max_element(major.begin(), major.end()) - major0));
+
+	int nthread = 1;
+	if (n >= PARALLEL_SORT_MIN)
+		nthread = std::max(1, std::min(8, (int)boost::thread::hardware_concurrency()));
+
+	std::vector<KeyVal> kv(n);
+	for (size_t i=0; i<n; ++i) {
+		kv[i].key = ((uint64_t)(major[i] - major0) << minor_bits)
+			| (uint64_t)(minor[i] - minor0);
+		kv[i].val = val[i];
+	}
+
+	{
+		std::vector<KeyVal> tmp;
+		radix_sort(kv, tmp, key_bits, nthread);
+	}
+
+	// Unpack, summing duplicates (now adjacent) if asked
+	uint64_t const minor_mask = (((uint64_t)1) << minor_bits) - 1;
+	size_t nout = 0;
+	for (size_t i=0; i<n; ++i) {
+		if (sum_duplicates && nout > 0 && kv[i].key == kv[nout-1].key) {
+			kv[nout-1].val += kv[i].val;
+		} else {
+			kv[nout++] = kv[i];
+		}
+	}
+	major.resize(nout);
+	minor.resize(nout);
+	val.resize(nout);
+	for (size_t i=0; i<nout; ++i) {
+		major[i] = (int)((int64_t)(kv[i].key >> minor_bits) + major0);
+		minor[i] = (int)((int64_t)(kv[i].key & minor_mask) + minor0);
+		val[i] = kv[i].val;
+	}
+}
+
+void VectorSparseMatrix::sort(SparseMatrix::SortOrder sort_order)
+{
+printf("VectorSparseMatrix::sort(%d, %ld)\n", sort_order, size());
+	radix_sort_coo(indx, jndx, val, sort_order, false);
 }
 
 void VectorSparseMatrix::sum_duplicates(
 	SparseMatrix::SortOrder sort_order) // = SparseMatrix::SortOrder::ROW_MAJOR
 {
-	// Nothing to do for zero-size matrices (or ones with just one element)
-	if (size() <= 1) return;
-
-	// Decide on how we'll sort
-	CmpIndex2 cmp;
-	switch(sort_order) {
-		case SparseMatrix::SortOrder::COLUMN_MAJOR :
-			cmp.init(&jndx[0], &indx[0]);
-		break;
-		default :
-			cmp.init(&indx[0], &jndx[0]);
-		break;
-	}
-
-	// Generate a sorted permuatation
-	int n = size();
-	std::vector<int> perm; perm.reserve(n);
-	for (int i=0; i<n; ++i) perm.push_back(i);
-	std::sort(perm.begin(), perm.end(), cmp);
+	radix_sort_coo(indx, jndx, val, sort_order, true);
+}
 
-	// Output arrays
-	std::vector<int> nindx;
-	std::vector<int> njndx;
+void VectorSparseMatrix::replace_rows(std::vector<char> const &rows, VectorSparseMatrix const &src)
+{
+	std::vector<int> nindx, njndx;
 	std::vector<double> nval;
+	nindx.reserve(indx.size());
+	njndx.reserve(indx.size());
+	nval.reserve(indx.size());
+
+	// Merge the unflagged rows of this with the flagged rows of src
+	size_t i = 0, j = 0;
+	size_t const n = indx.size(), nsrc = src.indx.size();
+	for (;;) {
+		while (i < n && rows[indx[i] - index_base]) ++i;
+		while (j < nsrc && !rows[src.indx[j] - index_base]) ++j;
+		bool take_src;
+		if (i < n && j < nsrc) take_src = (src.indx[j] < indx[i]);
+		else if (j < nsrc) take_src = true;
+		else if (i < n) take_src = false;
+		else break;
 
-	// Identify duplicates
-	nindx.push_back(indx[perm[0]]);
-	njndx.push_back(jndx[perm[0]]);
-	nval.push_back(val[perm[0]]);
-	for (int i=1; i<indx.size(); ++i) {
-		int row = indx[perm[i]];
-		int col = jndx[perm[i]];
-//printf("remove_dup: %d %d\n", row, col);
-		if ((row == nindx.back()) && (col == njndx.back())) {
-			nval.back() += val[perm[i]];
+		if (take_src) {
+			nindx.push_back(src.indx[j]);
+			njndx.push_back(src.jndx[j]);
+			nval.push_back(src.val[j]);
+			++j;
 		} else {
-			nindx.push_back(indx[perm[i]]);
-			njndx.push_back(jndx[perm[i]]);
-			nval.push_back(val[perm[i]]);
+			nindx.push_back(indx[i]);
+			njndx.push_back(jndx[i]);
+			nval.push_back(val[i]);
+			++i;
 		}
 	}
 
@@ -19,6 +19,7 @@
 #pragma once 
 
 #include <map>
+#include <algorithm>
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
 #include <galahad/zd11_c.hpp>
@@ -30,6 +31,8 @@ class NcFile;
 
 namespace giss {
 
+class VectorSparseMatrix;
+
 // ------------------------------------------------------------
 
 // ------------------------------------------------------------
@@ -152,6 +155,22 @@ public:
 	@param clear_y If true, y = A^T x.  Otherwise, y += A^T x. */
 	virtual void multiplyT(double const * x, double *y, bool clear_y = true) const = 0;
 
+	/** Multiply this matrix A by nfield vectors at once (a dense
+	multivector), reading each element of A just once.
+	Computes Y = A * X
+	@param X IN: [ncol][nfield] row-major: the fields of each column are adjacent.
+	@param Y OUT: [nrow][nfield] row-major.
+	@param nfield Number of fields (vectors) in X and Y.
+	@param clear_y If true, Y = AX.  Otherwise, Y += AX. */
+	virtual void multiply_multi(double const *X, double *Y, int nfield, bool clear_y = true) const = 0;
+
+	/** Multiply transpose of this matrix A by nfield vectors at once.
+	Computes Y = A^T * X
+	@param X IN: [nrow][nfield] row-major.
+	@param Y OUT: [ncol][nfield] row-major.
+	@see multiply_multi() */
+	virtual void multiplyT_multi(double const *X, double *Y, int nfield, bool clear_y = true) const = 0;
+
 	/** Computes the sum of each row of this matrix.
 	@return Vector[nrow], each element containing the sum of the respective row from the matrix. */
 	virtual std::vector<double> sum_per_row() const = 0;
@@ -170,6 +189,29 @@ public:
 
 };
 
+// =================================================================
+/** y[0..N) += a * x[0..N), with N known at compile time. */
+template<int N>
+inline void axpy_fixed(double a, double const *x, double *y)
+	{ for (int i=0; i<N; ++i) y[i] += a * x[i]; }
+
+/** y[0..n) += a * x[0..n).  Used to apply one matrix element to all
+fields of a multivector; the common small n have fixed-length loops
+the compiler can unroll and vectorize. */
+inline void axpy_fields(int n, double a, double const *x, double *y)
+{
+	switch(n) {
+		case 1 : y[0] += a * x[0]; break;
+		case 2 : axpy_fixed<2>(a, x, y); break;
+		case 3 : axpy_fixed<3>(a, x, y); break;
+		case 4 : axpy_fixed<4>(a, x, y); break;
+		case 8 : axpy_fixed<8>(a, x, y); break;
+		default :
+			for (int i=0; i<n; ++i) y[i] += a * x[i];
+		break;
+	}
+}
+
 // =================================================================
 // Mix-ins common to all sparse matrix types
 
@@ -186,6 +228,8 @@ public:
 
 	void multiply(double const * x, double *y, bool clear_y = true) const;
 	void multiplyT(double const * x, double *y, bool clear_y = true) const;
+	void multiply_multi(double const *X, double *Y, int nfield, bool clear_y = true) const;
+	void multiplyT_multi(double const *X, double *Y, int nfield, bool clear_y = true) const;
 	std::vector<double> sum_per_row() const;
 	std::vector<double> sum_per_col() const;
 	std::map<int,double> sum_per_row_map() const;
@@ -242,17 +286,15 @@ void SparseMatrix1<SparseMatrix0T>::netcdf_write(NcFile *nc, std::string const &
 	NcVar *grid_indexVar = nc->get_var((vname + ".index").c_str());
 	NcVar *areaVar = nc->get_var((vname + ".val").c_str());
 
-	int i=0;
+	NcBufferedWriter<int> index_w(grid_indexVar, 2);
+	NcBufferedWriter<double> val_w(areaVar);
 	for (auto ov = this->begin(); ov != this->end(); ++ov) {
-		grid_indexVar->set_cur(i,0);
-		int index[2] = {ov.row() + this->index_base, ov.col() + this->index_base};
-		grid_indexVar->put(index, 1,2);
-
-		areaVar->set_cur(i);
-		areaVar->put(&ov.val(), 1);
-
-		++i;
+		index_w.add(ov.row() + this->index_base);
+		index_w.add(ov.col() + this->index_base);
+		val_w.add(ov.val());
 	}
+	index_w.flush();
+	val_w.flush();
 }
 
 
@@ -264,6 +306,8 @@ boost::function<void ()> SparseMatrix1<SparseMatrix0T>::netcdf_define(
 	auto num_gridsDim = nc.add_dim((vname + ".rank").c_str(), 2);
 	auto grid_indexVar = nc.add_var((vname + ".index").c_str(), ncInt, lenDim, num_gridsDim);
 	auto areaVar = nc.add_var((vname + ".val").c_str(), ncDouble, lenDim);
+	set_nc_storage(nc, grid_indexVar);
+	set_nc_storage(nc, areaVar);
 
 	auto oneDim = get_or_add_dim(nc, "one", 1);
 	auto descrVar = nc.add_var((vname + ".descr").c_str(), ncInt, oneDim);	// TODO: This should be ".info"
@@ -306,6 +350,30 @@ void SparseMatrix1<SparseMatrix0T>::multiplyT(double const * x, double *y, bool
 	}
 }
 
+/// Computes Y = A * X, for nfield vectors at once
+template<class SparseMatrix0T>
+void SparseMatrix1<SparseMatrix0T>::multiply_multi(double const *X, double *Y, int nfield, bool clear_y) const
+{
+	if (clear_y) std::fill(Y, Y + (size_t)this->nrow * nfield, 0.0);
+	for (auto ii = this->begin(); ii != this->end(); ++ii) {
+		axpy_fields(nfield, ii.val(),
+			X + (size_t)ii.col() * nfield,
+			Y + (size_t)ii.row() * nfield);
+	}
+}
+
+/// Computes Y = A^T * X, for nfield vectors at once
+template<class SparseMatrix0T>
+void SparseMatrix1<SparseMatrix0T>::multiplyT_multi(double const *X, double *Y, int nfield, bool clear_y) const
+{
+	if (clear_y) std::fill(Y, Y + (size_t)this->ncol * nfield, 0.0);
+	for (auto ii = this->begin(); ii != this->end(); ++ii) {
+		axpy_fields(nfield, ii.val(),
+			X + (size_t)ii.row() * nfield,
+			Y + (size_t)ii.col() * nfield);
+	}
+}
+
 // ------------------------------------------------------------
 template<class SparseMatrix0T>
 std::vector<double> SparseMatrix1<SparseMatrix0T>::sum_per_row() const {
@@ -425,6 +493,17 @@ public:
 
 	size_t size() const { return _nnz_cur; }
 
+	/** Appends n elements at once, from coordinate arrays with
+	0-based indices.  The batch is validated once, then copied
+	straight into the Fortran-owned arrays; much faster than
+	calling add() per element.
+	@see galahad::zd11_c::fill_coo() */
+	void append_bulk(int n, int const *rows, int const *cols, double const *vals);
+
+	/** Appends a whole VectorSparseMatrix at once.
+	@see append_bulk() */
+	void append_bulk(VectorSparseMatrix const &mat);
+
 protected:
 	/** Internal set() function without any error checking or adjustments for index_base. */
 	void _set(int row, int col, double const val, DuplicatePolicy dups)
@@ -488,6 +567,14 @@ public:
 		{ return (i == 0 ? rows() : cols()); }
 	std::vector<double> const &vals() const { return val; }
 
+	/** Overwrites the element at storage position i.  Used to patch
+	matrices whose layout is known (see IceSheet_L0). */
+	void set_element(size_t i, int row, int col, double _val) {
+		indx[i] = row + index_base;
+		jndx[i] = col + index_base;
+		val[i] = _val;
+	}
+
 	// --------------------------------------------------
 	/** Standard STL-type iterator for iterating through a ZD11SparseMatrix. */
 	class iterator {
@@ -592,6 +679,13 @@ public:
 	void sum_duplicates(
 		SparseMatrix::SortOrder sort_order = SparseMatrix::SortOrder::ROW_MAJOR);
 
+	/** Replaces some rows of this matrix with the same rows of another.
+	Both must be sorted ROW_MAJOR (see sum_duplicates()), with the same
+	index_base; so is the result.
+	@param rows [nrow] Non-zero for the rows to take from src.
+	@param src Rows not flagged in rows are ignored. */
+	void replace_rows(std::vector<char> const &rows, VectorSparseMatrix const &src);
+
 	/** Construct a VectorSparseMatrix based on arrays in a netCDF file.
 	@param nc The netCDF file
 	@param vname Name of the variable in the netCDF file.
@@ -893,62 +987,53 @@ void transpose(SparseMatrixT1 &a, SparseMatrixT2 &b, SparseMatrix::DuplicatePoli
 	}
 }
 // ------------------------------------------------------------
-/** Converts from a used-set to a translator */
 template<class SparseMatrixT1>
-inline void make_used_translators(SparseMatrixT1 &a,
+inline void make_used_row_translator(SparseMatrixT1 &a,
 IndexTranslator &trans_row,
-IndexTranslator &trans_col,
-std::set<int> *_used_row = NULL,	// If not NULL, output to here.
-std::set<int> *_used_col = NULL)	// If not NULL, output to here.
-
+std::vector<int> *_used_row = NULL)	// If not NULL, output to here.
 {
 	// Figure out what is used
-	std::set<int> used_row;
-	std::set<int> used_col;
+	std::vector<int> used_row;
+	used_row.reserve(a.size());
 	for (typename SparseMatrixT1::iterator ii = a.begin(); ii != a.end(); ++ii) {
-		used_row.insert(ii.row());
-		used_col.insert(ii.col());
+		used_row.push_back(ii.row());
 	}
+	compact_indices(a.nrow, used_row);
 
 	// Convert used sets to translators
-	trans_row.init(a.nrow, used_row);
-	trans_col.init(a.ncol, used_col);
-
-	if (_used_row) *_used_row = std::move(used_row);
-	if (_used_col) *_used_col = std::move(used_col);
+	if (_used_row) *_used_row = used_row;
+	trans_row.init(a.nrow, std::move(used_row));
 }
 
-
 template<class SparseMatrixT1>
-inline void make_used_row_translator(SparseMatrixT1 &a,
-IndexTranslator &trans_row,
-std::set<int> *_used_row = NULL)	// If not NULL, output to here.
+inline void make_used_col_translator(SparseMatrixT1 &a,
+IndexTranslator &trans_col,
+std::vector<int> *_used_col = NULL)	// If not NULL, output to here.
 {
 	// Figure out what is used
-	std::set<int> used_row;
+	std::vector<int> used_col;
+	used_col.reserve(a.size());
 	for (typename SparseMatrixT1::iterator ii = a.begin(); ii != a.end(); ++ii) {
-		used_row.insert(ii.row());
+		used_col.push_back(ii.col());
 	}
+	compact_indices(a.ncol, used_col);
 
 	// Convert used sets to translators
-	trans_row.init(a.nrow, used_row);
-	if (_used_row) *_used_row = std::move(used_row);
+	if (_used_col) *_used_col = used_col;
+	trans_col.init(a.ncol, std::move(used_col));
 }
 
+/** Converts from a used-set to a translator */
 template<class SparseMatrixT1>
-inline void make_used_col_translator(SparseMatrixT1 &a,
+inline void make_used_translators(SparseMatrixT1 &a,
+IndexTranslator &trans_row,
 IndexTranslator &trans_col,
-std::set<int> *_used_col = NULL)	// If not NULL, output to here.
-{
-	// Figure out what is used
-	std::set<int> used_col;
-	for (typename SparseMatrixT1::iterator ii = a.begin(); ii != a.end(); ++ii) {
-		used_col.insert(ii.col());
-	}
+std::vector<int> *_used_row = NULL,	// If not NULL, output to here.
+std::vector<int> *_used_col = NULL)	// If not NULL, output to here.
 
-	// Convert used sets to translators
-	trans_col.init(a.ncol, used_col);
-	if (_used_col) *_used_col = std::move(used_col);
+{
+	make_used_row_translator(a, trans_row, _used_row);
+	make_used_col_translator(a, trans_col, _used_col);
 }
 
 
@@ -1017,16 +1102,111 @@ SparseMatrixT &mat)
 		ii.val() *= diag(ii.row());
 }
 
+// ===============================================================
+/** A diagonal matrix [n x n], stored as a dense vector of its
+diagonal.  Diagonal scalings (grid corrections, area normalizations)
+are applied to sparse matrices in place with scale_rows() /
+scale_cols(), in one pass over the non-zeros --- rather than building
+an n x n VectorSparseMatrix and multiplying it in with SpGEMM.
+Several diagonals may be combined first with operator*=. */
+class DiagonalMatrix {
+	std::vector<double> _diag;
+public:
+	/** @param n Size of the matrix
+	@param val Initial value of each diagonal element */
+	explicit DiagonalMatrix(int n = 0, double val = 1.0) : _diag(n, val) {}
+
+	int size() const { return _diag.size(); }
+
+	double &operator()(int i) { return _diag[i]; }
+	double operator()(int i) const { return _diag[i]; }
+	double const *data() const { return _diag.data(); }
+
+	/** this = this * b */
+	DiagonalMatrix &operator*=(DiagonalMatrix const &b) {
+		if (b.size() != size()) {
+			fprintf(stderr, "DiagonalMatrix::operator*=() with mismatched dimensions %d vs %d\n", b.size(), size());
+			throw std::exception();
+		}
+		for (int i=0; i<size(); ++i) _diag[i] *= b._diag[i];
+		return *this;
+	}
+
+	/** Replaces each element by its inverse.  Zero elements (eg:
+	cells with no area) are left at zero. */
+	void invert() {
+		for (auto ii = _diag.begin(); ii != _diag.end(); ++ii)
+			if (*ii != 0) *ii = 1.0 / *ii;
+	}
+};
+
+/** Computes diag * M, stores back in M */
+template<class SparseMatrixT>
+void scale_rows(DiagonalMatrix const &diag, SparseMatrixT &mat)
+{
+	if (diag.size() != mat.nrow) {
+		fprintf(stderr, "scale_rows() with mismatched dimensions %d vs %d\n", diag.size(), mat.nrow);
+		throw std::exception();
+	}
+	for (auto ii = mat.begin(); ii != mat.end(); ++ii)
+		ii.val() *= diag(ii.row());
+}
+
+/** Computes M * diag, stores back in M */
+template<class SparseMatrixT>
+void scale_cols(SparseMatrixT &mat, DiagonalMatrix const &diag)
+{
+	if (diag.size() != mat.ncol) {
+		fprintf(stderr, "scale_cols() with mismatched dimensions %d vs %d\n", diag.size(), mat.ncol);
+		throw std::exception();
+	}
+	for (auto ii = mat.begin(); ii != mat.end(); ++ii)
+		ii.val() *= diag(ii.col());
+}
+
+/** Computes left * M * right, stores back in M (in one pass) */
+template<class SparseMatrixT>
+void scale_rows_cols(DiagonalMatrix const &left, SparseMatrixT &mat, DiagonalMatrix const &right)
+{
+	if (left.size() != mat.nrow || right.size() != mat.ncol) {
+		fprintf(stderr, "scale_rows_cols() with mismatched dimensions (%d, %d) vs (%d, %d)\n", left.size(), right.size(), mat.nrow, mat.ncol);
+		throw std::exception();
+	}
+	for (auto ii = mat.begin(); ii != mat.end(); ++ii)
+		ii.val() *= left(ii.row()) * right(ii.col());
+}
+
 // ===============================================================
 // ======== Extra Functions
 
 //extern std::unique_ptr<VectorSparseMatrix> multiply_eigen_algorithm(VectorSparseMatrix &a, VectorSparseMatrix &b);
-extern std::unique_ptr<VectorSparseMatrix> multiply_giss_algorithm(VectorSparseMatrix &a, VectorSparseMatrix &b);
 
-inline std::unique_ptr<VectorSparseMatrix> multiply(VectorSparseMatrix &a, VectorSparseMatrix &b)
+/** Sparse matrix product using a per-row sparse accumulator.
+Does not modify (or sort) a or b. */
+extern std::unique_ptr<VectorSparseMatrix> multiply_giss_algorithm(VectorSparseMatrix const &a, VectorSparseMatrix const &b);
+
+/** Old O(nrow * ncol) row-by-column product; sorts a and b in place.
+Only kept for testing against multiply_giss_algorithm(). */
+extern std::unique_ptr<VectorSparseMatrix> multiply_rowcol_algorithm(VectorSparseMatrix &a, VectorSparseMatrix &b);
+
+inline std::unique_ptr<VectorSparseMatrix> multiply(VectorSparseMatrix const &a, VectorSparseMatrix const &b)
 	{ return multiply_giss_algorithm(a, b); }
 //	{ return multiply_eigen_algorithm(a, b); }		// Seemed to return the wrong answer in ice_to_hp() tests
 
+/** Computes the lower triangle (diagonal included) of scale * A^T A,
+directly into ZD11 storage --- as needed for a GALAHAD Hessian.  The
+structure is found first, so the output is allocated just once at its
+final size; the product is then filled in, one row at a time, in
+parallel.  Structural zeros (from cancellation) are kept.
+@param a The matrix A; not modified.
+@param alloc Called once with the number of elements in the result.
+    Must allocate that many (eg: qpt_problem_c::alloc_H()) and return
+    the ZD11 matrix to fill, which must be ncol(A) x ncol(A).
+@param nthread Number of threads to compute on. */
+extern void syrk_lower(VectorSparseMatrix const &a, double scale,
+	boost::function<galahad::zd11_c &(int ne)> const &alloc,
+	int nthread = 1);
+
 extern std::vector<int> get_rowcol_beginnings(
 	VectorSparseMatrix const &a,
 	int const rowcol);
@@ -0,0 +1,129 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+
+namespace giss {
+
+/** Dense LU factorization with partial pivoting, in place.
+Meant for many tiny systems, so there is no blocking: the caller
+should use dense_lu_factor_fixed() where n is known to be small.
+@param n Size of the (row-major) matrix A.
+@param A IN: Matrix [n*n].  OUT: L (unit diagonal, below) and U.
+@param piv OUT: Row permutation [n].
+@param rtol Pivots smaller than rtol * max|A| count as singular.
+@return false if A is (numerically) singular. */
+inline bool dense_lu_factor(int const n, double *A, int *piv, double rtol = 1e-12)
+{
+	double amax = 0;
+	for (int i=0; i<n*n; ++i) amax = std::max(amax, std::abs(A[i]));
+	double const tiny = rtol * amax;
+
+	for (int k=0; k<n; ++k) {
+		// Find pivot
+		int p = k;
+		double pmax = std::abs(A[k*n + k]);
+		for (int i=k+1; i<n; ++i) {
+			double const v = std::abs(A[i*n + k]);
+			if (v > pmax) { pmax = v; p = i; }
+		}
+		piv[k] = p;
+		if (pmax <= tiny) return false;
+		if (p != k) {
+			for (int j=0; j<n; ++j) std::swap(A[k*n + j], A[p*n + j]);
+		}
+
+		// Eliminate below the pivot
+		double const dinv = 1.0 / A[k*n + k];
+		for (int i=k+1; i<n; ++i) {
+			double const l = (A[i*n + k] *= dinv);
+			if (l == 0) continue;
+			for (int j=k+1; j<n; ++j) A[i*n + j] -= l * A[k*n + j];
+		}
+	}
+	return true;
+}
+
+/** Solves A x = b, given the output of dense_lu_factor().
+@param b IN: Right hand side [n].  OUT: Solution x. */
+inline void dense_lu_solve(int const n, double const *LU, int const *piv, double *b)
+{
+	// Apply permutation, and forward substitution with unit L
+	for (int k=0; k<n; ++k) {
+		if (piv[k] != k) std::swap(b[k], b[piv[k]]);
+	}
+	for (int i=1; i<n; ++i) {
+		double sum = b[i];
+		for (int j=0; j<i; ++j) sum -= LU[i*n + j] * b[j];
+		b[i] = sum;
+	}
+
+	// Back substitution with U
+	for (int i=n-1; i>=0; --i) {
+		double sum = b[i];
+		for (int j=i+1; j<n; ++j) sum -= LU[i*n + j] * b[j];
+		b[i] = sum / LU[i*n + i];
+	}
+}
+
+// ---------------------------------------------------------------
+/** Versions of dense_lu_factor() / dense_lu_solve() specialized at
+compile time for every n from 1 to N, so loop bounds are constants.
+Larger n fall through to the general versions. */
+template<int N>
+struct DenseLUFixed {
+	static bool factor(int n, double *A, int *piv, double rtol)
+	{
+		if (n == N) return dense_lu_factor(N, A, piv, rtol);
+		return DenseLUFixed<N-1>::factor(n, A, piv, rtol);
+	}
+
+	static void solve(int n, double const *LU, int const *piv, double *b)
+	{
+		if (n == N) dense_lu_solve(N, LU, piv, b);
+		else DenseLUFixed<N-1>::solve(n, LU, piv, b);
+	}
+};
+
+template<>
+struct DenseLUFixed<0> {
+	static bool factor(int n, double *A, int *piv, double rtol)
+		{ return dense_lu_factor(n, A, piv, rtol); }
+	static void solve(int n, double const *LU, int const *piv, double *b)
+		{ dense_lu_solve(n, LU, piv, b); }
+};
+
+/** Largest n for which dense_lu_factor_fixed() has a specialized kernel */
+int const DENSE_LU_MAX_FIXED = 48;
+
+inline bool dense_lu_factor_fixed(int n, double *A, int *piv, double rtol = 1e-12)
+{
+	if (n > DENSE_LU_MAX_FIXED) return dense_lu_factor(n, A, piv, rtol);
+	return DenseLUFixed<DENSE_LU_MAX_FIXED>::factor(n, A, piv, rtol);
+}
+
+inline void dense_lu_solve_fixed(int n, double const *LU, int const *piv, double *b)
+{
+	if (n > DENSE_LU_MAX_FIXED) dense_lu_solve(n, LU, piv, b);
+	else DenseLUFixed<DENSE_LU_MAX_FIXED>::solve(n, LU, piv, b);
+}
+
+}	// namespace giss
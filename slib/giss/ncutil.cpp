@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <netcdf.h>
 #include <giss/ncutil.hpp>
 
 namespace giss {
@@ -79,6 +80,48 @@ std::vector<int> read_int_vector(NcFile &nc, std::string const &var_name)
 }
 #endif
 
+NcStorage default_nc_storage;
+
+void set_nc_storage(NcFile &nc, NcVar *var, NcStorage const &storage)
+{
+	if (storage.deflate_level <= 0 && storage.chunk_rows <= 0) return;
+
+	int ncid = nc.id();
+	int varid = var->id();
+
+	// Chunking and compression only exist in NetCDF-4
+	int format;
+	nc_inq_format(ncid, &format);
+	if (format != NC_FORMAT_NETCDF4 && format != NC_FORMAT_NETCDF4_CLASSIC) return;
+
+	int err = NC_NOERR;
+	if (storage.chunk_rows > 0) {
+		int ndims;
+		int dimids[NC_MAX_VAR_DIMS];
+		nc_inq_varndims(ncid, varid, &ndims);
+		nc_inq_vardimid(ncid, varid, dimids);
+
+		// Chunk along the first dimension only
+		std::vector<size_t> chunks(ndims);
+		for (int i=0; i<ndims; ++i) {
+			nc_inq_dimlen(ncid, dimids[i], &chunks[i]);
+			if (i == 0) chunks[i] = std::min(chunks[i], (size_t)storage.chunk_rows);
+			chunks[i] = std::max(chunks[i], (size_t)1);
+		}
+		err = nc_def_var_chunking(ncid, varid, NC_CHUNKED, &chunks[0]);
+	}
+
+	if (err == NC_NOERR && storage.deflate_level > 0) {
+		err = nc_def_var_deflate(ncid, varid,
+			storage.shuffle ? 1 : 0, 1, storage.deflate_level);
+	}
+
+	if (err != NC_NOERR) {
+		fprintf(stderr, "set_nc_storage(%s): %s\n", var->name(), nc_strerror(err));
+		throw std::exception();
+	}
+}
+
 void netcdf_write_functions(std::vector<boost::function<void ()>> const &functions)
 {
 	for (auto fn = functions.begin(); fn != functions.end(); ++fn) (*fn)();
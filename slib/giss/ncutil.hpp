@@ -27,6 +27,7 @@
 #include <boost/bind.hpp>
 #include <giss/blitz.hpp>
 #include <cassert>
+#include <algorithm>
 
 namespace giss {
 
@@ -92,6 +93,55 @@ inline std::vector<double> read_double_vector(NcFile &nc, std::string const &var
 inline std::vector<int> read_int_vector(NcFile &nc, std::string const &var_name)
 	{ return read_vector<int>(nc, var_name); }
 
+/** Reads selected rows of a 1-D or 2-D variable.  Nearby rows are
+read together in one hyperslab, so this makes few get() calls even
+when rows are scattered.
+@param rows Rows to read, sorted ascending.
+@param ncol Size of the second dimension (1 for 1-D variables).
+@param max_gap Unselected rows that may be read (and discarded)
+	between two selected rows, rather than starting a new read.
+@return Values of the selected rows [rows.size() * ncol] */
+template<class T>
+std::vector<T> read_rows(NcVar *var, std::vector<long> const &rows,
+	long ncol = 1, long max_gap = 4096)
+{
+	long const max_run = 1L << 20;	// Limits the size of buf
+
+	std::vector<T> ret;
+	ret.reserve(rows.size() * ncol);
+	std::vector<T> buf;
+	size_t i = 0;
+	while (i < rows.size()) {
+		// Extend the run while the gaps are small
+		long const r0 = rows[i];
+		size_t j = i+1;
+		while (j < rows.size() && rows[j] - rows[j-1] <= max_gap
+			&& rows[j] - r0 < max_run) ++j;
+		long const nr = rows[j-1] - r0 + 1;
+
+		buf.resize(nr * ncol);
+		bool ok;
+		if (ncol == 1) {
+			var->set_cur(r0);
+			ok = var->get(&buf[0], nr);
+		} else {
+			var->set_cur(r0, 0);
+			ok = var->get(&buf[0], nr, ncol);
+		}
+		if (!ok) {
+			fprintf(stderr, "read_rows: Error reading rows %ld-%ld of %s\n", r0, r0+nr, var->name());
+			throw std::exception();
+		}
+
+		for (size_t k=i; k<j; ++k) {
+			T const *row = &buf[(rows[k] - r0) * ncol];
+			ret.insert(ret.end(), row, row + ncol);
+		}
+		i = j;
+	}
+	return ret;
+}
+
 // -----------------------------------------------------------
 
 template<class T, int rank>
@@ -124,6 +174,82 @@ for (int i=0; i<rank; ++i) printf("read_blitz: ret.extent(%d) = %d\n", i, ret.ex
 }
 
 
+// -----------------------------------------------------------
+/** How large variables are laid out on disk.  Only takes effect in
+NetCDF-4 files; ignored for classic-format files. */
+struct NcStorage {
+	int deflate_level;		/// 0-9; 0 = no compression
+	bool shuffle;			/// Apply the shuffle filter before deflating
+	long chunk_rows;		/// Chunk length along the first dimension; 0 = library default
+
+	NcStorage() : deflate_level(0), shuffle(true), chunk_rows(0) {}
+};
+
+/** Storage used for large variables by netcdf_define() in
+Grid, SparseMatrix, etc.  Defaults to no chunking or compression. */
+extern NcStorage default_nc_storage;
+
+/** Sets chunking and compression on a variable.  Must be called
+in define mode, right after add_var(). */
+void set_nc_storage(NcFile &nc, NcVar *var,
+	NcStorage const &storage = default_nc_storage);
+
+// -----------------------------------------------------------
+/** Writes a 1-D or 2-D NetCDF variable row by row.  Values are
+buffered so they go out in a few large put() calls, rather than one
+set_cur() / put() per row.  Call flush() when done.
+Usage:
+<pre>NcBufferedWriter<int> w(var, 2);
+for (...) { w.add(i); w.add(j); }
+w.flush();</pre> */
+template<class T>
+class NcBufferedWriter {
+	NcVar *_var;
+	long _ncol;
+	long _chunk_rows;		// Rows per put()
+	long _cur;				// Next row to write in the file
+	std::vector<T> _buf;
+public:
+	/** @param ncol Size of second dimension (1 for 1-D variables)
+	@param chunk_values Max. number of values buffered between put() calls */
+	NcBufferedWriter(NcVar *var, long ncol = 1, long chunk_values = 1L<<20)
+		: _var(var), _ncol(ncol), _cur(0)
+	{
+		_chunk_rows = std::max(1L, chunk_values / ncol);
+		_buf.reserve(std::min(_chunk_rows, _var->get_dim(0)->size()) * _ncol);
+	}
+
+	void add(T const &val)
+	{
+		_buf.push_back(val);
+		if ((long)_buf.size() == _chunk_rows * _ncol) flush();
+	}
+
+	void flush()
+	{
+		long nrow = _buf.size() / _ncol;
+		if (nrow == 0) return;
+
+		bool ok;
+		if (_ncol == 1) {
+			_var->set_cur(_cur);
+			ok = _var->put(&_buf[0], nrow);
+		} else {
+			_var->set_cur(_cur, 0);
+			ok = _var->put(&_buf[0], nrow, _ncol);
+		}
+		if (!ok) {
+			fprintf(stderr, "NcBufferedWriter: Error writing rows %ld-%ld of %s\n", _cur, _cur+nrow, _var->name());
+			throw std::exception();
+		}
+		_cur += nrow;
+		_buf.clear();
+	}
+
+	/** @return Number of rows written to the file so far */
+	long nrow_written() const { return _cur; }
+};
+
 // -----------------------------------------------------------
 void netcdf_write_functions(std::vector<boost::function<void ()>> const &functions);
 
@@ -17,6 +17,9 @@
  */
 
 #include <vector>
+#include <algorithm>
+#include <memory>
+#include <boost/thread.hpp>
 #include <giss/SparseMatrix.hpp>
 //#include <giss/eigen.hpp>
 
@@ -136,8 +139,252 @@ if (orow == 1 && ocol == 0) {
 }
 
 
-// This should work.  But so does Eigen sparse multiplcation
-std::unique_ptr<VectorSparseMatrix> multiply_giss_algorithm(VectorSparseMatrix &a, VectorSparseMatrix &b)
+// -----------------------------------------------------------------------
+/** Row-start offsets and a permutation that visits the elements of a
+VectorSparseMatrix one row (or column) at a time, in the style of CSR.
+Built with a stable counting sort, so the matrix itself is left alone. */
+struct RowcolIndex {
+	std::vector<int> start;		// [n+1] Beginning of each row in perm
+	std::vector<int> perm;		// [nnz] Element positions, grouped by row
+
+	RowcolIndex(VectorSparseMatrix const &a, int const rowcol)
+	{
+		int n = (rowcol == 0 ? a.nrow : a.ncol);
+		std::vector<int> const &ix(a.rowcols(rowcol));
+		int const base = a.index_base;
+		size_t nnz = a.size();
+
+		start.resize(n+1, 0);
+		for (size_t i=0; i<nnz; ++i) ++start[ix[i] - base + 1];
+		for (int r=0; r<n; ++r) start[r+1] += start[r];
+
+		std::vector<int> next(start.begin(), start.end()-1);
+		perm.resize(nnz);
+		for (size_t i=0; i<nnz; ++i) perm[next[ix[i] - base]++] = i;
+	}
+};
+
+/** Gustavson-style sparse matrix product, computes C = A * B.
+Each row of C is accumulated into a dense array of length ncol(B),
+with a list of touched columns, so the work done is proportional to
+the number of floating point multiplies --- not to nrow(A) * ncol(B).
+Neither a nor b is modified; duplicate entries in either are summed.
+@return C, sorted row-major, without duplicates. */
+std::unique_ptr<VectorSparseMatrix> multiply_giss_algorithm(VectorSparseMatrix const &a, VectorSparseMatrix const &b)
+{
+	if (a.ncol != b.nrow) {
+		fprintf(stderr, "multiply_giss_algorithm(): Mismatched dimensions (%d, %d) * (%d, %d)\n", a.nrow, a.ncol, b.nrow, b.ncol);
+		throw std::exception();
+	}
+
+	RowcolIndex arows(a, 0);
+	RowcolIndex brows(b, 0);
+
+	std::vector<int> const &a_cols(a.cols());
+	std::vector<double> const &a_vals(a.vals());
+	std::vector<int> const &b_cols(b.cols());
+	std::vector<double> const &b_vals(b.vals());
+	int const a_base = a.index_base;
+	int const b_base = b.index_base;
+
+	// Sparse accumulator for one row of C
+	std::vector<double> accum(b.ncol, 0.0);
+	std::vector<int> marker(b.ncol, -1);	// Row in which each column was last touched
+	std::vector<int> touched;
+
+	std::vector<int> indx, jndx;
+	std::vector<double> val;
+
+	for (int row=0; row < a.nrow; ++row) {
+		touched.clear();
+
+		for (int ai = arows.start[row]; ai < arows.start[row+1]; ++ai) {
+			int const ka = arows.perm[ai];
+			int const k = a_cols[ka] - a_base;
+			double const aval = a_vals[ka];
+
+			for (int bi = brows.start[k]; bi < brows.start[k+1]; ++bi) {
+				int const kb = brows.perm[bi];
+				int const col = b_cols[kb] - b_base;
+				if (marker[col] != row) {
+					marker[col] = row;
+					accum[col] = aval * b_vals[kb];
+					touched.push_back(col);
+				} else {
+					accum[col] += aval * b_vals[kb];
+				}
+			}
+		}
+
+		// Emit the row, in column order
+		std::sort(touched.begin(), touched.end());
+		for (auto col = touched.begin(); col != touched.end(); ++col) {
+			double cval = accum[*col];
+			if (cval == 0.0) continue;
+			indx.push_back(row);
+			jndx.push_back(*col);
+			val.push_back(cval);
+		}
+	}
+
+	return std::unique_ptr<VectorSparseMatrix>(new VectorSparseMatrix(
+		SparseDescr(a.nrow, b.ncol),
+		std::move(indx), std::move(jndx), std::move(val)));
+}
+
+// -----------------------------------------------------------------------
+/** Per-thread work space for syrk_lower(), indexed by column.  It is
+allocated once per thread and reused for all the rows the thread does:
+marker[j] == i marks the entries of row i, so nothing needs clearing. */
+struct RowScratch {
+	std::vector<int> marker;
+	std::vector<double> accum;
+	std::vector<int> touched;
+
+	RowScratch(int n) : marker(n, -1) {}
+};
+
+/** Hands out ranges of output rows to the threads of syrk_lower(). */
+struct RowWork {
+	int const n;
+	boost::function<void(int, int, RowScratch &)> const body;
+
+	boost::mutex mutex;		// Protects next and error
+	int next;
+	bool error;
+
+	RowWork(int _n, boost::function<void(int, int, RowScratch &)> const &_body)
+		: n(_n), body(_body), next(0), error(false) {}
+
+	void run()
+	{
+		int const chunk = 256;
+		std::unique_ptr<RowScratch> scratch;
+		for (;;) {
+			int i0, i1;
+			{
+				boost::lock_guard<boost::mutex> lock(mutex);
+				if (error || next >= n) return;
+				i0 = next;
+				i1 = std::min(i0 + chunk, n);
+				next = i1;
+			}
+			try {
+				// Allocated here, so threads that get no rows don't
+				if (!scratch.get()) scratch.reset(new RowScratch(n));
+				body(i0, i1, *scratch);
+			} catch(...) {
+				boost::lock_guard<boost::mutex> lock(mutex);
+				error = true;
+				return;
+			}
+		}
+	}
+};
+
+/** Runs body(i0, i1, scratch) over [0, n), on nthread threads. */
+static void parallel_rows(int n, int nthread,
+	boost::function<void(int, int, RowScratch &)> const &body)
+{
+	RowWork work(n, body);
+	if (nthread <= 1) {
+		work.run();
+	} else {
+		boost::thread_group threads;
+		for (int i=0; i<nthread; ++i)
+			threads.create_thread(boost::bind(&RowWork::run, &work));
+		threads.join_all();
+	}
+	if (work.error) throw std::exception();
+}
+
+void syrk_lower(VectorSparseMatrix const &a, double scale,
+	boost::function<galahad::zd11_c &(int ne)> const &alloc,
+	int nthread)
+{
+	int const n = a.ncol;
+	RowcolIndex arows(a, 0);
+	RowcolIndex acols(a, 1);
+
+	std::vector<int> const &a_rows(a.rows());
+	std::vector<int> const &a_cols(a.cols());
+	std::vector<double> const &a_vals(a.vals());
+	int const base = a.index_base;
+
+	// Row i of A^T A is sum_r A(r,i) A(r,:), for rows r with an
+	// element in column i.  Only columns j <= i of it are needed.
+
+	// ------------- Symbolic pass: number of elements in each row
+	std::vector<int> start(n+1, 0);
+	parallel_rows(n, nthread, [&](int i0, int i1, RowScratch &scratch) {
+		std::vector<int> &marker(scratch.marker);
+		for (int i=i0; i<i1; ++i) {
+			int count = 0;
+			for (int ci = acols.start[i]; ci < acols.start[i+1]; ++ci) {
+				int const r = a_rows[acols.perm[ci]] - base;
+				for (int ri = arows.start[r]; ri < arows.start[r+1]; ++ri) {
+					int const j = a_cols[arows.perm[ri]] - base;
+					if (j > i || marker[j] == i) continue;
+					marker[j] = i;
+					++count;
+				}
+			}
+			start[i+1] = count;
+		}
+	});
+	for (int i=0; i<n; ++i) start[i+1] += start[i];
+
+	// ------------- Allocate the output, all at once
+	int const ne = start[n];
+	galahad::zd11_c &out(alloc(ne));
+	if (out.ne != ne || out.m != n || out.n != n) {
+		fprintf(stderr, "syrk_lower(): Output has wrong shape (%d x %d, ne=%d), expected (%d x %d, ne=%d)\n", out.m, out.n, out.ne, n, n, ne);
+		throw std::exception();
+	}
+
+	// ------------- Numeric pass: fill in each row at its offset
+	parallel_rows(n, nthread, [&](int i0, int i1, RowScratch &scratch) {
+		std::vector<int> &marker(scratch.marker);
+		std::vector<double> &accum(scratch.accum);
+		std::vector<int> &touched(scratch.touched);
+		if (accum.size() != n) accum.resize(n);
+		for (int i=i0; i<i1; ++i) {
+			touched.clear();
+			for (int ci = acols.start[i]; ci < acols.start[i+1]; ++ci) {
+				int const kc = acols.perm[ci];
+				int const r = a_rows[kc] - base;
+				double const aval = scale * a_vals[kc];
+				for (int ri = arows.start[r]; ri < arows.start[r+1]; ++ri) {
+					int const kr = arows.perm[ri];
+					int const j = a_cols[kr] - base;
+					if (j > i) continue;
+					if (marker[j] != i) {
+						marker[j] = i;
+						accum[j] = aval * a_vals[kr];
+						touched.push_back(j);
+					} else {
+						accum[j] += aval * a_vals[kr];
+					}
+				}
+			}
+
+			// Emit the row, in column order (ZD11 is 1-based)
+			std::sort(touched.begin(), touched.end());
+			int k = start[i];
+			for (auto j = touched.begin(); j != touched.end(); ++j, ++k) {
+				out.row[k] = i + 1;
+				out.col[k] = *j + 1;
+				out.val[k] = accum[*j];
+			}
+		}
+	});
+}
+
+/** Original row-by-column product.  Costs O(nrow(a) * ncol(b)) calls
+to multiply_row_col(), whether or not a row and column overlap.  Kept
+only for comparison against multiply_giss_algorithm() (see smulttest).
+NOTE: Sorts a and b in place. */
+std::unique_ptr<VectorSparseMatrix> multiply_rowcol_algorithm(VectorSparseMatrix &a, VectorSparseMatrix &b)
 {
 	// Get beginning of each row in a (including sentinel at end)
 	a.sort(SparseMatrix::SortOrder::ROW_MAJOR);
@@ -175,9 +422,6 @@ printf("\n");
 
 		int row = a.rows()[abegin[ai]];
 		int col = b.cols()[bbegin[bi]];
-if (col == 25120) {
-	printf("************* 25120 ai=%d (%d of %ld) (%d of %ld)\n", ai, bi, bbegin.size(), bbegin[bi], b.cols().size());
-}
 		ret->add(row, col, val);
 	}}
 
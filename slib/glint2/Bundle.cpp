@@ -0,0 +1,257 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include <glint2/Bundle.hpp>
+#include <glint2/MatrixMaker.hpp>
+
+namespace glint2 {
+
+static char const bundle_magic[8] = {'G','L','I','N','T','2','B','N'};
+static uint32_t const bundle_byte_order = 0x01020304;
+
+static uint64_t align64(uint64_t x)
+	{ return (x + 63) & ~(uint64_t)63; }
+
+// ======================================================
+void BundleWriter::add_csr(std::string const &name, giss::VectorSparseMatrix const &mat)
+{
+	int const nrow = mat.nrow;
+
+	// Counting sort by row (stable)
+	std::vector<int32_t> rowptr(nrow + 1, 0);
+	for (auto ii = mat.begin(); ii != mat.end(); ++ii) ++rowptr[ii.row() + 1];
+	for (int i=0; i<nrow; ++i) rowptr[i+1] += rowptr[i];
+
+	std::vector<int32_t> col(rowptr[nrow]);
+	std::vector<double> val(rowptr[nrow]);
+	std::vector<int32_t> next(rowptr.begin(), rowptr.end() - 1);
+	for (auto ii = mat.begin(); ii != mat.end(); ++ii) {
+		int k = next[ii.row()]++;
+		col[k] = ii.col();
+		val[k] = ii.val();
+	}
+
+	int32_t shape[2] = {mat.nrow, mat.ncol};
+	add(name + ".shape", shape, 2);
+	add(name + ".rowptr", rowptr);
+	add(name + ".col", col);
+	add(name + ".val", val);
+}
+
+void BundleWriter::write(std::string const &fname) const
+{
+	// ------- Lay out the file
+	BundleHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, bundle_magic, sizeof(header.magic));
+	header.version = BUNDLE_VERSION;
+	header.byte_order = bundle_byte_order;
+	header.nsections = _items.size();
+
+	std::vector<BundleSection> sections(_items.size());
+	uint64_t offset = align64(sizeof(BundleHeader) + _items.size() * sizeof(BundleSection));
+	for (size_t i=0; i<_items.size(); ++i) {
+		Item const &item(_items[i]);
+		BundleSection &sec(sections[i]);
+		memset(&sec, 0, sizeof(sec));
+		strncpy(sec.name, item.name.c_str(), sizeof(sec.name) - 1);
+		sec.type = item.type;
+		sec.elsize = item.elsize;
+		sec.offset = offset;
+		sec.count = item.data.size() / item.elsize;
+		offset = align64(offset + item.data.size());
+	}
+	header.file_size = offset;
+
+	// ------- Write it
+	std::string tmpname(fname + ".tmp" + std::to_string((long)getpid()));
+	FILE *fout = fopen(tmpname.c_str(), "wb");
+	if (!fout) {
+		fprintf(stderr, "BundleWriter: Cannot open %s for writing\n", tmpname.c_str());
+		throw std::exception();
+	}
+
+	static char const zeros[64] = {0};
+	bool ok = true;
+	ok = ok && fwrite(&header, sizeof(header), 1, fout) == 1;
+	if (sections.size() > 0)
+		ok = ok && fwrite(&sections[0], sizeof(BundleSection), sections.size(), fout) == sections.size();
+	uint64_t pos = sizeof(BundleHeader) + sections.size() * sizeof(BundleSection);
+	for (size_t i=0; ok && i<_items.size(); ++i) {
+		ok = ok && fwrite(zeros, 1, sections[i].offset - pos, fout) == sections[i].offset - pos;
+		size_t n = _items[i].data.size();
+		if (n > 0) ok = ok && fwrite(&_items[i].data[0], 1, n, fout) == n;
+		pos = sections[i].offset + n;
+	}
+	ok = ok && fwrite(zeros, 1, header.file_size - pos, fout) == header.file_size - pos;
+	ok = (fclose(fout) == 0) && ok;
+
+	if (!ok) {
+		fprintf(stderr, "BundleWriter: Error writing %s\n", tmpname.c_str());
+		boost::filesystem::remove(tmpname);
+		throw std::exception();
+	}
+	boost::filesystem::rename(tmpname, fname);
+}
+
+// ======================================================
+Bundle::Bundle(std::string const &fname) : _fname(fname), _fd(-1), _addr(0), _size(0)
+{
+	_fd = open(fname.c_str(), O_RDONLY);
+	if (_fd < 0) {
+		fprintf(stderr, "Bundle: Cannot open %s\n", fname.c_str());
+		throw std::exception();
+	}
+
+	struct stat st;
+	fstat(_fd, &st);
+	_size = st.st_size;
+	if (_size < sizeof(BundleHeader)) {
+		fprintf(stderr, "Bundle: %s is too short\n", fname.c_str());
+		close(_fd);
+		throw std::exception();
+	}
+
+	// Shared, read-only mapping: all processes on the node share the pages
+	void *addr = mmap(0, _size, PROT_READ, MAP_SHARED, _fd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "Bundle: Cannot mmap %s\n", fname.c_str());
+		close(_fd);
+		throw std::exception();
+	}
+	_addr = (char const *)addr;
+
+	// ------- Check the header
+	BundleHeader const *header = (BundleHeader const *)_addr;
+	char const *err = 0;
+	if (memcmp(header->magic, bundle_magic, sizeof(bundle_magic)) != 0)
+		err = "not a GLINT2 bundle";
+	else if (header->byte_order != bundle_byte_order)
+		err = "wrong byte order";
+	else if (header->version != BUNDLE_VERSION)
+		err = "wrong version";
+	else if (header->file_size != _size
+		|| sizeof(BundleHeader) + header->nsections * sizeof(BundleSection) > _size)
+		err = "truncated";
+
+	// ------- Index the sections
+	BundleSection const *sections = (BundleSection const *)(_addr + sizeof(BundleHeader));
+	for (uint64_t i=0; !err && i<header->nsections; ++i) {
+		BundleSection const *sec = &sections[i];
+		if (sec->offset + sec->count * sec->elsize > _size) err = "truncated";
+		else _sections.insert(std::make_pair(std::string(sec->name), sec));
+	}
+
+	if (err) {
+		fprintf(stderr, "Bundle: %s: %s\n", fname.c_str(), err);
+		munmap((void *)_addr, _size);
+		close(_fd);
+		throw std::exception();
+	}
+}
+
+Bundle::~Bundle()
+{
+	munmap((void *)_addr, _size);
+	close(_fd);
+}
+
+BundleSection const *Bundle::section(std::string const &name, BundleType type) const
+{
+	auto ii = _sections.find(name);
+	if (ii == _sections.end()) {
+		fprintf(stderr, "Bundle %s: No array named %s\n", _fname.c_str(), name.c_str());
+		throw std::exception();
+	}
+	if (ii->second->type != type) {
+		fprintf(stderr, "Bundle %s: Array %s has type %d, not %d\n", _fname.c_str(), name.c_str(), (int)ii->second->type, (int)type);
+		throw std::exception();
+	}
+	return ii->second;
+}
+
+std::string Bundle::get_string(std::string const &name) const
+{
+	auto arr(get<char>(name));
+	return std::string(arr.data, arr.size);
+}
+
+BundleCsr Bundle::get_csr(std::string const &name) const
+{
+	BundleCsr ret;
+	auto shape(get<int32_t>(name + ".shape"));
+	ret.nrow = shape[0];
+	ret.ncol = shape[1];
+	ret.rowptr = get<int32_t>(name + ".rowptr");
+	ret.col = get<int32_t>(name + ".col");
+	ret.val = get<double>(name + ".val");
+	return ret;
+}
+
+// ======================================================
+std::string bundle_source_stamp(
+	std::string const &config_fname, std::string const &maker_vname)
+{
+	boost::filesystem::path path(boost::filesystem::canonical(config_fname));
+	std::stringstream ss;
+	ss << path.string()
+		<< " size=" << boost::filesystem::file_size(path)
+		<< " mtime=" << (long)boost::filesystem::last_write_time(path)
+		<< " vname=" << maker_vname;
+	return ss.str();
+}
+
+void write_maker_bundle(MatrixMaker &maker,
+	std::string const &fname, std::string const &source)
+{
+	BundleWriter bundle;
+
+	bundle.add("source", source);
+	int64_t fingerprint = maker.matrix_fingerprint(NULL);
+	bundle.add("fingerprint", &fingerprint, 1);
+
+	// fgice1
+	giss::CooVector<int,double> fgice1;
+	maker.fgice(fgice1);
+	std::vector<int32_t> fgice1_index;
+	std::vector<double> fgice1_val;
+	for (auto ii = fgice1.begin(); ii != fgice1.end(); ++ii) {
+		fgice1_index.push_back(ii->first);
+		fgice1_val.push_back(ii->second);
+	}
+	bundle.add("fgice1.index", fgice1_index);
+	bundle.add("fgice1.val", fgice1_val);
+
+	bundle.add_csr("hp_to_atm", *maker.hp_to_atm());
+
+	// Ice sheets
+	for (auto sheet = maker.sheets.begin(); sheet != maker.sheets.end(); ++sheet)
+		bundle.add_csr(sheet->name + ".hp_to_ice", *maker.hp_to_iceinterp(&*sheet, IceInterp::ICE));
+
+	bundle.write(fname);
+}
+
+}	// namespace glint2
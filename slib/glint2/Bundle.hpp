@@ -0,0 +1,208 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include <giss/SparseMatrix.hpp>
+
+namespace glint2 {
+
+class MatrixMaker;
+
+/** A Bundle is a flat binary file of named, typed arrays, laid out so
+it can be memory-mapped and used in place: no parsing, no copying, and
+all processes on a node share the same pages.
+
+Scope: bundles hold the precomputed matrices a GCM needs (see
+write_maker_bundle()), not the grids or the rest of the MatrixMaker.
+Every rank still reads the config file and realizes its MatrixMaker:
+the ice models and GCMCoupler work on the full Grid / IceSheet objects,
+and attaching those to a bundle would mean a second, array-based
+implementation of them.  What the bundle saves is computing hp_to_atm,
+hp_to_ice and fgice1, which dominates startup.
+
+File layout (native byte order; all offsets 64-byte aligned):
+<pre>BundleHeader
+BundleSection[nsections]
+array data...</pre>
+Conventions on top of that:
+  - Strings are CHAR arrays.
+  - Sparse matrices are stored in CSR form as <name>.shape [nrow, ncol],
+    <name>.rowptr [nrow+1], <name>.col [nnz] and <name>.val [nnz]. */
+struct BundleHeader {
+	char magic[8];				/// "GLINT2BN"
+	uint32_t version;			/// BUNDLE_VERSION
+	uint32_t byte_order;		/// 0x01020304, as written
+	uint64_t nsections;
+	uint64_t file_size;
+};
+
+enum class BundleType : int32_t {
+	CHAR = 1,
+	INT = 2,		/// int32
+	LONG = 3,		/// int64
+	DOUBLE = 4
+};
+
+struct BundleSection {
+	char name[104];				/// Null-terminated
+	BundleType type;
+	int32_t elsize;				/// Size of one element, for checking
+	uint64_t offset;			/// From start of file
+	uint64_t count;				/// Number of elements
+};
+
+/** Increment when the layout of bundle files (or the set of arrays
+written by write_maker_bundle()) changes. */
+int const BUNDLE_VERSION = 3;
+
+template<class T> inline BundleType bundle_type();
+template<> inline BundleType bundle_type<char>() { return BundleType::CHAR; }
+template<> inline BundleType bundle_type<int32_t>() { return BundleType::INT; }
+template<> inline BundleType bundle_type<int64_t>() { return BundleType::LONG; }
+template<> inline BundleType bundle_type<double>() { return BundleType::DOUBLE; }
+
+// ----------------------------------------------------
+/** Collects named arrays, then writes them to a bundle file. */
+class BundleWriter {
+	struct Item {
+		std::string name;
+		BundleType type;
+		int elsize;
+		std::vector<char> data;
+	};
+	std::vector<Item> _items;
+
+public:
+	template<class T>
+	void add(std::string const &name, T const *data, size_t count);
+
+	template<class T>
+	void add(std::string const &name, std::vector<T> const &vals)
+		{ add(name, vals.size() == 0 ? (T const *)0 : &vals[0], vals.size()); }
+
+	void add(std::string const &name, std::string const &str)
+		{ add(name, str.c_str(), str.size()); }
+
+	/** Stores a sparse matrix in CSR form.  Elements keep their
+	original order within each row. */
+	void add_csr(std::string const &name, giss::VectorSparseMatrix const &mat);
+
+	/** Writes the bundle.  The file is written under a temporary
+	name, then renamed into place. */
+	void write(std::string const &fname) const;
+};
+
+template<class T>
+void BundleWriter::add(std::string const &name, T const *data, size_t count)
+{
+	if (name.size() >= sizeof(BundleSection::name)) {
+		fprintf(stderr, "BundleWriter: Name too long: %s\n", name.c_str());
+		throw std::exception();
+	}
+	_items.push_back(Item());
+	Item &item(_items.back());
+	item.name = name;
+	item.type = bundle_type<T>();
+	item.elsize = sizeof(T);
+	char const *cdata = (char const *)data;
+	item.data.assign(cdata, cdata + count * sizeof(T));
+}
+
+// ----------------------------------------------------
+/** Array stored in a Bundle; points directly into the mapped file. */
+template<class T>
+struct BundleArray {
+	T const *data;
+	size_t size;
+
+	BundleArray() : data(0), size(0) {}
+	BundleArray(T const *_data, size_t _size) : data(_data), size(_size) {}
+
+	T const &operator[](size_t i) const { return data[i]; }
+	T const *begin() const { return data; }
+	T const *end() const { return data + size; }
+};
+
+/** Sparse matrix stored in a Bundle, in CSR form.
+Elements of row i are at [rowptr[i], rowptr[i+1]). */
+struct BundleCsr {
+	int nrow, ncol;
+	BundleArray<int32_t> rowptr;
+	BundleArray<int32_t> col;
+	BundleArray<double> val;
+
+	size_t size() const { return val.size; }
+};
+
+/** Read-only, memory-mapped bundle file. */
+class Bundle {
+	std::string _fname;
+	int _fd;
+	char const *_addr;
+	size_t _size;
+	std::map<std::string, BundleSection const *> _sections;
+
+	BundleSection const *section(std::string const &name, BundleType type) const;
+
+public:
+	/** Maps the file and checks its header; throws if it is not
+	a bundle of the current version. */
+	explicit Bundle(std::string const &fname);
+	~Bundle();
+
+	std::string const &fname() const { return _fname; }
+	bool has(std::string const &name) const
+		{ return _sections.find(name) != _sections.end(); }
+
+	template<class T>
+	BundleArray<T> get(std::string const &name) const
+	{
+		BundleSection const *sec = section(name, bundle_type<T>());
+		return BundleArray<T>((T const *)(_addr + sec->offset), sec->count);
+	}
+
+	std::string get_string(std::string const &name) const;
+
+	BundleCsr get_csr(std::string const &name) const;
+};
+
+// ----------------------------------------------------
+/** Identifies the inputs a bundle was built from (file name, size and
+modification time of the GLINT2 config file, and variable name).
+A bundle should only be used with the inputs it was built from.  That
+is not enough on its own: elev2 / mask2 may be replaced after the
+config file is read (eg: from PISM), so also check the "fingerprint"
+array against MatrixMaker::matrix_fingerprint(NULL). */
+std::string bundle_source_stamp(
+	std::string const &config_fname, std::string const &maker_vname);
+
+/** Writes the matrices a GCM needs from a realized MatrixMaker:
+fgice1, hp_to_atm and, for each ice sheet, hp_to_iceinterp(ICE).  The
+MatrixMaker must still be read and realized to use them; the bundle
+saves computing the matrices, not reading the config file.
+@param source Result of bundle_source_stamp(), stored as "source".
+	MatrixMaker::matrix_fingerprint(NULL) is stored as "fingerprint". */
+void write_maker_bundle(MatrixMaker &maker,
+	std::string const &fname, std::string const &source);
+
+}	// namespace glint2
@@ -16,8 +16,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <unordered_map>
+#include <exception>
 #include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include <CGAL/Exact_predicates_exact_constructions_kernel.h>
 #include <CGAL/Boolean_set_operations_2.h>
@@ -28,9 +31,11 @@
 #include <giss/ncutil.hpp>
 
 #include <glint2/ExchangeGrid.hpp>
+#include <glint2/Grid_XY.hpp>
 #include <glint2/gridutil.hpp>
 
 #include <glint2/cgal.hpp>
+#include <glint2/clip_convex.hpp>
 
 namespace glint2 {
 
@@ -46,6 +51,13 @@ struct OCell {
 	/** Bounding box of the polygon, used for search/overlap algorithms. */
 	gc::Iso_rectangle_2 bounding_box;
 
+	/** Same polygon in plain doubles, for the fast overlap path. */
+	std::vector<DPoint> dpoly;
+	double darea;
+
+	/** True if dpoly may be used with clip_convex() */
+	bool convex;
+
 	OCell(Cell const *_cell, giss::Proj2 const &proj);
 };
 
@@ -56,7 +68,10 @@ OCell::OCell(Cell const *_cell, giss::Proj2 const &proj) : cell(_cell)
 		double x, y;
 		proj.transform(vertex->x, vertex->y, x, y);
 		poly.push_back(gc::Point_2(x, y));
+		dpoly.push_back(DPoint(x, y));
 	}
+	darea = signed_area(dpoly);
+	convex = is_convex_ccw(dpoly);
 
 	// Compute the bounding box
 	bounding_box = CGAL::bounding_box(poly.vertices_begin(), poly.vertices_end());
@@ -124,32 +139,33 @@ OGrid::OGrid(Grid const *_grid, giss::Proj2 const &proj) : grid(_grid) {
 void OGrid::realize_rtree() {
 	rtree.reset(new OGrid::RTree);
 
-	double min[2];
-	double max[2];
+	// Bulk-load the RTree all at once
+	std::vector<double> min, max;
+	std::vector<OCell const *> ids;
+	min.reserve(ocells.size() * 2);
+	max.reserve(ocells.size() * 2);
+	ids.reserve(ocells.size());
 	for (auto ii1=ocells.begin(); ii1 != ocells.end(); ++ii1) {
 		OCell &ocell(ii1->second);
 
-		min[0] = CGAL::to_double(ocell.bounding_box.xmin());
-		min[1] = CGAL::to_double(ocell.bounding_box.ymin());
-		max[0] = CGAL::to_double(ocell.bounding_box.xmax());
-		max[1] = CGAL::to_double(ocell.bounding_box.ymax());
+		double min0 = CGAL::to_double(ocell.bounding_box.xmin());
+		double min1 = CGAL::to_double(ocell.bounding_box.ymin());
+		double max0 = CGAL::to_double(ocell.bounding_box.xmax());
+		double max1 = CGAL::to_double(ocell.bounding_box.ymax());
 
-		//fprintf(stderr, "Adding bounding box: (%f %f)  (%f %f)\n", min[0], min[1], max[0], max[1]);
+		//fprintf(stderr, "Adding bounding box: (%f %f)  (%f %f)\n", min0, min1, max0, max1);
 
 		// Deal with floating point...
 		const double eps = 1e-7;
-		double epsilon_x = eps * std::abs(max[0] - min[0]);
-		double epsilon_y = eps * std::abs(max[1] - min[1]);
-		min[0] -= epsilon_x;
-		min[1] -= epsilon_y;
-		max[0] += epsilon_x;
-		max[1] += epsilon_y;
-
-		//std::cout << ocell.poly << std::endl;
-		//std::cout << ocell.bounding_box << std::endl;
-		//printf("(%g,%g) -> (%g,%g)\n", min[0], min[1], max[0], max[1]);
-		rtree->Insert(min, max, &ocell);
+		double epsilon_x = eps * std::abs(max0 - min0);
+		double epsilon_y = eps * std::abs(max1 - min1);
+		min.push_back(min0 - epsilon_x);
+		min.push_back(min1 - epsilon_y);
+		max.push_back(max0 + epsilon_x);
+		max.push_back(max1 + epsilon_y);
+		ids.push_back(&ocell);
 	}
+	rtree->BulkLoad(min, max, ids);
 }
 
 
@@ -162,16 +178,9 @@ void OGrid::realize_rtree() {
 	vertices in grid1 or grid2.  No more than a "best effort" is
 	needed to eliminate duplicate vertices.
 @return Always returns true (tells RTree search algorithm to keep going) */
-static bool overlap_callback(VertexCache *exvcache, long grid2_ndata,
-	OCell const **ocell1p, OCell const *ocell2)
+static inline bool overlap_callback(VertexCache *exvcache, long grid2_ndata,
+	OCell const *ocell1, OCell const *ocell2)
 {
-	// Enable using same boost::function callback for many values of grid1
-	OCell const *ocell1 = *ocell1p;
-
-	// Compute the overlap polygon (CGAL)
-	auto expoly(poly_overlap(ocell1->poly, ocell2->poly));
-	if (expoly.size() == 0) return true;
-
 	// Convert it to a glint2::Cell
 	Cell excell;	// Exchange Cell
 	excell.i = ocell1->cell->index;
@@ -179,11 +188,30 @@ static bool overlap_callback(VertexCache *exvcache, long grid2_ndata,
 //	excell.index = excell.i * grid2_ndata + excell.j;	// guarantee unique
 	excell.index = -1;		// Get an index assigned...
 
-	// Add the vertices of the polygon outline
-	for (auto vertex = expoly.vertices_begin(); vertex != expoly.vertices_end(); ++vertex) {
-		double x = CGAL::to_double(vertex->x());
-		double y = CGAL::to_double(vertex->y());
-		exvcache->add_vertex(excell, x, y);
+	// Fast path: clip convex cells in floating point
+	ClipResult clip = ClipResult::DEGENERATE;
+	if (ocell1->convex && ocell2->convex) {
+		std::vector<DPoint> dexpoly;
+		clip = clip_convex(ocell1->dpoly, ocell1->darea,
+			ocell2->dpoly, ocell2->darea, dexpoly);
+		if (clip == ClipResult::EMPTY) return true;
+		if (clip == ClipResult::OVERLAP) {
+			for (auto vertex = dexpoly.begin(); vertex != dexpoly.end(); ++vertex)
+				exvcache->add_vertex(excell, vertex->x, vertex->y);
+		}
+	}
+
+	if (clip == ClipResult::DEGENERATE) {
+		// Non-convex or degenerate: compute the overlap polygon (CGAL)
+		auto expoly(poly_overlap(ocell1->poly, ocell2->poly));
+		if (expoly.size() == 0) return true;
+
+		// Add the vertices of the polygon outline
+		for (auto vertex = expoly.vertices_begin(); vertex != expoly.vertices_end(); ++vertex) {
+			double x = CGAL::to_double(vertex->x());
+			double y = CGAL::to_double(vertex->y());
+			exvcache->add_vertex(excell, x, y);
+		}
 	}
 
 	// Compute its area (we will need this)
@@ -196,9 +224,258 @@ static bool overlap_callback(VertexCache *exvcache, long grid2_ndata,
 }
 // --------------------------------------------------------------------
 
+/** Bounding boxes of the grid1 cells, used as queries into
+the RTree of grid2. */
+struct OverlapQueries {
+	std::vector<OCell const *> ocells1;
+	std::vector<double> min, max;		// [ocells1.size() * 2]
+
+	OverlapQueries(OGrid const &ogrid1);
+
+	/** Reorders the queries to the order in which
+	OGrid::RTree::SearchBatch() would run them. */
+	void batch_order();
+};
+
+OverlapQueries::OverlapQueries(OGrid const &ogrid1)
+{
+	ocells1.reserve(ogrid1.ocells.size());
+	min.reserve(ogrid1.ocells.size() * 2);
+	max.reserve(ogrid1.ocells.size() * 2);
+	for (auto ii1 = ogrid1.ocells.begin(); ii1 != ogrid1.ocells.end(); ++ii1) {
+		OCell const *ocell1 = &ii1->second;
+		ocells1.push_back(ocell1);
+		min.push_back(CGAL::to_double(ocell1->bounding_box.xmin()));
+		min.push_back(CGAL::to_double(ocell1->bounding_box.ymin()));
+		max.push_back(CGAL::to_double(ocell1->bounding_box.xmax()));
+		max.push_back(CGAL::to_double(ocell1->bounding_box.ymax()));
+	}
+}
+
+void OverlapQueries::batch_order()
+{
+	std::vector<int> order(OGrid::RTree::BatchOrder(
+		ocells1.size(), min.data(), max.data()));
+
+	std::vector<OCell const *> ocells1_new;
+	std::vector<double> min_new, max_new;
+	ocells1_new.reserve(order.size());
+	min_new.reserve(min.size());
+	max_new.reserve(max.size());
+	for (auto ii = order.begin(); ii != order.end(); ++ii) {
+		ocells1_new.push_back(ocells1[*ii]);
+		for (int k=0; k<2; ++k) {
+			min_new.push_back(min[*ii*2 + k]);
+			max_new.push_back(max[*ii*2 + k]);
+		}
+	}
+	ocells1.swap(ocells1_new);
+	min.swap(min_new);
+	max.swap(max_new);
+}
+// --------------------------------------------------------------------
+/** Exchange cells computed (on some thread) for one block of grid1
+cells.  Results go in a private Grid, with its own VertexCache, so
+threads never touch the exchange grid itself. */
+struct OverlapBlock {
+	Grid grid;
+	VertexCache vcache;
+
+	OverlapBlock() : grid(Grid::Type::EXCHANGE), vcache(&grid) {}
+};
+
+/** Shared state for the worker threads in the parallel
+ExchangeGrid constructor. */
+struct OverlapWork {
+	OverlapQueries const *queries;		// grid1 cells, in serial order
+	OGrid const *ogrid2;
+	long grid2_ndata;
+	int block_size;
+	std::vector<std::unique_ptr<OverlapBlock>> blocks;
+
+	boost::mutex mutex;		// Protects next_block and error
+	int next_block;
+	/** First exception thrown by a worker; stops the others */
+	std::exception_ptr error;
+
+	/** Thread body: grabs blocks until there are none left. */
+	void run();
+};
+
+void OverlapWork::run()
+{
+	for (;;) {
+		int iblock;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			if (error || next_block >= (int)blocks.size()) return;
+			iblock = next_block++;
+		}
+		VertexCache *vcache = &blocks[iblock]->vcache;
+
+		try {
+			int i1_end = std::min((int)queries->ocells1.size(), (iblock+1) * block_size);
+			for (int i1 = iblock * block_size; i1 < i1_end; ++i1) {
+				OCell const *ocell1 = queries->ocells1[i1];
+				ogrid2->rtree->Search(&queries->min[i1*2], &queries->max[i1*2],
+					[&](OCell const *ocell2) -> bool
+						{ return overlap_callback(vcache, grid2_ndata, ocell1, ocell2); });
+			}
+		} catch(...) {
+			// Don't let it escape the thread (std::terminate); the
+			// main thread rethrows it after join_all().
+			boost::lock_guard<boost::mutex> lock(mutex);
+			if (!error) error = std::current_exception();
+			return;
+		}
+	}
+}
+// --------------------------------------------------------------------
+
+/** Computes the overlaps of grid1 against ogrid2 on nthread threads,
+and adds them to the exchange grid behind exvcache.  grid1 cells are
+processed in blocks; blocks are merged in the same order the serial
+SearchBatch() visits grid1 cells, so the resulting cells, vertices and
+indices are identical to the serial algorithm no matter how many
+threads are used.
+NOTE: Worker threads share (read-only) the CGAL polygons of ogrid2,
+so CGAL must be built with thread support (CGAL_HAS_THREADS). */
+static void overlap_parallel(OverlapQueries &queries, OGrid const &ogrid2,
+	VertexCache &exvcache, long grid2_ndata, int nthread)
+{
+	queries.batch_order();
+
+	OverlapWork work;
+	work.queries = &queries;
+	work.ogrid2 = &ogrid2;
+	work.grid2_ndata = grid2_ndata;
+	work.next_block = 0;
+
+	// Several blocks per thread, for load balancing
+	int n1 = queries.ocells1.size();
+	work.block_size = std::max(1, n1 / (nthread * 16));
+	int nblock = (n1 + work.block_size - 1) / work.block_size;
+	for (int i=0; i<nblock; ++i)
+		work.blocks.push_back(std::unique_ptr<OverlapBlock>(new OverlapBlock));
+
+	printf("ExchangeGrid: %d grid1 cells in %d blocks on %d threads\n",
+		n1, nblock, nthread);
+	boost::thread_group threads;
+	for (int i=0; i<nthread; ++i)
+		threads.create_thread(boost::bind(&OverlapWork::run, &work));
+	threads.join_all();
+	if (work.error) std::rethrow_exception(work.error);
+
+	// Merge the blocks, in order.  Cells were added to each block grid
+	// with sequential indices, so iterating by index gives the order in
+	// which the serial algorithm would have added them.
+	Grid *exgrid = exvcache.grid;
+	for (int iblock=0; iblock < nblock; ++iblock) {
+		Grid &bgrid(work.blocks[iblock]->grid);
+		for (auto bcell = bgrid.cells_begin(); bcell != bgrid.cells_end(); ++bcell) {
+			Cell excell;
+			excell.i = bcell->i;
+			excell.j = bcell->j;
+			excell.index = -1;		// Get an index assigned...
+			excell.reserve(bcell->size());
+			for (auto vertex = bcell->begin(); vertex != bcell->end(); ++vertex)
+				exvcache.add_vertex(excell, vertex->x, vertex->y);
+			excell.area = bcell->area;
+			exgrid->add_cell(std::move(excell));
+		}
+		work.blocks[iblock].reset();	// Free memory as we go
+
+		printf("Merged block %d of %d, total overlaps = %ld\n",
+			iblock+1, nblock, exgrid->ncells_realized());
+	}
+}
+// --------------------------------------------------------------------
+
+// --------------------------------------------------------------------
+/** Overlap of two sets of 1-D cell boundaries, for overlap_xy().
+Segments are stored CSR-style by cell of the first set of boundaries:
+segments for cell i1 are [start[i1], start[i1+1]). */
+struct Overlap1D {
+	std::vector<int> start;		// [n1+1]
+	std::vector<int> i2;		// Cell in the second set
+	std::vector<double> lo, hi;	// Extent of the overlap
+
+	/** Merges two sorted boundary arrays, in O(nb1 + nb2 + noverlap). */
+	Overlap1D(std::vector<double> const &b1, std::vector<double> const &b2);
+};
+
+Overlap1D::Overlap1D(std::vector<double> const &b1, std::vector<double> const &b2)
+{
+	int n1 = b1.size() - 1;
+	int n2 = b2.size() - 1;
+	start.reserve(n1+1);
+
+	int k2 = 0;
+	for (int k1=0; k1<n1; ++k1) {
+		start.push_back(i2.size());
+
+		// Skip cells of b2 that lie entirely below this cell of b1
+		while (k2 < n2 && b2[k2+1] <= b1[k1]) ++k2;
+
+		for (int j=k2; j < n2 && b2[j] < b1[k1+1]; ++j) {
+			double const l = std::max(b1[k1], b2[j]);
+			double const h = std::min(b1[k1+1], b2[j+1]);
+			if (h <= l) continue;
+			i2.push_back(j);
+			lo.push_back(l);
+			hi.push_back(h);
+		}
+	}
+	start.push_back(i2.size());
+}
+
+/** Computes the exchange grid between two Grid_XY in the same projection,
+without any polygon clipping.  Since all cells are axis-aligned
+rectangles, overlaps are found by merging the boundary arrays
+along x and y separately.  Cost is O(n1 + n2 + noverlap). */
+static void overlap_xy(Grid_XY const &grid1, Grid_XY const &grid2,
+	VertexCache &exvcache)
+{
+	Overlap1D xover(grid1.xb, grid2.xb);
+	Overlap1D yover(grid1.yb, grid2.yb);
+
+	Grid *exgrid = exvcache.grid;
+	for (int iy1=0; iy1 < grid1.ny(); ++iy1) {
+	for (int ix1=0; ix1 < grid1.nx(); ++ix1) {
+		long index1 = grid1.ij_to_index(ix1, iy1);
+		if (!grid1.get_cell(index1)) continue;		// Not realized
+
+		for (int ky = yover.start[iy1]; ky < yover.start[iy1+1]; ++ky) {
+		for (int kx = xover.start[ix1]; kx < xover.start[ix1+1]; ++kx) {
+			long index2 = grid2.ij_to_index(xover.i2[kx], yover.i2[ky]);
+			if (!grid2.get_cell(index2)) continue;	// Not realized
+
+			double const x0 = xover.lo[kx];
+			double const x1 = xover.hi[kx];
+			double const y0 = yover.lo[ky];
+			double const y1 = yover.hi[ky];
+
+			Cell excell;
+			excell.i = index1;
+			excell.j = index2;
+			excell.index = -1;		// Get an index assigned...
+			excell.reserve(4);
+			exvcache.add_vertex(excell, x0, y0);
+			exvcache.add_vertex(excell, x1, y0);
+			exvcache.add_vertex(excell, x1, y1);
+			exvcache.add_vertex(excell, x0, y1);
+			excell.area = (x1 - x0) * (y1 - y0);
+
+			exgrid->add_cell(std::move(excell));
+		}}
+	}}
+	printf("ExchangeGrid (XY): total overlaps = %ld\n", exgrid->ncells_realized());
+}
+// --------------------------------------------------------------------
+
 /** @param grid2 Put in an RTree */
 //std::unique_ptr<Grid> compute_exchange_grid
-ExchangeGrid::ExchangeGrid(Grid const &grid1, Grid const &grid2, std::string const &_sproj)
+ExchangeGrid::ExchangeGrid(Grid const &grid1, Grid const &grid2, std::string const &_sproj, int nthread)
 : Grid(Grid::Type::EXCHANGE)
 {
 	coordinates = Grid::Coordinates::XY;
@@ -248,37 +525,43 @@ ExchangeGrid::ExchangeGrid(Grid const &grid1, Grid const &grid2, std::string con
 	exgrid->_nvertices_full = -1;	// Not specified
 	VertexCache exvcache(exgrid);
 
+	// Two Cartesian grids in the same projection: no clipping needed
+	auto grid1_xy = dynamic_cast<Grid_XY const *>(&grid1);
+	auto grid2_xy = dynamic_cast<Grid_XY const *>(&grid2);
+	if (grid1_xy && grid2_xy) {
+		overlap_xy(*grid1_xy, *grid2_xy, exvcache);
+		return;
+	}
+
 	OGrid ogrid1(&grid1, proj1);
 	OGrid ogrid2(&grid2, proj2);
 	ogrid2.realize_rtree();
 
-	OCell const *ocell1;
-	auto callback(boost::bind(&overlap_callback, &exvcache,
-		grid2.ndata(), &ocell1, _1));
-
-	int nprocessed=0;
-	for (auto ii1 = ogrid1.ocells.begin(); ii1 != ogrid1.ocells.end(); ++ii1) {
-		ocell1 = &ii1->second;		// Set parameter for the callback
-
-		double min[2];
-		double max[2];
-
-//printf("grid1[%d]: x in (%f - %f), y in (%f - %f)\n", ocell1->cell->index, min[0], max[0], min[1], max[1]);
-
-		min[0] = CGAL::to_double(ocell1->bounding_box.xmin());
-		min[1] = CGAL::to_double(ocell1->bounding_box.ymin());
-		max[0] = CGAL::to_double(ocell1->bounding_box.xmax());
-		max[1] = CGAL::to_double(ocell1->bounding_box.ymax());
-
-		int nfound = ogrid2.rtree->Search(min, max, callback);
+	OverlapQueries queries(ogrid1);
+	if (nthread > 1) {
+		overlap_parallel(queries, ogrid2, exvcache, grid2.ndata(), nthread);
+		return;
+	}
 
+	long const grid2_ndata = grid2.ndata();
+	int const nquery = queries.ocells1.size();
+	int nprocessed = 0;
+	int last_i1 = -1;
+	ogrid2.rtree->SearchBatch(nquery, queries.min.data(), queries.max.data(),
+		[&](int i1, OCell const *ocell2) -> bool
+	{
 		// Logging
-		++nprocessed;
-		if (nprocessed % 10 == 0) {
-			printf("Processed %d of %d from grid1, total overlaps = %d\n",
-				nprocessed+1, ogrid1.ocells.size(), exgrid->ncells_realized());
+		if (i1 != last_i1) {
+			last_i1 = i1;
+			++nprocessed;
+			if (nprocessed % 10 == 0) {
+				printf("Processed %d of %d from grid1, total overlaps = %ld\n",
+					nprocessed, nquery, exgrid->ncells_realized());
+			}
 		}
-	}
+
+		return overlap_callback(&exvcache, grid2_ndata, queries.ocells1[i1], ocell2);
+	});
 }
 
 // ---------------------------------------------------------------
@@ -295,9 +578,10 @@ boost::function<void ()> ExchangeGrid::netcdf_define(NcFile &nc, std::string con
 	return parent;
 }
 
-void ExchangeGrid::read_from_netcdf(NcFile &nc, std::string const &vname)
+void ExchangeGrid::read_from_netcdf(NcFile &nc, std::string const &vname,
+	CellFilter const &include_cell)
 {
-	Grid::read_from_netcdf(nc, vname);
+	Grid::read_from_netcdf(nc, vname, include_cell);
 
 	NcVar *info_var = nc.get_var((vname + ".info").c_str());
 	grid1_ncells_full = giss::get_att(info_var, "grid1.ncells_full")->as_int(0);
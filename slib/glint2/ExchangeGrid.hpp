@@ -35,14 +35,17 @@ public :
 	long grid2_ncells_full;
 
 	/** @param proj Projection to use to project Lon/Lat grids to XY,
-	if no projection is found in the XY-type grid. */
-	ExchangeGrid(Grid const &grid1, Grid const &grid2, std::string const &_sproj="");
+	if no projection is found in the XY-type grid.
+	@param nthread Number of threads to use computing overlaps.
+	The result does not depend on the number of threads. */
+	ExchangeGrid(Grid const &grid1, Grid const &grid2, std::string const &_sproj="", int nthread=1);
 
 	ExchangeGrid(): Grid(Grid::Type::EXCHANGE) {}
 
 	virtual boost::function<void()> netcdf_define(NcFile &nc, std::string const &vname) const;
 
-	virtual void read_from_netcdf(NcFile &nc, std::string const &vname);
+	virtual void read_from_netcdf(NcFile &nc, std::string const &vname,
+		CellFilter const &include_cell = CellFilter());
 
 };
 
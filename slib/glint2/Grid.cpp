@@ -72,6 +72,13 @@ extern double area_of_proj_polygon(Cell const &cell, giss::Proj2 const &proj)
 	return ret;
 }
 
+// ------------------------------------------------------------
+static bool filter_by_index(boost::function<bool (int)> const &include_index, Cell const &cell)
+	{ return include_index(cell.index); }
+
+CellFilter cell_index_filter(boost::function<bool (int)> const &include_index)
+	{ return boost::bind(&filter_by_index, include_index, _1); }
+
 // ------------------------------------------------------------
 Grid::Grid(Type _type) :
 	type(_type),
@@ -205,15 +212,15 @@ printf("Grid::netcdf_write(%s) 1\n", vname.c_str());
 	NcVar *vertices_xy_var = nc->get_var((vname + ".vertices.xy").c_str());
 
 	std::vector<Vertex *> vertices(_vertices.sorted());	// Sort by index
-	int i=0;
-	for (auto vertex = vertices.begin(); vertex != vertices.end(); ++i, ++vertex) {
-		vertices_index_var->set_cur(i);
-		vertices_index_var->put(&(*vertex)->index, 1);
-
-		double point[2] = {(*vertex)->x, (*vertex)->y};
-		vertices_xy_var->set_cur(i, 0);
-		vertices_xy_var->put(point, 1, 2);
+	giss::NcBufferedWriter<int> vertices_index_w(vertices_index_var);
+	giss::NcBufferedWriter<double> vertices_xy_w(vertices_xy_var, 2);
+	for (auto vertex = vertices.begin(); vertex != vertices.end(); ++vertex) {
+		vertices_index_w.add((*vertex)->index);
+		vertices_xy_w.add((*vertex)->x);
+		vertices_xy_w.add((*vertex)->y);
 	}
+	vertices_index_w.flush();
+	vertices_xy_w.flush();
 
 printf("Grid::netcdf_write() 2\n");
 	// -------- Write out the cells (and vertex references)
@@ -231,35 +238,38 @@ printf("Grid::netcdf_write() 2\n");
 
 printf("Grid::netcdf_write() 3\n");
 	std::vector<Cell *> cells(_cells.sorted());
+	giss::NcBufferedWriter<int> cells_index_w(cells_index_var);
+	giss::NcBufferedWriter<int> cells_ijk_w(cells_ijk_var, 3);
+	giss::NcBufferedWriter<double> cells_area_w(cells_area_var);
+	giss::NcBufferedWriter<int> cells_vertex_refs_w(cells_vertex_refs_var);
+	giss::NcBufferedWriter<int> cells_vertex_refs_start_w(cells_vertex_refs_start_var);
 	int ivref = 0;
-	i=0;
-	for (auto celli = cells.begin(); celli != cells.end(); ++i, ++celli) {
+	for (auto celli = cells.begin(); celli != cells.end(); ++celli) {
 		Cell *cell(*celli);
 
 		// Write general cell contents
-		cells_index_var->set_cur(i);
-		cells_index_var->put(&cell->index, 1);
-
-		int ijk[3] = {cell->i, cell->j, cell->k};
-		cells_ijk_var->set_cur(i, 0);
-		cells_ijk_var->put(ijk, 1, 3);
-
-		cells_area_var->set_cur(i);
-		cells_area_var->put(&cell->area, 1);
+		cells_index_w.add(cell->index);
+		cells_ijk_w.add(cell->i);
+		cells_ijk_w.add(cell->j);
+		cells_ijk_w.add(cell->k);
+		cells_area_w.add(cell->area);
 
 		// Write vertex indices for this cell
-		cells_vertex_refs_start_var->set_cur(i);
-		cells_vertex_refs_start_var->put(&ivref, 1);
+		cells_vertex_refs_start_w.add(ivref);
 		for (auto vertex = cell->begin(); vertex != cell->end(); ++vertex) {
-			cells_vertex_refs_var->set_cur(ivref);
-			cells_vertex_refs_var->put(&vertex->index, 1);
+			cells_vertex_refs_w.add(vertex->index);
 			++ivref;
 		}
 	}
 
 	// Write out a sentinel for polygon index bounds
-	cells_vertex_refs_start_var->set_cur(i);
-	cells_vertex_refs_start_var->put(&ivref, 1);
+	cells_vertex_refs_start_w.add(ivref);
+
+	cells_index_w.flush();
+	cells_ijk_w.flush();
+	cells_area_w.flush();
+	cells_vertex_refs_w.flush();
+	cells_vertex_refs_start_w.flush();
 printf("Grid::netcdf_write() 5\n");
 }
 
@@ -312,20 +322,23 @@ printf("netcdf_define(%s) 2\n", vname.c_str());
 
 printf("netcdf_define(%s) 3\n", vname.c_str());
 	// --------- Variables
-	nc.add_var((vname + ".vertices.index").c_str(), ncInt, nvertices_dim);
-	nc.add_var((vname + ".vertices.xy").c_str(), ncDouble, nvertices_dim, two_dim);
+	std::vector<NcVar *> vars;
+	vars.push_back(nc.add_var((vname + ".vertices.index").c_str(), ncInt, nvertices_dim));
+	vars.push_back(nc.add_var((vname + ".vertices.xy").c_str(), ncDouble, nvertices_dim, two_dim));
 
-	nc.add_var((vname + ".cells.index").c_str(), ncInt, ncells_dim);
-	nc.add_var((vname + ".cells.ijk").c_str(), ncInt, ncells_dim, three_dim);
+	vars.push_back(nc.add_var((vname + ".cells.index").c_str(), ncInt, ncells_dim));
+	vars.push_back(nc.add_var((vname + ".cells.ijk").c_str(), ncInt, ncells_dim, three_dim));
 //	nc.add_var((vname + ".cells.i").c_str(), ncInt, ncells_dim);
 //	nc.add_var((vname + ".cells.j").c_str(), ncInt, ncells_dim);
 //	nc.add_var((vname + ".cells.k").c_str(), ncInt, ncells_dim);
-	nc.add_var((vname + ".cells.area").c_str(), ncDouble, ncells_dim);
+	vars.push_back(nc.add_var((vname + ".cells.area").c_str(), ncDouble, ncells_dim));
 //	nc.add_var((vname + ".cells.native_area").c_str(), ncDouble, ncells_dim);
 //	nc.add_var((vname + ".cells.proj_area").c_str(), ncDouble, ncells_dim);
 
-	nc.add_var((vname + ".cells.vertex_refs").c_str(), ncInt, nvrefs_dim);
-	nc.add_var((vname + ".cells.vertex_refs_start").c_str(), ncInt, ncells_plus_1_dim);
+	vars.push_back(nc.add_var((vname + ".cells.vertex_refs").c_str(), ncInt, nvrefs_dim));
+	vars.push_back(nc.add_var((vname + ".cells.vertex_refs_start").c_str(), ncInt, ncells_plus_1_dim));
+	for (auto var = vars.begin(); var != vars.end(); ++var)
+		giss::set_nc_storage(nc, *var);
 
 printf("netcdf_define(%s) 4\n", vname.c_str());
 	return boost::bind(&Grid::netcdf_write, this, &nc, vname);
@@ -335,7 +348,8 @@ printf("netcdf_define(%s) 4\n", vname.c_str());
 @param vname Eg: "grid1" or "grid2" */
 void Grid::read_from_netcdf(
 NcFile &nc,
-std::string const &vname)
+std::string const &vname,
+CellFilter const &include_cell)
 {
 	clear();
 
@@ -363,62 +377,118 @@ std::string const &vname)
 
 	printf("Grid::read_from_netcdf(%s) 2\n", vname.c_str());
 
+	// ---------- Choose the Cells
+	// Scan cell indices in chunks, keeping only the cells we want
+	NcVar *cells_index_var = nc.get_var((vname + ".cells.index").c_str());
+	NcVar *cells_ijk_var = nc.get_var((vname + ".cells.ijk").c_str());
+	long ncells = cells_index_var->get_dim(0)->size();
+
+	std::vector<Cell> cells;
+	std::vector<long> cell_rows;		// Position of each chosen cell in the file
+	long const chunk = 1L << 16;
+	std::vector<int> index_buf;
+	std::vector<int> ijk_buf;
+	for (long r0 = 0; r0 < ncells; r0 += chunk) {
+		long n = std::min(chunk, ncells - r0);
+		index_buf.resize(n);
+		ijk_buf.resize(n*3);
+		cells_index_var->set_cur(r0);
+		cells_index_var->get(&index_buf[0], n);
+		cells_ijk_var->set_cur(r0, 0);
+		cells_ijk_var->get(&ijk_buf[0], n, 3);
+
+		for (long i=0; i<n; ++i) {
+			Cell cell;
+			cell.index = index_buf[i];
+			cell.i = ijk_buf[i*3 + 0];
+			cell.j = ijk_buf[i*3 + 1];
+			cell.k = ijk_buf[i*3 + 2];
+			if (include_cell && !include_cell(cell)) continue;
+
+			cells.push_back(std::move(cell));
+			cell_rows.push_back(r0 + i);
+		}
+	}
+
+	printf("Grid::read_from_netcdf(%s) 3: %ld of %ld cells\n", vname.c_str(), (long)cells.size(), ncells);
+
+	// ---------- Read the rest of the chosen cells
+	std::vector<double> cells_area(giss::read_rows<double>(
+		nc.get_var((vname + ".cells.area").c_str()), cell_rows));
+
+	// Vertex references of cell in row r are vrefs[vrefs_start[r]:vrefs_start[r+1]]
+	std::vector<long> start_rows;
+	start_rows.reserve(cell_rows.size() * 2);
+	for (auto r = cell_rows.begin(); r != cell_rows.end(); ++r) {
+		if (start_rows.size() == 0 || start_rows.back() != *r)
+			start_rows.push_back(*r);
+		start_rows.push_back(*r + 1);
+	}
+	std::vector<int> vrefs_start(giss::read_rows<int>(
+		nc.get_var((vname + ".cells.vertex_refs_start").c_str()), start_rows));
+
+	std::vector<long> vref_rows;
+	std::vector<long> cells_vstart;		// Where each chosen cell's refs begin in vrefs
+	cells_vstart.reserve(cells.size() + 1);
+	for (size_t i=0, is=0; i < cell_rows.size(); ++i) {
+		while (start_rows[is] != cell_rows[i]) ++is;
+		cells_vstart.push_back(vref_rows.size());
+		for (long j = vrefs_start[is]; j < vrefs_start[is+1]; ++j)
+			vref_rows.push_back(j);
+	}
+	cells_vstart.push_back(vref_rows.size());
+	std::vector<int> vrefs(giss::read_rows<int>(
+		nc.get_var((vname + ".cells.vertex_refs").c_str()), vref_rows));
+
+	printf("Grid::read_from_netcdf(%s) 4\n", vname.c_str());
+
 	// ---------- Read the Vertices
-	// Basic Info
 	std::vector<int> vertices_index(
 		giss::read_int_vector(nc, vname + ".vertices.index"));
 
+	// Choose the vertices used by our cells (or all of them)
+	std::vector<long> vertex_rows;
+	if (include_cell) {
+		std::vector<int> used(vrefs);
+		std::sort(used.begin(), used.end());
+		used.erase(std::unique(used.begin(), used.end()), used.end());
+		for (size_t i=0; i < vertices_index.size(); ++i) {
+			if (std::binary_search(used.begin(), used.end(), vertices_index[i]))
+				vertex_rows.push_back(i);
+		}
+	} else {
+		vertex_rows.reserve(vertices_index.size());
+		for (size_t i=0; i < vertices_index.size(); ++i) vertex_rows.push_back(i);
+	}
+
 	// Read points 2-d array as single vector (double)
-	NcVar *vertices_xy_var = nc.get_var((vname + ".vertices.xy").c_str());
-	long npoints = vertices_xy_var->get_dim(0)->size();
-	std::vector<double> vertices_xy(npoints*2);
-	vertices_xy_var->get(&vertices_xy[0], npoints, 2);
+	std::vector<double> vertices_xy(giss::read_rows<double>(
+		nc.get_var((vname + ".vertices.xy").c_str()), vertex_rows, 2));
 
 	// Assemble into vertices
-	for (size_t i=0; i < vertices_index.size(); ++i) {
-		long index = vertices_index[i];
+	for (size_t i=0; i < vertex_rows.size(); ++i) {
+		long index = vertices_index[vertex_rows[i]];
 		double x = vertices_xy[i*2];
 		double y = vertices_xy[i*2 + 1];
 		add_vertex(Vertex(x, y, index));
 	}
-	printf("Grid::read_from_netcdf(%s) 3\n", vname.c_str());
-
-	// ---------- Read the Cells
-	std::vector<int> cells_index(giss::read_int_vector(nc, vname + ".cells.index"));
 
-	NcVar *cells_ijk_var = nc.get_var((vname + ".cells.ijk").c_str());
-	long ncells = cells_ijk_var->get_dim(0)->size();
-	std::vector<int> cells_ijk(ncells*3);
-	cells_ijk_var->get(&cells_ijk[0], ncells, 3);
-
-	std::vector<double> cells_area(giss::read_double_vector(nc, vname + ".cells.area"));
-
-	std::vector<int> vrefs(giss::read_int_vector(nc, vname + ".cells.vertex_refs"));
-	std::vector<int> vrefs_start(giss::read_int_vector(nc, vname + ".cells.vertex_refs_start"));
-
-	printf("Grid::read_from_netcdf(%s) 4\n", vname.c_str());
+	printf("Grid::read_from_netcdf(%s) 5\n", vname.c_str());
 
 	// Assemble into Cells
-	for (size_t i=0; i < cells_index.size(); ++i) {
-		long index = cells_index[i];
-
-		Cell cell;
-		cell.index = cells_index[i];
-		cell.i = cells_ijk[i*3 + 0];
-		cell.j = cells_ijk[i*3 + 1];
-		cell.k = cells_ijk[i*3 + 2];
-
+	for (size_t i=0; i < cells.size(); ++i) {
+		Cell &cell(cells[i]);
 		cell.area = cells_area[i];
 
 		// Add the vertices
-		cell.reserve(vrefs_start[i+1] - vrefs_start[i]);
-		for (int j = vrefs_start[i]; j < vrefs_start[i+1]; ++j)
+		cell.reserve(cells_vstart[i+1] - cells_vstart[i]);
+		for (long j = cells_vstart[i]; j < cells_vstart[i+1]; ++j)
 			cell.add_vertex(get_vertex(vrefs[j]));
 
 		// Add thecell to the grid
 		add_cell(std::move(cell));
 	}
-	printf("Grid::read_from_netcdf(%s) 5 (done)\n", vname.c_str());
+	printf("Grid::read_from_netcdf(%s) 6 (done)\n", vname.c_str());
 }
 
 void Grid::to_netcdf(std::string const &fname)
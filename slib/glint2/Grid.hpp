@@ -97,8 +97,23 @@ public:
 
 	Cell() { clear(); }
 };		// class Cell
+
+/** Chooses cells to keep when reading a grid; for example, cells
+in our MPI domain.  Only the index, i, j and k of the cell are set
+when this is called. */
+typedef boost::function<bool (Cell const &)> CellFilter;
+
+/** @return A CellFilter that chooses cells by their index. */
+CellFilter cell_index_filter(boost::function<bool (int)> const &include_index);
 // ----------------------------------------------------
 class Grid {
+	/** TODO: Each Cell and Vertex here is allocated separately, and each
+	Cell has its own vector of Vertex pointers.  Flat arrays (x/y per
+	vertex, cell->vertex offsets in CSR form, dense index arrays) would
+	be much smaller and faster to iterate.  But the API below hands out
+	the HashDict iterators themselves (see cells_erase()), and a Cell*
+	that owns its vertex list; so compact storage means changing that
+	API and everything that uses it, not just swapping the backend. */
 	giss::HashDict<int, Vertex> _vertices;
 	giss::HashDict<int, Cell> _cells;
 
@@ -217,7 +232,10 @@ protected:
 
 public:
 	virtual boost::function<void()> netcdf_define(NcFile &nc, std::string const &vname) const;
-	virtual void read_from_netcdf(NcFile &nc, std::string const &vname);
+	/** @param include_cell If set, only the cells it accepts (and
+	their vertices) are read from the file. */
+	virtual void read_from_netcdf(NcFile &nc, std::string const &vname,
+		CellFilter const &include_cell = CellFilter());
 
 	void to_netcdf(std::string const &fname);
 
@@ -228,7 +246,8 @@ public:
 
 };
 
-std::unique_ptr<Grid> read_grid(NcFile &nc, std::string const &vname);
+std::unique_ptr<Grid> read_grid(NcFile &nc, std::string const &vname,
+	CellFilter const &include_cell = CellFilter());
 
 
 
@@ -277,9 +277,10 @@ boost::function<void ()> Grid_LonLat::netcdf_define(NcFile &nc, std::string cons
 }
 // ---------------------------------------------------------
 
-void Grid_LonLat::read_from_netcdf(NcFile &nc, std::string const &vname)
+void Grid_LonLat::read_from_netcdf(NcFile &nc, std::string const &vname,
+	CellFilter const &include_cell)
 {
-	Grid::read_from_netcdf(nc, vname);
+	Grid::read_from_netcdf(nc, vname, include_cell);
 
 	NcVar *info_var = nc.get_var((vname + ".info").c_str());
 	north_pole = (giss::get_att(info_var, "north_pole_cap")->as_int(0) != 0);
@@ -132,9 +132,10 @@ boost::function<void ()> Grid_XY::netcdf_define(NcFile &nc, std::string const &v
 	return boost::bind(&Grid_XY_netcdf_write, parent, &nc, this, vname);
 }
 
-void Grid_XY::read_from_netcdf(NcFile &nc, std::string const &vname)
+void Grid_XY::read_from_netcdf(NcFile &nc, std::string const &vname,
+	CellFilter const &include_cell)
 {
-	Grid::read_from_netcdf(nc, vname);
+	Grid::read_from_netcdf(nc, vname, include_cell);
 
 	xb = giss::read_double_vector(nc, vname + ".x_boundaries");
 	yb = giss::read_double_vector(nc, vname + ".y_boundaries");
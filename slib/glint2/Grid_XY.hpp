@@ -94,7 +94,8 @@ public:
 public:
 	virtual boost::function<void()> netcdf_define(NcFile &nc, std::string const &vname) const;
 
-	virtual void read_from_netcdf(NcFile &nc, std::string const &vname);
+	virtual void read_from_netcdf(NcFile &nc, std::string const &vname,
+		CellFilter const &include_cell = CellFilter());
 
 };
 
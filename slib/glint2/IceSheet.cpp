@@ -17,6 +17,8 @@
  */
 
 #include <cstdio>
+#include <cstring>
+#include <cstdint>
 #include <unordered_set>
 #include <glint2/MatrixMaker.hpp>
 #include <glint2/IceSheet.hpp>
@@ -27,7 +29,8 @@
 namespace glint2 {
 
 // -----------------------------------------------------
-IceSheet::IceSheet() : interp_style(InterpStyle::Z_INTERP), name("icesheet") {}
+IceSheet::IceSheet() : _elev2_version(0), _mask2_version(0), _elev2_mask2_checksum(0),
+	interp_style(InterpStyle::Z_INTERP), name("icesheet") {}
 
 IceSheet::~IceSheet() {}
 
@@ -74,15 +77,53 @@ void IceSheet::realize()
 			name.c_str(), elev2.extent(0), n2);
 		throw std::exception();
 	}
+
+	_elev2_mask2_checksum = elev2_mask2_checksum();
+}
+// -----------------------------------------------------
+void IceSheet::elev2_mask2_changed(std::vector<int> const *i2s)
+{
+	update_elev2_mask2(i2s);
+	_elev2_mask2_checksum = elev2_mask2_checksum();
+}
+
+bool IceSheet::check_elev2_mask2()
+{
+	if (elev2_mask2_checksum() == _elev2_mask2_checksum) return false;
+printf("IceSheet::check_elev2_mask2(%s): elev2/mask2 changed without elev2_mask2_changed()\n", name.c_str());
+	elev2_mask2_changed(NULL);
+	return true;
+}
+
+/** FNV-1a, a word at a time */
+static inline void checksum_add(size_t &h, uint64_t word)
+{
+	h ^= word;
+	h *= 1099511628211ULL;
+}
+
+size_t IceSheet::elev2_mask2_checksum() const
+{
+	size_t h = 14695981039346656037ULL;
+	checksum_add(h, elev2.extent(0));
+	for (int i=elev2.lbound(0); i<=elev2.ubound(0); ++i) {
+		uint64_t bits;
+		double const e2 = elev2(i);
+		memcpy(&bits, &e2, sizeof(bits));
+		checksum_add(h, bits);
+	}
+
+	checksum_add(h, mask2.get() ? mask2->extent(0) : -1);
+	if (mask2.get()) for (int i=mask2->lbound(0); i<=mask2->ubound(0); ++i)
+		checksum_add(h, (*mask2)(i));
+	return h;
 }
 // -----------------------------------------------------
-std::unique_ptr<giss::VectorSparseMatrix>
+giss::DiagonalMatrix
 IceSheet::atm_proj_correct(ProjCorrect direction)
 {
 	int n1 = gcm->n1();
-	std::unique_ptr<giss::VectorSparseMatrix> ret(
-		new giss::VectorSparseMatrix(
-		giss::SparseDescr(n1, n1)));
+	giss::DiagonalMatrix ret(n1, 0.0);
 
 	giss::Proj2 proj;
 	gcm->grid1->get_ll_to_xy(proj, grid2->sproj);
@@ -90,18 +131,17 @@ IceSheet::atm_proj_correct(ProjCorrect direction)
 	for (auto cell = gcm->grid1->cells_begin(); cell != gcm->grid1->cells_end(); ++cell) {
 		double native_area = cell->area;
 		double proj_area = area_of_proj_polygon(*cell, proj);
-		ret->add(cell->index, cell->index,
+		ret(cell->index) =
 			direction == ProjCorrect::NATIVE_TO_PROJ ?
-				native_area / proj_area : proj_area / native_area);
+				native_area / proj_area : proj_area / native_area;
 	}
-	ret->sum_duplicates();
 
 	return ret;
 }
 // -----------------------------------------------------
 /** Corrects the area1_m result */
 void IceSheet::atm_proj_correct(
-	giss::SparseAccumulator<int,double> &area1_m,
+	giss::DenseAccumulator<int,double> &area1_m,
 	ProjCorrect direction)
 {
 	int n1 = gcm->n1();
@@ -130,6 +170,12 @@ static bool in_good(std::unordered_set<int> const *set, int index_c)
 	return (set->find(index_c) != set->end());
 }
 
+static bool exgrid_in_good1(boost::function<bool (int)> const &include_cell1, Cell const &excell)
+	{ return include_cell1(excell.i); }
+
+static bool grid2_in_good(std::unordered_set<int> const *set, Cell const &cell)
+	{ return in_good(set, cell.index); }
+
 void IceSheet::filter_cells1(boost::function<bool (int)> const &include_cell1)
 {
 	// Remove unneeded cells from exgrid
@@ -174,7 +220,8 @@ boost::function<void ()> IceSheet::netcdf_define(NcFile &nc, std::string const &
 	return boost::bind(&giss::netcdf_write_functions, fns);
 }
 // -------------------------------------------------------------
-void IceSheet::read_from_netcdf(NcFile &nc, std::string const &vname)
+void IceSheet::read_from_netcdf(NcFile &nc, std::string const &vname,
+	boost::function<bool (int)> const &include_cell1)
 {
 	clear();
 
@@ -185,8 +232,21 @@ void IceSheet::read_from_netcdf(NcFile &nc, std::string const &vname)
 	std::string sinterp_style(giss::get_att(info_var, "interp_style")->as_string(0));
 	interp_style = giss::parse_enum<InterpStyle>(sinterp_style.c_str());
 
-	grid2.reset(read_grid(nc, vname + ".grid2").release());
-	exgrid = giss::shared_cast<ExchangeGrid,Grid>(read_grid(nc, vname + ".exgrid"));
+	if (include_cell1) {
+		// Read just the exchange cells that overlap our grid1 cells,
+		// and the grid2 cells they overlap (see filter_cells1()).
+		exgrid = giss::shared_cast<ExchangeGrid,Grid>(read_grid(nc, vname + ".exgrid",
+			boost::bind(&exgrid_in_good1, include_cell1, _1)));
+
+		std::unordered_set<int> good_index2;
+		for (auto excell = exgrid->cells_begin(); excell != exgrid->cells_end(); ++excell)
+			good_index2.insert(excell->j);
+		grid2.reset(read_grid(nc, vname + ".grid2",
+			boost::bind(&grid2_in_good, &good_index2, _1)).release());
+	} else {
+		grid2.reset(read_grid(nc, vname + ".grid2").release());
+		exgrid = giss::shared_cast<ExchangeGrid,Grid>(read_grid(nc, vname + ".exgrid"));
+	}
 	if (giss::get_var_safe(nc, vname + ".mask2")) {
 		mask2.reset(new blitz::Array<int,1>(
 		giss::read_blitz<int,1>(nc, vname + ".mask2")));
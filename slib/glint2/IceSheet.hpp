@@ -60,6 +60,13 @@ protected:
 
 	MatrixMaker *gcm;
 
+	/** Counts changes to elev2 and mask2; see elev2_mask2_changed() */
+	long _elev2_version;
+	long _mask2_version;
+
+	/** elev2_mask2_checksum() as of the last elev2_mask2_changed() */
+	size_t _elev2_mask2_checksum;
+
 public:
 	int index;
 
@@ -73,9 +80,46 @@ public:
 	/** TODO: How does mask2 work for L1 grids? */
 	std::unique_ptr<blitz::Array<int,1>> mask2;
 
-	/** Elevation of each cell (L0) or vertex (L1) in the ice model */
+	/** Elevation of each cell (L0) or vertex (L1) in the ice model.
+	This may be a view of the caller's array (eg: from Python), so it
+	can change in place without the IceSheet being told; see
+	check_elev2_mask2(). */
 	blitz::Array<double,1> elev2;	// [n2]
 
+	/** Should be called after elev2 or mask2 are changed in place (or
+	replaced) once the MatrixMaker has been realized, so that the
+	regridding matrices follow.  Matrices depending on elev2 are then
+	patched, rather than recomputed, where the IceSheet type allows it.
+	Changes not reported here are still caught by check_elev2_mask2(),
+	but then every ice cell has to be compared against its old value.
+	@param i2s Ice cells that (may) have changed; or NULL if not
+		known, in which case all cells are checked. */
+	void elev2_mask2_changed(std::vector<int> const *i2s = NULL);
+
+	/** Calls elev2_mask2_changed(NULL) if the contents of elev2 or
+	mask2 have changed since it was last called (or since realize()).
+	MatrixMaker calls this before it uses any cached matrix.
+	@return true if they had changed. */
+	bool check_elev2_mask2();
+
+	/** Hash of the values in elev2 and mask2.  Costs about as much as
+	one pass over them. */
+	size_t elev2_mask2_checksum() const;
+
+	/** Incremented when elev2 changes (as reported to elev2_mask2_changed()) */
+	long elev2_version() const { return _elev2_version; }
+
+	/** Incremented when mask2 changes (as reported to elev2_mask2_changed()) */
+	long mask2_version() const { return _mask2_version; }
+
+protected:
+	/** Brings whatever the IceSheet keeps about elev2 and mask2 up to
+	date, and increments the version counters.  Called by
+	elev2_mask2_changed(). */
+	virtual void update_elev2_mask2(std::vector<int> const *i2s)
+		{ ++_elev2_version; ++_mask2_version; }
+public:
+
 	// ===================================================
 
 	// -------------------------------------------
@@ -101,9 +145,11 @@ public:
 		{ return n2(); }
 
 	// ------------------------------------------------
-	/** Diagonal matrix converts values from native atmosphere grid to projected atmosphere grid (or vice versa)
+	/** Diagonal matrix converts values from native atmosphere grid to projected atmosphere grid (or vice versa).
+	Apply it with giss::scale_rows(), not multiply().  Cells not in
+	the grid (eg: halo cells) get zero.
 	@param direction Direction to convert vectors (NATIVE_TO_PROJ or PROJ_TO_NATIVE) */
-	std::unique_ptr<giss::VectorSparseMatrix> atm_proj_correct(ProjCorrect direction);
+	giss::DiagonalMatrix atm_proj_correct(ProjCorrect direction);
 
 #if 0
 	double IceSheet::atm_proj_correct(
@@ -127,14 +173,14 @@ public:
 	matrix just for this purpose.  This subroutine is only really useful when
 	working with one ice sheet at a time. */
 	void atm_proj_correct(
-		giss::SparseAccumulator<int,double> &area1_m,
+		giss::DenseAccumulator<int,double> &area1_m,
 		ProjCorrect direction);
 
 	// ------------------------------------------------
 
 	/** Adds up the (ice-covered) area of each GCM grid cell */
 	virtual void accum_areas(
-		giss::SparseAccumulator<int,double> &area1_m) = 0;
+		giss::DenseAccumulator<int,double> &area1_m) = 0;
 
 	/** Computes matrix to go from height-point space [nhp * n1] to ice grid [n2] */
 	virtual std::unique_ptr<giss::VectorSparseMatrix> hp_to_iceinterp(IceInterp dest) = 0;
@@ -149,16 +195,43 @@ public:
 	@param area1_m IN/OUT: Area of each GCM cell covered by
 		(non-masked-out) ice sheet.  Must divide result by this number. */
 	virtual std::unique_ptr<giss::VectorSparseMatrix> hp_to_projatm(
-		giss::SparseAccumulator<int,double> &area1_m) = 0;
+		giss::DenseAccumulator<int,double> &area1_m) = 0;
 
 	virtual std::unique_ptr<giss::VectorSparseMatrix> iceinterp_to_projatm(
-		giss::SparseAccumulator<int,double> &area1_m,
+		giss::DenseAccumulator<int,double> &area1_m,
 		IceInterp src) = 0;
 
+	// ------------------------------------------------
+	// Patching matrices after elev2 has changed.  Each returns false
+	// if it cannot patch (eg: mask2 has changed since, too); then the
+	// matrix must be recomputed.  On false, M may be half-patched.
+
+	/** Updates M, as returned by hp_to_iceinterp(dest) when
+	elev2_version() was since, to the current elev2. */
+	virtual bool patch_hp_to_iceinterp(giss::VectorSparseMatrix &M,
+		IceInterp dest, long since)
+		{ return false; }
+
+	/** Computes some rows of hp_to_projatm(), from the current elev2.
+	@param rows1 [n1] Non-zero for the GCM cells (rows) to compute.
+	@param fn Called as fn(i1, i3, val) for each contribution to those
+		rows; contributions to the same (i1, i3) must be summed. */
+	virtual bool hp_to_projatm_rows(std::vector<char> const &rows1,
+		boost::function<void (int, int, double)> const &fn)
+		{ return false; }
+
+	/** Lists GCM cells whose rows / columns of the matrices changed
+	since elev2_version() was since (possibly with repeats). */
+	virtual bool changed_cells1(long since, std::vector<int> &i1s)
+		{ return false; }
+
 public:
 
 	virtual boost::function<void ()> netcdf_define(NcFile &nc, std::string const &vname) const;
-	virtual void read_from_netcdf(NcFile &nc, std::string const &vname);
+	/** @param include_cell1 If set, only read the parts of the ice sheet
+	that interact with the grid1 cells it accepts (see filter_cells1()). */
+	virtual void read_from_netcdf(NcFile &nc, std::string const &vname,
+		boost::function<bool (int)> const &include_cell1 = boost::function<bool (int)>());
 
 };	// class IceSheet
 
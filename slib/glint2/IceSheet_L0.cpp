@@ -16,7 +16,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <cmath>
 #include <glint2/MatrixMaker.hpp>
 #include <glint2/IceSheet_L0.hpp>
 #include <giss/IndexTranslator.hpp>
@@ -72,6 +74,215 @@ static int nearest_1d(
 }
 
 
+// --------------------------------------------------------
+static inline bool same_value(double a, double b)
+	{ return (a == b) || (std::isnan(a) && std::isnan(b)); }
+
+bool IceSheet_L0::update_exch_state()
+{
+	ExchState &st(exch_state);
+	blitz::Array<int,1> const *mask1 = gcm->mask1.get();
+	int const n2 = this->n2();
+
+	// Pick up changes to elev2 / mask2 nobody told us about
+	if (st.valid) check_elev2_mask2();
+
+	// ----------- Do we need to rebuild from scratch?
+	bool rebuild = (!st.valid
+		|| st.exgrid != exgrid.get()
+		|| st.exgrid_ncells != exgrid->ncells_realized()
+		|| st.interp_style != interp_style
+		|| st.hpdefs != gcm->hpdefs
+		|| (int)st.mask2.size() != n2
+		|| st.mask1.size() != (mask1 ? mask1->extent(0) : 0));
+	if (!rebuild && mask1) {
+		for (int i1=0; i1 < (int)st.mask1.size(); ++i1) {
+			if (st.mask1[i1] != (*mask1)(i1)) {
+				rebuild = true;
+				break;
+			}
+		}
+	}
+	if (!rebuild) return false;
+
+printf("IceSheet_L0::update_exch_state(%s): rebuilding\n", name.c_str());
+	st.exgrid = exgrid.get();
+	st.exgrid_ncells = exgrid->ncells_realized();
+	st.interp_style = interp_style;
+	st.hpdefs = gcm->hpdefs;
+	st.mask1.clear();
+	if (mask1) for (int i1=0; i1 < mask1->extent(0); ++i1)
+		st.mask1.push_back((*mask1)(i1));
+
+	// Flatten the exchange grid
+	st.i1.clear(); st.i2.clear(); st.i4.clear(); st.area.clear();
+	for (auto cell = exgrid->cells_begin(); cell != exgrid->cells_end(); ++cell) {
+		st.i1.push_back(cell->i);
+		st.i2.push_back(cell->j);
+		st.i4.push_back(cell->index);
+		st.area.push_back(cell->area);
+	}
+	int const ncell = st.i1.size();
+	st.masked.resize(ncell);
+
+	// Index exchange cells by ice cell (stable, so exgrid order is kept)
+	st.by_i2_start.assign(n2+1, 0);
+	for (int k=0; k<ncell; ++k) ++st.by_i2_start[st.i2[k]+1];
+	for (int i2=0; i2<n2; ++i2) st.by_i2_start[i2+1] += st.by_i2_start[i2];
+	st.by_i2.resize(ncell);
+	std::vector<int> next(st.by_i2_start.begin(), st.by_i2_start.end()-1);
+	for (int k=0; k<ncell; ++k) st.by_i2[next[st.i2[k]]++] = k;
+
+	st.mask2.resize(n2);
+	st.elev2.resize(n2);
+	st.area2.resize(n2);
+	st.ihps.resize(n2);
+	st.whps.resize(n2);
+	for (int i2=0; i2<n2; ++i2) {
+		st.mask2[i2] = (mask2.get() ? (*mask2)(i2) : 0);
+		st.elev2[i2] = elev2(i2);
+		update_exch_i2(i2);
+	}
+
+	st.nslot = (interp_style == InterpStyle::Z_INTERP ? 2 : 1);
+	update_exch_slots();
+	st.valid = true;
+	return true;
+}
+
+void IceSheet_L0::update_exch_slots()
+{
+	ExchState &st(exch_state);
+	int const ncell = st.i1.size();
+	st.slot.resize(ncell);
+	st.nnz = 0;
+	for (int k=0; k<ncell; ++k) {
+		if (st.masked[k]) st.slot[k] = -1;
+		else {
+			st.slot[k] = st.nnz;
+			st.nnz += st.nslot;
+		}
+	}
+
+	// Matrices computed before now can't be patched
+	st.log.clear();
+	st.log_version0 = _elev2_version;
+}
+
+void IceSheet_L0::realize()
+{
+	IceSheet::realize();
+	invalidate_exch_state();
+}
+
+void IceSheet_L0::update_elev2_mask2(std::vector<int> const *i2s)
+{
+	ExchState &st(exch_state);
+	if (!st.valid) {
+		// Nothing to patch; it will be built from scratch
+		IceSheet::update_elev2_mask2(i2s);
+		return;
+	}
+
+	++_elev2_version;
+	bool mask_changed = false;
+	long nchanged = 0;
+	auto check_i2 = [&](int i2) {
+		int const m2 = (mask2.get() ? (*mask2)(i2) : 0);
+		double const e2 = elev2(i2);
+		if (m2 == st.mask2[i2] && same_value(e2, st.elev2[i2])) return;
+		++nchanged;
+
+		ExchChange change;
+		change.version = _elev2_version;
+		change.i2 = i2;
+		change.ihps = st.ihps[i2];
+		change.whps = st.whps[i2];
+
+		if (m2 != st.mask2[i2]) mask_changed = true;
+		st.mask2[i2] = m2;
+		st.elev2[i2] = e2;
+		update_exch_i2(i2);
+
+		// Log it, unless the interpolation came out the same
+		if (change.ihps != st.ihps[i2] || change.whps != st.whps[i2])
+			st.log.push_back(change);
+	};
+
+	if (i2s) {
+		for (auto ii = i2s->begin(); ii != i2s->end(); ++ii) check_i2(*ii);
+	} else {
+		for (int i2=0; i2 < (int)st.mask2.size(); ++i2) check_i2(i2);
+	}
+
+	if (mask_changed) {
+		// Changes the structure of the matrices
+		++_mask2_version;
+		update_exch_slots();
+	} else if (st.log.size() > st.mask2.size()) {
+		// Cheaper to recompute than to replay a long log
+		st.log.clear();
+		st.log_version0 = _elev2_version;
+	}
+
+	if (nchanged > 0)
+		printf("IceSheet_L0::update_elev2_mask2(%s): %ld ice cells changed%s\n",
+			name.c_str(), nchanged, mask_changed ? " (including mask2)" : "");
+}
+
+bool IceSheet_L0::exch_changes(long since,
+	std::vector<ExchChange const *> &changes) const
+{
+	ExchState const &st(exch_state);
+	if (!st.valid || since < st.log_version0) return false;
+
+	// Log entries after since; the first for each i2 has its old state
+	changes.clear();
+	for (auto ii = st.log.begin(); ii != st.log.end(); ++ii)
+		if (ii->version > since) changes.push_back(&*ii);
+	std::stable_sort(changes.begin(), changes.end(),
+		[](ExchChange const *a, ExchChange const *b) { return a->i2 < b->i2; });
+	changes.erase(std::unique(changes.begin(), changes.end(),
+		[](ExchChange const *a, ExchChange const *b) { return a->i2 == b->i2; }),
+		changes.end());
+	return true;
+}
+
+void IceSheet_L0::update_exch_i2(int i2)
+{
+	ExchState &st(exch_state);
+
+	// Masks and unmasked area
+	double area2 = 0;
+	for (int kk = st.by_i2_start[i2]; kk < st.by_i2_start[i2+1]; ++kk) {
+		int const k = st.by_i2[kk];
+		bool m = ((!st.mask1.empty() && st.mask1[st.i1[k]]) || st.mask2[i2]);
+		st.masked[k] = m;
+		if (!m) area2 += st.area[k];
+	}
+	st.area2[i2] = area2;
+
+	// Interpolation in height points
+	double elevation = std::max(st.elev2[i2], 0.0);
+	std::array<int,2> &ihps(st.ihps[i2]);
+	std::array<double,2> &whps(st.whps[i2]);
+	switch(interp_style.index()) {
+		case InterpStyle::Z_INTERP :
+			linterp_1d(gcm->hpdefs, elevation, &ihps[0], &whps[0]);
+		break;
+		case InterpStyle::ELEV_CLASS_INTERP :
+			ihps[0] = nearest_1d(gcm->hpdefs, elevation);
+			whps[0] = 1.0;
+			ihps[1] = -1;
+			whps[1] = 0;
+		break;
+		default :	// BILIN_INTERP does not use exch_state
+			ihps[0] = ihps[1] = -1;
+			whps[0] = whps[1] = 0;
+		break;
+	}
+}
+
 // --------------------------------------------------------
 // =========================================================
 // Stuff for bilin_interp()
@@ -96,13 +307,8 @@ printf("BEGIN hp_interp(%s) mask1=%p\n", dest.str(), &*gcm->mask1);
 			gcm->hpdefs, elev2, &*gcm->mask1, &*mask2);
 	}
 
-	// Sum overlap matrix by column (ice grid cell)
-	std::vector<double> area2(n2());
-	for (auto cell = exgrid->cells_begin(); cell != exgrid->cells_end(); ++cell) {
-		if (masked(cell)) continue;
-		area2[cell->j] += cell->area;
-	}
-
+	update_exch_state();
+	ExchState const &st(exch_state);
 
 printf("MID hp_interp(%s)\n", dest.str());
 
@@ -110,39 +316,19 @@ printf("MID hp_interp(%s)\n", dest.str());
 
 	std::unique_ptr<giss::VectorSparseMatrix> ret(new giss::VectorSparseMatrix(
 		giss::SparseDescr(nx, gcm->n3())));
-
-	// Interpolate in the vertical
-	for (auto cell = exgrid->cells_begin(); cell != exgrid->cells_end(); ++cell) {
-		if (masked(cell)) continue;
-
-		int const i1 = cell->i;
-		int const i2 = cell->j;
-		int const i4 = cell->index;
-		int ix = (dest == IceExch::ICE ? i2 : i4);
-
-		double overlap_ratio =
-			(dest == IceExch::ICE ? cell->area / area2[i2] : 1.0);
-		double elevation = std::max(elev2(i2), 0.0);
-//elevation = 800;
-
-		// Interpolate in height points
-		switch(interp_style.index()) {
-			case InterpStyle::Z_INTERP : {
-				int ihps[2];
-				double whps[2];
-				linterp_1d(gcm->hpdefs, elevation, ihps, whps);
-//printf("LINTERP %d %f %f (%d : %f), (%d : %f)\n", i2, elev2(i2), overlap_ratio, ihps[0], whps[0], ihps[1], whps[1]);
-				ret->add(ix, gcm->hc_index->ik_to_index(i1, ihps[0]),
-					overlap_ratio * whps[0]);
-				ret->add(ix, gcm->hc_index->ik_to_index(i1, ihps[1]),
-					overlap_ratio * whps[1]);
-			} break;
-			case InterpStyle::ELEV_CLASS_INTERP : {
-				int ihps0 = nearest_1d(gcm->hpdefs, elevation);
-				ret->add(ix, gcm->hc_index->ik_to_index(i1, ihps0),
-					overlap_ratio);
-			} break;
-		}
+	ret->reserve(st.nnz);
+
+	// Interpolate in the vertical.  Entries are laid out as in
+	// st.slot[], so patch_hp_to_iceinterp() can find them later.
+	int cols[2];
+	double vals[2];
+	for (int k=0; k < (int)st.i1.size(); ++k) {
+		if (st.masked[k]) continue;
+
+		int const i2 = st.i2[k];
+		int ix = (dest == IceExch::ICE ? i2 : st.i4[k]);
+		hp_to_iceexch_entries(k, dest, st.ihps[i2], st.whps[i2], cols, vals);
+		for (int j=0; j < st.nslot; ++j) ret->add(ix, cols[j], vals[j]);
 	}
 
 printf("END hp_interp(%s)\n", dest.str());
@@ -150,25 +336,156 @@ printf("END hp_interp(%s)\n", dest.str());
 	return ret;
 }
 // --------------------------------------------------------
+void IceSheet_L0::hp_to_iceexch_entries(int k, IceExch dest,
+	std::array<int,2> const &ihps, std::array<double,2> const &whps,
+	int *cols, double *vals) const
+{
+	ExchState const &st(exch_state);
+	int const i1 = st.i1[k];
+	int const i2 = st.i2[k];
+
+	double overlap_ratio =
+		(dest == IceExch::ICE ? st.area[k] / st.area2[i2] : 1.0);
+
+	// Interpolate in height points
+	switch(interp_style.index()) {
+		case InterpStyle::Z_INTERP :
+			cols[0] = gcm->hc_index->ik_to_index(i1, ihps[0]);
+			vals[0] = overlap_ratio * whps[0];
+			cols[1] = gcm->hc_index->ik_to_index(i1, ihps[1]);
+			vals[1] = overlap_ratio * whps[1];
+		break;
+		case InterpStyle::ELEV_CLASS_INTERP :
+			cols[0] = gcm->hc_index->ik_to_index(i1, ihps[0]);
+			vals[0] = overlap_ratio;
+		break;
+	}
+}
+
+void IceSheet_L0::hp_to_projatm_block(int i2,
+	std::array<int,2> const &ihps, std::array<double,2> const &whps,
+	boost::function<void (int, int, double)> const &fn) const
+{
+	ExchState const &st(exch_state);
+	int cols[2];
+	double vals[2];
+	int const kk0 = st.by_i2_start[i2];
+	int const kk1 = st.by_i2_start[i2+1];
+
+	// hp_to_projatm = iceexch_to_projatm(interp_grid) * hp_to_iceexch(interp_grid)
+	for (int kk = kk0; kk < kk1; ++kk) {
+		int const k = st.by_i2[kk];
+		if (st.masked[k]) continue;
+		hp_to_iceexch_entries(k, interp_grid, ihps, whps, cols, vals);
+
+		if (interp_grid == IceExch::EXCH) {
+			// Exchange cell k is row i4 of hp_to_iceexch, column i4 of iceexch_to_projatm
+			for (int j=0; j < st.nslot; ++j)
+				fn(st.i1[k], cols[j], st.area[k] * vals[j]);
+		} else {
+			// Row i2 of hp_to_iceexch meets every exchange cell of i2
+			for (int kk2 = kk0; kk2 < kk1; ++kk2) {
+				int const k2 = st.by_i2[kk2];
+				if (st.masked[k2]) continue;
+				for (int j=0; j < st.nslot; ++j)
+					fn(st.i1[k2], cols[j], st.area[k2] * vals[j]);
+			}
+		}
+	}
+}
+
+bool IceSheet_L0::patch_hp_to_iceinterp(giss::VectorSparseMatrix &M,
+	IceInterp dest, long since)
+{
+	if (interp_style == InterpStyle::BILIN_INTERP) return false;
+	if (update_exch_state()) return false;
+	ExchState const &st(exch_state);
+	if (M.size() != st.nnz) return false;
+
+	std::vector<ExchChange const *> changes;
+	if (!exch_changes(since, changes)) return false;
+
+	IceExch iedest = (dest == IceInterp::ICE ? IceExch::ICE : interp_grid);
+	int cols[2];
+	double vals[2];
+	for (auto ch = changes.begin(); ch != changes.end(); ++ch) {
+		int const i2 = (*ch)->i2;
+		for (int kk = st.by_i2_start[i2]; kk < st.by_i2_start[i2+1]; ++kk) {
+			int const k = st.by_i2[kk];
+			if (st.masked[k]) continue;
+
+			int ix = (iedest == IceExch::ICE ? i2 : st.i4[k]);
+			hp_to_iceexch_entries(k, iedest, st.ihps[i2], st.whps[i2], cols, vals);
+			for (int j=0; j < st.nslot; ++j)
+				M.set_element(st.slot[k] + j, ix, cols[j], vals[j]);
+		}
+	}
+printf("IceSheet_L0::patch_hp_to_iceinterp(%s): %ld ice cells\n", name.c_str(), changes.size());
+	return true;
+}
+
+bool IceSheet_L0::hp_to_projatm_rows(std::vector<char> const &rows1,
+	boost::function<void (int, int, double)> const &fn)
+{
+	if (interp_style == InterpStyle::BILIN_INTERP) return false;
+	update_exch_state();
+	ExchState const &st(exch_state);
+
+	// Every ice cell overlapping one of the rows contributes to it
+	std::vector<char> done2(n2(), 0);
+	auto fn_rows = [&](int i1, int i3, double val) {
+		if (rows1[i1] && val != 0) fn(i1, i3, val);
+	};
+	long nblock = 0;
+	for (int k=0; k < (int)st.i1.size(); ++k) {
+		int const i2 = st.i2[k];
+		if (!rows1[st.i1[k]] || done2[i2]) continue;
+		done2[i2] = 1;
+		++nblock;
+		hp_to_projatm_block(i2, st.ihps[i2], st.whps[i2], fn_rows);
+	}
+printf("IceSheet_L0::hp_to_projatm_rows(%s): %ld ice cells\n", name.c_str(), nblock);
+	return true;
+}
+
+bool IceSheet_L0::changed_cells1(long since, std::vector<int> &i1s)
+{
+	if (interp_style == InterpStyle::BILIN_INTERP) return false;
+	if (update_exch_state()) return false;
+	ExchState const &st(exch_state);
+
+	std::vector<ExchChange const *> changes;
+	if (!exch_changes(since, changes)) return false;
+	for (auto ch = changes.begin(); ch != changes.end(); ++ch) {
+		int const i2 = (*ch)->i2;
+		for (int kk = st.by_i2_start[i2]; kk < st.by_i2_start[i2+1]; ++kk)
+			i1s.push_back(st.i1[st.by_i2[kk]]);
+	}
+	return true;
+}
+// --------------------------------------------------------
 // --------------------------------------------------------
 blitz::Array<double,1> const IceSheet_L0::ice_to_interp(
 	blitz::Array<double,1> const &f2)
 {
 	if (interp_grid == IceExch::ICE) return f2;
 
+	update_exch_state();
+	ExchState const &st(exch_state);
+
 	blitz::Array<double,1> f4(n4());
-	for (auto cell = exgrid->cells_begin(); cell != exgrid->cells_end(); ++cell) {
-		if (masked(cell)) continue;
-		// cell->i = index in atmosphere grid
-		int i2 = cell->j;		// index in ice grid
-		int i4 = cell->index; 	// index in exchange grid
+	for (int k=0; k < (int)st.i1.size(); ++k) {
+		if (st.masked[k]) continue;
+		// st.i1[k] = index in atmosphere grid
+		int i2 = st.i2[k];		// index in ice grid
+		int i4 = st.i4[k]; 		// index in exchange grid
 		f4(i4) = f2(i2);
 	}
 	return f4;
 }
 // --------------------------------------------------------
 std::unique_ptr<giss::VectorSparseMatrix> IceSheet_L0::hp_to_projatm(
-	giss::SparseAccumulator<int,double> &area1_m)
+	giss::DenseAccumulator<int,double> &area1_m)
 {
 printf("BEGIN IceSheet_L0::hp_to_projatm %ld %ld\n", n1(), n4());
 
@@ -186,7 +503,7 @@ printf("END IceSheet_L0::hp_to_projatm()\n");
 }
 // --------------------------------------------------------
 std::unique_ptr<giss::VectorSparseMatrix> IceSheet_L0::iceexch_to_projatm(
-	giss::SparseAccumulator<int,double> &area1_m,
+	giss::DenseAccumulator<int,double> &area1_m,
 	IceExch src)
 {
 printf("BEGIN IceSheet_L0::ice_to_projatm %ld %ld\n", n1(), n4());
@@ -194,21 +511,24 @@ printf("BEGIN IceSheet_L0::ice_to_projatm %ld %ld\n", n1(), n4());
 	// ============= ice_to_atm (with area1 scaling factor)
 	// Area-weighted remapping from exchange to atmosphere grid is equal
 	// to scaled version of overlap matrix.
+	update_exch_state();
+	ExchState const &st(exch_state);
+
 	int nx = niceexch(src);
 	std::unique_ptr<giss::VectorSparseMatrix> ice_to_projatm(
 		new giss::VectorSparseMatrix(giss::SparseDescr(n1(), nx)));
-	for (auto cell = exgrid->cells_begin(); cell != exgrid->cells_end(); ++cell) {
-		if (masked(cell)) continue;
+	for (int k=0; k < (int)st.i1.size(); ++k) {
+		if (st.masked[k]) continue;
 
 		// Exchange Grid is in Cartesian coordinates
-		// cell->i = index in atmosphere grid
-		// cell->j = index in ice grid
-		// cell->index = index in exchange grid
-		double area = cell->area;	// Computed in ExchangeGrid::overlap_callback()
-		ice_to_projatm->add(cell->i,
-			src == IceExch::ICE ? cell->j : cell->index,
+		// st.i1[k] = index in atmosphere grid
+		// st.i2[k] = index in ice grid
+		// st.i4[k] = index in exchange grid
+		double area = st.area[k];	// Computed in ExchangeGrid::overlap_callback()
+		ice_to_projatm->add(st.i1[k],
+			src == IceExch::ICE ? st.i2[k] : st.i4[k],
 			area);
-		area1_m.add(cell->i, area);
+		area1_m.add(st.i1[k], area);
 	}
 
 	//ice_to_projatm->sum_duplicates();
@@ -220,14 +540,17 @@ printf("BEGIN IceSheet_L0::ice_to_projatm %ld %ld\n", n1(), n4());
 @param area1_m IN/OUT: Area of each GCM cell covered by
 	(non-masked-out) ice sheet. */
 void IceSheet_L0::accum_areas(
-giss::SparseAccumulator<int,double> &area1_m)
+giss::DenseAccumulator<int,double> &area1_m)
 {
 printf("BEGIN accum_area(%s)\n", name.c_str());
 
-	for (auto cell = exgrid->cells_begin(); cell != exgrid->cells_end(); ++cell) {
-		if (masked(cell)) continue;
+	update_exch_state();
+	ExchState const &st(exch_state);
+
+	for (int k=0; k < (int)st.i1.size(); ++k) {
+		if (st.masked[k]) continue;
 
-		area1_m.add(cell->i, cell->area);
+		area1_m.add(st.i1[k], st.area[k]);
 	}
 printf("END accum_area(%s)\n", name.c_str());
 }
@@ -244,9 +567,10 @@ boost::function<void ()> IceSheet_L0::netcdf_define(NcFile &nc, std::string cons
 	return ret;
 }
 // -------------------------------------------------------------
-void IceSheet_L0::read_from_netcdf(NcFile &nc, std::string const &vname)
+void IceSheet_L0::read_from_netcdf(NcFile &nc, std::string const &vname,
+	boost::function<bool (int)> const &include_cell1)
 {
-	IceSheet::read_from_netcdf(nc, vname);
+	IceSheet::read_from_netcdf(nc, vname, include_cell1);
 
 	NcVar *info_var = nc.get_var((vname + ".info").c_str());
 	std::string sinterp_grid(giss::get_att(info_var, "interp_grid")->as_string(0));
@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <array>
 #include "IceSheet.hpp"
 
 namespace glint2 {
@@ -52,6 +53,107 @@ protected:
 	bool masked(giss::HashDict<int, Cell>::iterator const &it);
 	bool masked(giss::HashDict<int, Cell>::const_iterator const &it);
 
+	/** Height point interpolation of one ice cell, before an elev2 change */
+	struct ExchChange {
+		long version;		// elev2_version() after the change
+		int i2;
+		std::array<int,2> ihps;
+		std::array<double,2> whps;
+	};
+
+	/** The exchange grid in flat arrays (in exgrid order), plus
+	everything the exchange-based matrices need to know about each ice
+	cell.  When elev2 or mask2 change, only the ice cells that changed
+	(and the exchange cells overlapping them) are recomputed.
+	@see update_exch_state(), elev2_mask2_changed() */
+	struct ExchState {
+		bool valid;
+
+		// ------ What the state was computed from
+		Grid const *exgrid;			// Rebuild if exgrid changes
+		long exgrid_ncells;
+		InterpStyle interp_style;
+		std::vector<double> hpdefs;
+		std::vector<int> mask1;		// [n1] (empty if no mask1)
+		std::vector<int> mask2;		// [n2]
+		std::vector<double> elev2;	// [n2]
+
+		// ------ Exchange grid cells, in exgrid order
+		std::vector<int> i1, i2, i4;
+		std::vector<double> area;
+		std::vector<char> masked;
+		std::vector<int> by_i2_start;	// [n2+1] Cells overlapping each ice cell are...
+		std::vector<int> by_i2;			// ...by_i2[by_i2_start[i2] : by_i2_start[i2+1]]
+
+		// ------ Per ice cell
+		std::vector<double> area2;		// Unmasked area
+		std::vector<std::array<int,2>> ihps;		// Height points to interpolate from
+		std::vector<std::array<double,2>> whps;		// Weights of those height points
+
+		// ------ Layout of hp_to_iceexch(): exchange cell k has entries
+		// [slot[k], slot[k] + nslot); slot[k] = -1 if masked.
+		int nslot;
+		std::vector<long> slot;
+		long nnz;
+
+		// ------ elev2 changes since log_version0, oldest first
+		long log_version0;
+		std::vector<ExchChange> log;
+
+		ExchState() : valid(false), exgrid(0), exgrid_ncells(-1), nslot(0), nnz(0), log_version0(0) {}
+	};
+	ExchState exch_state;
+
+	/** Builds exch_state from scratch, if it is not valid or mask1,
+	hpdefs, interp_style or the exchange grid have changed.  Changes to
+	elev2 and mask2 are instead patched in by elev2_mask2_changed()
+	(called from here, via check_elev2_mask2(), if nobody else did).
+	@return true if it was rebuilt. */
+	bool update_exch_state();
+
+	/** Recomputes exch_state for one ice cell. */
+	void update_exch_i2(int i2);
+
+	/** Recomputes the layout of hp_to_iceexch() (after masks change) */
+	void update_exch_slots();
+
+	/** Lists the ice cells whose elev2 changed since elev2_version()
+	was since, each with its state just before the first such change.
+	@return false if that is not known (eg: mask2 changed since). */
+	bool exch_changes(long since, std::vector<ExchChange const *> &changes) const;
+
+	/** Computes the nslot entries of hp_to_iceexch() for exchange cell k,
+	with a given height point interpolation for its ice cell. */
+	void hp_to_iceexch_entries(int k, IceExch dest,
+		std::array<int,2> const &ihps, std::array<double,2> const &whps,
+		int *cols, double *vals) const;
+
+	/** Calls fn(i1, i3, val) for each contribution of ice cell i2 to
+	hp_to_projatm(), with a given height point interpolation. */
+	void hp_to_projatm_block(int i2,
+		std::array<int,2> const &ihps, std::array<double,2> const &whps,
+		boost::function<void (int, int, double)> const &fn) const;
+
+	virtual void realize();
+
+public:
+	/** Forces exch_state to be rebuilt next time it is used. */
+	void invalidate_exch_state() { exch_state.valid = false; }
+
+protected:
+	/** Patches exch_state for just the ice cells that changed, and
+	logs elev2 changes for the patch_*() methods below. */
+	virtual void update_elev2_mask2(std::vector<int> const *i2s);
+public:
+
+	virtual bool patch_hp_to_iceinterp(giss::VectorSparseMatrix &M,
+		IceInterp dest, long since);
+
+	virtual bool hp_to_projatm_rows(std::vector<char> const &rows1,
+		boost::function<void (int, int, double)> const &fn);
+
+	virtual bool changed_cells1(long since, std::vector<int> &i1s);
+
 protected :
 	/** Builds an interpolation matrix to go from height points to ice/exchange grid.
 	@param overlap_type Controls matrix output to ice or exchange grid. */
@@ -71,7 +173,7 @@ public:
 
 	/** Adds up the (ice-covered) area of each GCM grid cell */
 	virtual void accum_areas(
-		giss::SparseAccumulator<int,double> &area1_m);
+		giss::DenseAccumulator<int,double> &area1_m);
 
 	/** Converts vector from ice grid (n2) to exchange grid (n4).
 	The transformation is easy, and no matrix needs to be computed.
@@ -85,16 +187,16 @@ public:
 	@param area1_m IN/OUT: Area of each GCM cell covered by
 		(non-masked-out) ice sheet. */
 	virtual std::unique_ptr<giss::VectorSparseMatrix> hp_to_projatm(
-		giss::SparseAccumulator<int,double> &area1_m);
+		giss::DenseAccumulator<int,double> &area1_m);
 
 protected :
 	std::unique_ptr<giss::VectorSparseMatrix> iceexch_to_projatm(
-		giss::SparseAccumulator<int,double> &area1_m,
+		giss::DenseAccumulator<int,double> &area1_m,
 		IceExch src = IceExch::ICE);
 
 public:
 	virtual std::unique_ptr<giss::VectorSparseMatrix> iceinterp_to_projatm(
-		giss::SparseAccumulator<int,double> &area1_m,
+		giss::DenseAccumulator<int,double> &area1_m,
 		IceInterp src)
 	{
 		IceExch iesrc = (src == IceInterp::ICE ? IceExch::ICE : interp_grid);
@@ -103,7 +205,8 @@ public:
 
 
 	virtual boost::function<void ()> netcdf_define(NcFile &nc, std::string const &vname) const;
-	virtual void read_from_netcdf(NcFile &nc, std::string const &vname);
+	virtual void read_from_netcdf(NcFile &nc, std::string const &vname,
+		boost::function<bool (int)> const &include_cell1 = boost::function<bool (int)>());
 
 };
 
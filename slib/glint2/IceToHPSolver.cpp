@@ -0,0 +1,856 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <set>
+#include <boost/thread.hpp>
+#include <giss/IndexTranslator.hpp>
+#include <giss/IndexTranslator2.hpp>
+#include <galahad/qpt_c.hpp>
+#include <galahad/eqp_c.hpp>
+#include <giss/dense_lu.hpp>
+#include <glint2/IceToHPSolver.hpp>
+
+namespace glint2 {
+
+// --------------------------------------------------------------
+/** Change this to a boost function later
+@param trans_2_2p Tells us which columns of conserv (i2) are active,
+       after masking with mask1, mask1h and mask2.
+*/
+static std::unique_ptr<giss::VectorSparseMatrix> remove_small_constraints(
+giss::VectorSparseMatrix const &in_constraints_const,
+int min_row_count)
+{
+	// Const cast because we don't know how to do const_iterator() right in VectorSparseMatrix
+	auto in_constraints(const_cast<giss::VectorSparseMatrix &>(in_constraints_const));
+
+	std::set<int> delete_row;		// Rows to delete
+	std::set<int> delete_col;		// Cols to delete
+
+	// Make sure there are no constraints (rows) with too few variables (columns).
+	// Uses an iterative process
+	std::vector<int> row_count(in_constraints.nrow);
+	for (;;) {
+		// Count rows
+		row_count.clear(); row_count.resize(in_constraints.nrow);
+		for (auto oi = in_constraints.begin(); oi != in_constraints.end(); ++oi) {
+			int i2 = oi.col();
+
+			// Loop if it's already in our delete_row and delete_col sets
+			if (delete_row.find(oi.row()) != delete_row.end()) continue;
+			if (delete_col.find(i2) != delete_col.end()) continue;
+
+			++row_count[oi.row()];
+		}
+
+
+		// Add to our deletion set
+		int num_deleted = 0;
+		for (auto oi = in_constraints.begin(); oi != in_constraints.end(); ++oi) {
+			int i2 = oi.col();
+
+			// Loop if it's already in our delete_row and delete_col sets
+			if (delete_row.find(oi.row()) != delete_row.end()) continue;
+			if (delete_col.find(i2) != delete_col.end()) continue;
+
+			if (row_count[oi.row()] < min_row_count) {
+				++num_deleted;
+				delete_row.insert(oi.row());
+				delete_col.insert(i2);
+			}
+		}
+
+		// Terminate if we didn't remove anything on this round
+printf("num_deleted = %d\n", num_deleted);
+		if (num_deleted == 0) break;
+	}
+
+
+	// Copy over the matrix, deleting rows and columns as planned
+	std::unique_ptr<giss::VectorSparseMatrix> out_constraints(
+		new giss::VectorSparseMatrix(giss::SparseDescr(in_constraints)));
+	for (auto oi = in_constraints.begin(); oi != in_constraints.end(); ++oi) {
+		int i2 = oi.col();
+
+		// Loop if it's already in our delete_row and delete_col sets
+		if (delete_row.find(oi.row()) != delete_row.end()) continue;
+		if (delete_col.find(i2) != delete_col.end()) continue;
+
+		out_constraints->set(oi.row(), i2, oi.val());
+	}
+	return out_constraints;
+}
+// -------------------------------------------------------------
+/** Checksums an interpolation matrix, to ensure that the sume of weights
+for each output grid cell is 1.  This should always be the case, no
+matter what kind of interpolation is used. */
+static bool checksum_interp(giss::VectorSparseMatrix &mat, std::string const &name,
+double epsilon)
+{
+	bool ret = true;
+	auto rowsums(mat.sum_per_row_map());
+	for (auto ii = rowsums.begin(); ii != rowsums.end(); ++ii) {
+		int row = ii->first;
+		double sum = ii->second;
+		if (std::abs(sum - 1.0d) > epsilon) {
+			printf("rowsum != 1 at %s: %d %g\n", name.c_str(), row, sum);
+			ret = false;
+		}
+	}
+	return false;
+}
+// -------------------------------------------------------------
+class I3XTranslator {
+	HCIndex *hc_index;
+	int nhc;
+
+public:
+
+	void init(HCIndex *_hc_index, int _nhc)
+	{
+		hc_index = _hc_index;
+		nhc = _nhc;
+	}
+
+	// Identity Transformation
+	void init_identity() {
+		hc_index = 0;
+		nhc = -1;
+	}
+
+	I3XTranslator() : hc_index(0), nhc(-1) {}
+
+	int i3x_to_i3(int i3x) const
+	{
+		if (!hc_index) return i3x;		// Identity
+
+		int i1 = i3x / nhc;
+		int k = i3x - i1 * nhc;
+		return hc_index->ik_to_index(i1, k);
+	}
+
+	int i3_to_i3x(int i3) const
+	{
+		if (!hc_index) return i3;		// Identity
+
+		int i1, k;
+		hc_index->index_to_ik(i3, i1, k);
+		int i3x = i1 * nhc + k;
+	//printf("i3=%d (%d, %d) --> i3x=%d\n", i3, i1, k, i3x);
+		return i3x;
+	}
+};
+// -------------------------------------------------------------
+struct UsedAll {
+	// Indices used in each space (with repeats; see giss::compact_indices())
+	std::vector<int> used1;
+	std::vector<std::pair<int,int>> used4;
+	std::vector<int> used3;
+	std::vector<int> used3x;
+	giss::IndexTranslator trans_1_1p;
+	giss::IndexTranslator2 trans_4_4p;
+	giss::IndexTranslator trans_3x_3p;
+
+	std::unique_ptr<giss::VectorSparseMatrix> RMp;
+	std::unique_ptr<giss::VectorSparseMatrix> Sp;
+	std::unique_ptr<giss::VectorSparseMatrix> XMp;
+	blitz::Array<double,1> area1p_inv;
+
+	UsedAll() :
+		trans_1_1p("trans_1_1p"),
+		trans_4_4p("trans_4_4p"),
+		trans_3x_3p("trans_3x_3p") {}
+
+};
+
+class GetSubID {
+	QPAlgorithm _qp_algorithm;
+public:
+	GetSubID(QPAlgorithm qp_algorithm) : _qp_algorithm(qp_algorithm) {}
+	int operator()(int i1) {
+		if (_qp_algorithm == QPAlgorithm::SINGLE_QP) return 0;
+		return i1;
+	}
+};
+// -------------------------------------------------------------
+/** Subproblems with at most this many variables + constraints are
+solved with a dense kernel rather than GALAHAD.  With a local RM
+(MULTI_QP), that is every subproblem: one constraint plus one
+variable per elevation class. */
+static int const DENSE_KKT_MAX = giss::DENSE_LU_MAX_FIXED;
+
+/** One QP subproblem of IceToHPSolver.  The problem is assembled,
+and factorized, the first time it is solved.  Different subproblems
+may be solved concurrently. */
+struct IceToHPSub {
+	int subid;
+	UsedAll ua;
+	bool assembled;
+
+	/** LU factors of the dense KKT matrix, if this is a small
+	subproblem (see assemble_dense()); empty otherwise. */
+	std::vector<double> kkt_lu;
+	std::vector<int> kkt_piv;
+
+	std::unique_ptr<galahad::qpt_problem_c> qpt;
+	std::unique_ptr<galahad::eqp_solver_c> eqp;
+
+	IceToHPSub(int _subid) : subid(_subid), assembled(false) {}
+
+	/** Sets up the dense solver if the subproblem is small enough,
+	otherwise the GALAHAD problem.
+	@param nthread Number of threads to assemble the GALAHAD problem on. */
+	void assemble(int nthread = 1);
+
+	/** Builds and factorizes the KKT matrix of the (equality
+	constrained) problem:
+	    [ 2 XMp^T XMp   RMp^T ] [x]   [2 XMp^T f4p]
+	    [ RMp           0     ] [y] = [Sp f4p     ]
+	@return false if it is singular (eg: an elevation point not
+	    touched by XMp or RMp); then GALAHAD must be used instead. */
+	bool assemble_dense();
+
+	/** Allocates the QPT problem and fills in H and A */
+	void assemble_galahad(int nthread);
+
+	/** Solves for one field.
+	@param x3 Solution, as (i3, value) pairs. */
+	void solve(
+		std::map<int, blitz::Array<double,1>> const &f4s,
+		blitz::Array<double,1> const &initial3,
+		I3XTranslator const &trans_3_3x,
+		std::vector<std::pair<int,double>> &x3);
+};
+
+void IceToHPSub::assemble(int nthread)
+{
+	int n1p = ua.trans_1_1p.nb();
+	int n3p = ua.trans_3x_3p.nb();
+
+	if (n1p + n3p > DENSE_KKT_MAX || !assemble_dense())
+		assemble_galahad(nthread);
+
+	// No longer needed: XMp and Sp are still used for the RHS
+	ua.RMp.reset();
+	assembled = true;
+}
+
+bool IceToHPSub::assemble_dense()
+{
+	int n1p = ua.trans_1_1p.nb();
+	int n3p = ua.trans_3x_3p.nb();
+	int const n = n3p + n1p;
+
+	std::vector<double> K(n*n, 0.0);
+
+	// Upper left: H = 2 XMp^T XMp, accumulated row by row of XMp
+	// (XMp has few entries per row, so this is cheap).
+	std::vector<std::pair<int,double>> row;
+	auto add_row = [&]() {
+		for (auto a = row.begin(); a != row.end(); ++a)
+		for (auto b = row.begin(); b != row.end(); ++b)
+			K[a->first*n + b->first] += 2.0d * a->second * b->second;
+		row.clear();
+	};
+	ua.XMp->sort(giss::SparseMatrix::SortOrder::ROW_MAJOR);
+	int last_row = -1;
+	for (auto ii = ua.XMp->begin(); ii != ua.XMp->end(); ++ii) {
+		if (ii.row() != last_row) {
+			add_row();
+			last_row = ii.row();
+		}
+		row.push_back(std::make_pair(ii.col(), ii.val()));
+	}
+	add_row();
+
+	// Off-diagonal blocks: RMp and RMp^T
+	for (auto ii = ua.RMp->begin(); ii != ua.RMp->end(); ++ii) {
+		int const i1p = n3p + ii.row();
+		int const i3p = ii.col();
+		K[i1p*n + i3p] += ii.val();
+		K[i3p*n + i1p] += ii.val();
+	}
+
+	std::vector<int> piv(n);
+	if (!giss::dense_lu_factor_fixed(n, &K[0], &piv[0])) {
+		printf("IceToHPSub %d: singular KKT matrix, using GALAHAD\n", subid);
+		return false;
+	}
+	kkt_lu = std::move(K);
+	kkt_piv = std::move(piv);
+	return true;
+}
+
+void IceToHPSub::assemble_galahad(int nthread)
+{
+	int n1p = ua.trans_1_1p.nb();
+	int n4p = ua.trans_4_4p.nb();
+	int n3p = ua.trans_3x_3p.nb();
+printf("--------------------- QP %d: n1p=%d, n4p=%d, n3p=%d\n", subid, n1p, n4p, n3p);
+
+ 	// ---------- Allocate the QPT problem
+	// m = # constraints = n1p (size of atmosphere grid)
+	// n = # variabeles = n3p
+	qpt.reset(new galahad::qpt_problem_c(n1p, n3p, true));
+	eqp.reset(new galahad::eqp_solver_c());
+
+	// ================ Objective Function
+	// 1/2 (XM F_E - F_I)^2    where XM = (Ice->Exch)(Elev->Ice)
+	// qpt%H = (XM)^T (XM),    qpt%G = f_I \cdot (XM),        qpt%f = f_I \cdot f_I
+
+	// -------- H = 2 * XMp^T XMp
+	// Only the lower triangle is stored (otherwise, GALAHAD won't work)
+	giss::syrk_lower(*ua.XMp, 2.0d,
+		[this](int ne) -> galahad::zd11_c & {
+			qpt->alloc_H(ne);
+			return qpt->H;
+		}, nthread);
+
+	// ============================ Constraints
+	// RM x = Sp f4p
+
+	// qpt.A = constraints matrix = RMp
+	qpt->alloc_A(ua.RMp->size());
+	giss::ZD11SparseMatrix A_zd11(qpt->A, 0);
+	A_zd11.append_bulk(*ua.RMp);
+}
+
+void IceToHPSub::solve(
+	std::map<int, blitz::Array<double,1>> const &f4s,
+	blitz::Array<double,1> const &initial3,
+	I3XTranslator const &trans_3_3x,
+	std::vector<std::pair<int,double>> &x3)
+{
+	if (!assembled) assemble();
+
+	int n1p = ua.trans_1_1p.nb();
+	int n4p = ua.trans_4_4p.nb();
+	int n3p = ua.trans_3x_3p.nb();
+
+	// -------- Translate f4 -> f4p
+	// Ignore elements NOT listed in the translation
+	blitz::Array<double,1> f4p(n4p);
+	f4p = 0;
+	for (int i4p = 0; i4p < n4p; ++i4p) {
+		std::pair<int,int> const &a(ua.trans_4_4p.b2a(i4p));
+		int index = a.first;
+		int i4 = a.second;
+		f4p(i4p) = f4s.at(index)(i4);
+	}
+
+	if (kkt_lu.size() > 0) {
+		// Dense path: initial guess not needed, solution is direct
+		int const n = n3p + n1p;
+		std::vector<double> rhs(n, 0.0);
+		for (auto ii = ua.XMp->begin(); ii != ua.XMp->end(); ++ii)
+			rhs[ii.col()] += 2.0d * f4p(ii.row()) * ii.val();
+		for (auto ii = ua.Sp->begin(); ii != ua.Sp->end(); ++ii)
+			rhs[n3p + ii.row()] += f4p(ii.col()) * ii.val();
+
+		giss::dense_lu_solve_fixed(n, &kkt_lu[0], &kkt_piv[0], &rhs[0]);
+
+		x3.clear();
+		x3.reserve(n3p);
+		for (int i3p=0; i3p<n3p; ++i3p) {
+			int i3x = ua.trans_3x_3p.b2a(i3p);
+			int i3 = trans_3_3x.i3x_to_i3(i3x);
+			x3.push_back(std::make_pair(i3, rhs[i3p]));
+		}
+		return;
+	}
+
+	// -------- Linear term of obj function
+	// G = -2*f4p \cdot XMp
+	for (int i=0; i < qpt->n; ++i) qpt->G[i] = 0;
+	for (auto ii = ua.XMp->begin(); ii != ua.XMp->end(); ++ii) {
+		qpt->G[ii.col()] -= 2.0d * f4p(ii.row()) * ii.val();
+	}
+
+	// --------- Constant term of objective function
+	// f = f4p \cdot f4p
+	qpt->f = 0;
+	for (int i4p=0; i4p<n4p; ++i4p) {
+		qpt->f += f4p(i4p) * f4p(i4p);
+	}
+
+	// Constraints: Ax + C = 0
+	// qpt.C = equality constraints RHS = Sp * f4p
+	for (int i=0; i<n1p; ++i) qpt->C[i] = 0;
+	for (auto ii = ua.Sp->begin(); ii != ua.Sp->end(); ++ii) {
+		int i1p = ii.row();		// Atm
+		int i4p = ii.col();		// Ice
+		qpt->C[i1p] -= f4p(i4p) * ii.val();
+	}
+
+	// =========================== Initial guess at solution
+	bool zero_initial(initial3.size() == 0);
+	for (int i3p=0; i3p<n3p; ++i3p) {
+		if (zero_initial) {
+			// No initial guess, start at 0
+			qpt->X[i3p] = 0;
+		} else {
+			// Use initial guess supplied by user
+			int i3x = ua.trans_3x_3p.b2a(i3p);
+			int i3 = trans_3_3x.i3x_to_i3(i3x);
+			double val = initial3(i3);
+			if (std::isnan(val)) {
+				fprintf(stderr, "ERROR: ice_to_hp(), NaN in initial guess, i3=%d\n", i3);
+				qpt->X[i3p] = 0;
+			} else {
+				qpt->X[i3p] = val;
+			}
+		}
+	}
+
+	// =========================== Solve the Problem!
+	// (Factorizes on the first call; reuses the factorization after that)
+	eqp->solve(*qpt);
+
+	// --------- Pick out the answer and convert back to standard vector space
+	x3.clear();
+	x3.reserve(n3p);
+	for (int i3p=0; i3p<n3p; ++i3p) {
+		int i3x = ua.trans_3x_3p.b2a(i3p);
+		int i3 = trans_3_3x.i3x_to_i3(i3x);
+		x3.push_back(std::make_pair(i3, qpt->X[i3p]));
+	}
+}
+// -------------------------------------------------------------
+/** Shared state for the worker threads in IceToHPSolver::solve() */
+struct QPWork {
+	std::vector<std::unique_ptr<IceToHPSub>> *subs;
+	std::vector<std::map<int, blitz::Array<double,1>>> const *f4s_list;
+	std::vector<blitz::Array<double,1>> const *initial3s;
+	I3XTranslator const *trans_3_3x;
+
+	/** Solution of each field, for each subproblem: [isub][ifield] */
+	std::vector<std::vector<std::vector<std::pair<int,double>>>> x3s;
+
+	boost::mutex mutex;		// Protects next_sub and error
+	int next_sub;
+	bool error;
+
+	QPWork() : next_sub(0), error(false) {}
+
+	/** Thread body: solves subproblems until there are none left. */
+	void run();
+};
+
+void QPWork::run()
+{
+	// Subproblems are handed out in chunks: with MULTI_QP there is
+	// one tiny (dense) subproblem per GCM grid cell.
+	int const chunk = 64;
+
+	blitz::Array<double,1> const no_initial3;
+	for (;;) {
+		int isub0, isub1;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			if (error || next_sub >= (int)subs->size()) return;
+			isub0 = next_sub;
+			isub1 = std::min(isub0 + chunk, (int)subs->size());
+			next_sub = isub1;
+		}
+
+		try {
+			for (int isub=isub0; isub < isub1; ++isub) {
+				IceToHPSub &sub(*(*subs)[isub]);
+				for (size_t k=0; k < f4s_list->size(); ++k) {
+					sub.solve((*f4s_list)[k],
+						initial3s->size() == 0 ? no_initial3 : (*initial3s)[k],
+						*trans_3_3x, x3s[isub][k]);
+				}
+			}
+		} catch(...) {
+			boost::lock_guard<boost::mutex> lock(mutex);
+			error = true;
+			return;
+		}
+	}
+}
+// -------------------------------------------------------------
+IceToHPSolver::IceToHPSolver(MatrixMaker *maker,
+	std::vector<int> const &_sheet_ids,
+	QPAlgorithm _qp_algorithm)
+: sheet_ids(_sheet_ids), qp_algorithm(_qp_algorithm)
+{
+printf("BEGIN IceToHPSolver::IceToHPSolver()\n");
+	build(maker, NULL);
+printf("END IceToHPSolver::IceToHPSolver(): %ld subproblems\n", subs.size());
+}
+
+void IceToHPSolver::update(MatrixMaker *maker, std::vector<int> const &i1s)
+{
+	GetSubID get_subid(qp_algorithm);
+	std::vector<int> subids;
+	subids.reserve(i1s.size());
+	for (auto ii = i1s.begin(); ii != i1s.end(); ++ii)
+		subids.push_back(get_subid(*ii));
+	std::sort(subids.begin(), subids.end());
+	subids.erase(std::unique(subids.begin(), subids.end()), subids.end());
+	if (subids.size() == 0) return;
+
+printf("BEGIN IceToHPSolver::update(): %ld of %ld subproblems\n", subids.size(), subs.size());
+	build(maker, &subids);
+printf("END IceToHPSolver::update()\n");
+}
+
+void IceToHPSolver::build(MatrixMaker *maker, std::vector<int> const *only_subids)
+{
+	bool const convert_3_3x = false;		// Didn't seem to help
+
+	// =============== Partition big QP problems into many little ones
+	// (if caller requested)
+	GetSubID get_subid(qp_algorithm);
+	auto rebuild = [&](int subid) -> bool {
+		return !only_subids || std::binary_search(
+			only_subids->begin(), only_subids->end(), subid);
+	};
+
+	// Temporary variables required on a per-sub-problem basis
+	// (NULL for subproblems that are not being built)
+	std::map<int, std::unique_ptr<IceToHPSub>> used;		// subid -> A bunch of used sets
+	auto get_ua = [&](int i1) -> UsedAll * {
+		int subid = get_subid(i1);
+		auto ii(used.find(subid));
+		if (ii == used.end()) {
+			if (!rebuild(subid)) return NULL;
+			ii = used.insert(std::make_pair(subid,
+				std::unique_ptr<IceToHPSub>(new IceToHPSub(subid)))).first;
+		}
+		return &ii->second->ua;
+	};
+
+	// =============== Set up basic vector spaces for optimization problem
+
+	// Used in constraints
+	std::shared_ptr<giss::VectorSparseMatrix const> RM0(maker->hp_to_atm());	// 3->1
+	for (auto ii = RM0->begin(); ii != RM0->end(); ++ii) {
+		int i1 = ii.row();
+		UsedAll *ua(get_ua(i1));
+		if (!ua) continue;
+
+		// Check RM is local for MULTI_QP algorithm
+		int i3 = ii.col();
+		if (qp_algorithm == QPAlgorithm::MULTI_QP) {
+			int i1b, k;
+			maker->hc_index->index_to_ik(i3, i1b, k);
+			if (i1b != i1) {
+				fprintf(stderr, "RM (hp2atm) matrix is non-local!\n");
+				throw std::exception();
+			}
+		}
+
+		ua->used1.push_back(i1);
+		ua->used3.push_back(i3);
+	}
+
+// In some cases in the past, QP optimization has not worked well
+// when there are grid cells with very few entries in the
+// constraints matrix.  Not an issue here now.
+#if 0
+	std::shared_ptr<giss::VectorSparseMatrix const> RM(
+		remove_small_constraints(*RM0, 2));
+	RM0.reset();
+#else
+	std::shared_ptr<giss::VectorSparseMatrix const> RM(std::move(RM0));
+#endif
+
+	giss::DenseAccumulator<int,double> area1(maker->n1());
+	std::map<int, std::shared_ptr<giss::VectorSparseMatrix const>> Ss;
+	std::map<int, std::shared_ptr<giss::VectorSparseMatrix const>> XMs;
+	std::map<int, size_t> size4;	// Size of each ice vector space
+	for (auto id = sheet_ids.begin(); id != sheet_ids.end(); ++id) {
+		IceSheet *sheet = (*maker)[*id];
+
+		std::shared_ptr<giss::VectorSparseMatrix const> S(
+			maker->iceinterp_to_projatm(sheet, area1, IceInterp::INTERP));		// 4 -> 1
+		if (maker->correct_area1) {
+			// S is shared with the matrix cache: correct a copy
+			std::shared_ptr<giss::VectorSparseMatrix> Sc(
+				new giss::VectorSparseMatrix(*S));
+			giss::scale_rows(sheet->atm_proj_correct(ProjCorrect::PROJ_TO_NATIVE), *Sc);
+			S = Sc;
+		}
+		for (auto ii = S->begin(); ii != S->end(); ++ii) {
+			int i1 = ii.row();
+			UsedAll *ua(get_ua(i1));
+			if (!ua) continue;
+			ua->used1.push_back(i1);
+			ua->used4.push_back(std::make_pair(sheet->index, ii.col()));
+		}
+
+		std::shared_ptr<giss::VectorSparseMatrix const> XM(
+			maker->hp_to_iceinterp(sheet, IceInterp::INTERP));				// 3 -> 4
+//		checksum_interp(*XM, "XM");
+
+		for (auto ii = XM->begin(); ii != XM->end(); ++ii) {
+			int i4 = ii.row();
+
+			int i3 = ii.col();
+			int i1, k;
+			maker->hc_index->index_to_ik(i3, i1, k);
+
+			UsedAll *ua(get_ua(i1));
+			if (!ua) continue;
+			ua->used4.push_back(std::make_pair(sheet->index, i4));
+			ua->used3.push_back(i3);
+		}
+printf("IceToHPSolver: sheet %d\n", sheet->index);
+
+		size4[sheet->index] = sheet->n4();
+
+		// Store away for later reference
+		Ss[sheet->index] = S;
+		XMs[sheet->index] = XM;
+	}
+
+
+	// -------- Set up the i3 <-> i3x transformation (if we want to)
+	// (When only some subproblems are rebuilt, the others still use it)
+	if (!trans_3_3x.get()) trans_3_3x.reset(new I3XTranslator);
+	if (convert_3_3x) {
+		int max_k = 0;		// Maximum height class index
+		for (auto sub = used.begin(); sub != used.end(); ++sub) {
+			UsedAll *ua(&sub->second->ua);
+
+			// Convert from i3 to i3x (renumbered height class indices)
+			for (auto p3 = ua->used3.begin(); p3 != ua->used3.end(); ++p3) {
+				int i1, k;
+				maker->hc_index->index_to_ik(*p3, i1, k);
+				max_k = std::max(k, max_k);
+			}
+		}
+
+		if (!only_subids) trans_3_3x->init(&*maker->hc_index, max_k + 1);
+
+		for (auto sub = used.begin(); sub != used.end(); ++sub) {
+			UsedAll *ua(&sub->second->ua);
+
+			for (auto p3 = ua->used3.begin(); p3 != ua->used3.end(); ++p3) {
+				int i3x = trans_3_3x->i3_to_i3x(*p3);
+				ua->used3x.push_back(i3x);
+			}
+			std::vector<int>().swap(ua->used3);		// No longer needed
+		}
+	} else {
+		if (!only_subids) trans_3_3x->init_identity();
+		for (auto sub = used.begin(); sub != used.end(); ++sub) {
+			UsedAll *ua(&sub->second->ua);
+			ua->used3x = std::move(ua->used3);
+		}
+	}
+
+
+	// -------------- Set up destination renumbered matrices
+	for (auto sub = used.begin(); sub != used.end(); ++sub) {
+		UsedAll *ua(&sub->second->ua);
+		ua->trans_1_1p.init(maker->n1(), std::move(ua->used1));
+		ua->trans_4_4p.init(size4, ua->used4);
+		ua->trans_3x_3p.init(maker->n3(), std::move(ua->used3x));
+
+		int n1p = ua->trans_1_1p.nb();
+		int n4p = ua->trans_4_4p.nb();
+		int n3p = ua->trans_3x_3p.nb();
+
+		// Translate to new matrices
+		ua->RMp.reset(new giss::VectorSparseMatrix(giss::SparseDescr(n1p, n3p)));
+		ua->Sp .reset(new giss::VectorSparseMatrix(giss::SparseDescr(n1p, n4p)));
+		ua->XMp.reset(new giss::VectorSparseMatrix(giss::SparseDescr(n4p, n3p)));
+		ua->area1p_inv.resize(n1p);
+	}
+
+	// ----------------- Copy data into those matrices
+printf("Translating RM\n");
+	for (auto ii = RM->begin(); ii != RM->end(); ++ii) {
+		int i1 = ii.row();
+		UsedAll *ua(get_ua(i1));
+		if (!ua) continue;
+
+		int i3x = trans_3_3x->i3_to_i3x(ii.col());
+		ua->RMp->add(
+			ua->trans_1_1p.a2b_unchecked(i1),
+			ua->trans_3x_3p.a2b_unchecked(i3x), ii.val());
+	}
+
+
+	for (auto id = sheet_ids.begin(); id != sheet_ids.end(); ++id) {
+		int const index = *id;
+
+		// Source matrices
+		giss::VectorSparseMatrix const *S(Ss[index].get());
+		giss::VectorSparseMatrix const *XM(XMs[index].get());
+
+printf("Translating S: %d\n", index);
+		for (auto ii = S->begin(); ii != S->end(); ++ii) {
+			int i1 = ii.row();
+			UsedAll *ua(get_ua(i1));
+			if (!ua) continue;
+			ua->Sp->add(
+				ua->trans_1_1p.a2b_unchecked(i1),
+				ua->trans_4_4p.a2b_unchecked(std::make_pair(index, ii.col())),
+				ii.val());
+		}
+
+printf("Translating XM: %d\n", index);
+		for (auto ii = XM->begin(); ii != XM->end(); ++ii) {
+			int i4 = ii.row();
+
+			int i3 = ii.col();
+			int i3x = trans_3_3x->i3_to_i3x(i3);
+			int i1, k;
+			maker->hc_index->index_to_ik(i3, i1, k);
+			UsedAll *ua(get_ua(i1));
+			if (!ua) continue;
+
+			ua->XMp->add(
+				ua->trans_4_4p.a2b_unchecked(std::make_pair(index, ii.row())),
+				ua->trans_3x_3p.a2b_unchecked(i3x),
+				ii.val());
+		}
+	}
+
+	// ----------- Translate area1 -> area1p
+	for (auto sub = used.begin(); sub != used.end(); ++sub) {
+		UsedAll *ua(&sub->second->ua);
+		int n1p = ua->trans_1_1p.nb();
+
+		ua->area1p_inv.resize(n1p);
+		ua->area1p_inv = 0;
+	}
+
+	for (auto ii = area1.begin(); ii != area1.end(); ++ii) {
+		int i1 = ii->first;
+		UsedAll *ua(get_ua(i1));
+		if (!ua) continue;
+		int i1p = ua->trans_1_1p.a2b(i1);
+		ua->area1p_inv(i1p) += ii->second;
+	}
+
+	for (auto sub = used.begin(); sub != used.end(); ++sub) {
+		UsedAll *ua(&sub->second->ua);
+		int n1p = ua->trans_1_1p.nb();
+
+		for (int i1p=0; i1p<n1p; ++i1p) {
+			if (ua->area1p_inv(i1p) != 0) ua->area1p_inv(i1p) = 1.0d / ua->area1p_inv(i1p);
+		}
+
+		// ---------- Divide Sp by area1p to complete the regridding matrix
+		for (auto ii = ua->Sp->begin(); ii != ua->Sp->end(); ++ii) {
+			int i1p = ii.row();
+			ii.val() *= ua->area1p_inv(i1p);
+		}
+	}
+
+	// The used sets are no longer needed
+	for (auto sub = used.begin(); sub != used.end(); ++sub) {
+		UsedAll *ua(&sub->second->ua);
+		std::vector<int>().swap(ua->used1);
+		std::vector<std::pair<int,int>>().swap(ua->used4);
+		std::vector<int>().swap(ua->used3x);
+	}
+
+	// Keep the subproblems that were not rebuilt, and put them all
+	// back in order of subproblem ID
+	for (auto sub = subs.begin(); sub != subs.end(); ++sub) {
+		int const subid = (*sub)->subid;
+		if (!rebuild(subid)) used.insert(std::make_pair(subid, std::move(*sub)));
+	}
+	subs.clear();
+	for (auto sub = used.begin(); sub != used.end(); ++sub)
+		subs.push_back(std::move(sub->second));
+}
+
+IceToHPSolver::~IceToHPSolver() {}
+
+giss::CooVector<int, double> IceToHPSolver::solve(
+	std::map<int, blitz::Array<double,1>> const &f4s,
+	blitz::Array<double,1> const &initial3,
+	int nthread)
+{
+	std::vector<std::map<int, blitz::Array<double,1>>> f4s_list;
+	f4s_list.push_back(f4s);
+	std::vector<blitz::Array<double,1>> initial3s;
+	if (initial3.size() > 0) initial3s.push_back(initial3);
+
+	std::vector<giss::CooVector<int, double>> ret(solve(f4s_list, initial3s, nthread));
+	return std::move(ret[0]);
+}
+
+std::vector<giss::CooVector<int, double>> IceToHPSolver::solve(
+	std::vector<std::map<int, blitz::Array<double,1>>> const &f4s_list,
+	std::vector<blitz::Array<double,1>> const &initial3s,
+	int nthread)
+{
+	if (initial3s.size() != 0 && initial3s.size() != f4s_list.size()) {
+		fprintf(stderr, "IceToHPSolver::solve(): Got %ld initial guesses for %ld fields\n",
+			initial3s.size(), f4s_list.size());
+		throw std::exception();
+	}
+
+	// With fewer subproblems than threads (eg: SINGLE_QP), use the
+	// threads to assemble each subproblem instead.
+	if ((int)subs.size() < nthread) {
+		for (auto sub = subs.begin(); sub != subs.end(); ++sub)
+			if (!(*sub)->assembled) (*sub)->assemble(nthread);
+	}
+
+	// ----------------- Solve the subproblems
+	// Solutions are gathered in subproblem order, so the result
+	// does not depend on the number of threads.
+	QPWork work;
+	work.subs = &subs;
+	work.f4s_list = &f4s_list;
+	work.initial3s = &initial3s;
+	work.trans_3_3x = &*trans_3_3x;
+	work.x3s.resize(subs.size());
+	for (auto x3 = work.x3s.begin(); x3 != work.x3s.end(); ++x3)
+		x3->resize(f4s_list.size());
+
+	nthread = std::max(1, std::min(nthread, (int)subs.size()));
+	if (nthread == 1) {
+		work.run();
+	} else {
+		printf("IceToHPSolver: %ld QP subproblems on %d threads\n",
+			subs.size(), nthread);
+		boost::thread_group threads;
+		for (int i=0; i<nthread; ++i)
+			threads.create_thread(boost::bind(&QPWork::run, &work));
+		threads.join_all();
+	}
+	if (work.error) {
+		fprintf(stderr, "IceToHPSolver::solve(): Error solving QP subproblem\n");
+		throw std::exception();
+	}
+
+	std::vector<giss::CooVector<int, double>> ret3(f4s_list.size());	// Function return value
+	for (auto x3 = work.x3s.begin(); x3 != work.x3s.end(); ++x3) {
+		for (size_t k=0; k < f4s_list.size(); ++k) {
+			std::vector<std::pair<int,double>> const &x3k((*x3)[k]);
+			for (auto ii = x3k.begin(); ii != x3k.end(); ++ii)
+				ret3[k].add(ii->first, ii->second);
+		}
+	}
+
+	return ret3;
+}
+
+}	// namespace glint2
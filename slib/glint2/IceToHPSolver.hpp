@@ -0,0 +1,97 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+#include <blitz/array.h>
+#include <giss/CooVector.hpp>
+#include <glint2/MatrixMaker.hpp>
+
+namespace glint2 {
+
+class I3XTranslator;
+struct IceToHPSub;
+
+/** Persistent solver for MatrixMaker::iceinterp_to_hp().
+
+The QP problem(s) solved there have constraints RMp and Hessian
+2 XMp^T XMp, which depend only on geometry, masks and elevations;
+only the linear and constant terms (G, C, f) depend on the field being
+regridded.  This class sets up the subproblems once, factorizes each
+one the first time it is solved, and then solves further fields
+reusing that factorization.
+
+A solver is only valid as long as the MatrixMaker's matrices are;
+MatrixMaker::ice_to_hp_solver() takes care of that. */
+class IceToHPSolver {
+	std::unique_ptr<I3XTranslator> trans_3_3x;
+
+	/** The subproblems, in order of subproblem ID */
+	std::vector<std::unique_ptr<IceToHPSub>> subs;
+
+	/** Sets up the subproblems from the MatrixMaker's current matrices.
+	@param only_subids Sorted IDs of the subproblems to (re)build, in
+		place of the existing ones; or NULL to build them all. */
+	void build(MatrixMaker *maker, std::vector<int> const *only_subids);
+
+public:
+	/** Ice sheets (by index) this solver was set up for */
+	std::vector<int> const sheet_ids;
+
+	QPAlgorithm const qp_algorithm;
+
+	/** Sets up (but does not yet factorize) the QP subproblems.
+	@param sheet_ids Ice sheets whose fields will be regridded. */
+	IceToHPSolver(MatrixMaker *maker,
+		std::vector<int> const &sheet_ids,
+		QPAlgorithm qp_algorithm);
+
+	~IceToHPSolver();
+
+	/** Rebuilds just the subproblems touching some GCM grid cells,
+	after the MatrixMaker's matrices have changed there (eg: because
+	elev2 changed; see IceSheet::changed_cells1()).  With SINGLE_QP,
+	that is the whole problem. */
+	void update(MatrixMaker *maker, std::vector<int> const &i1s);
+
+	/** Number of QP subproblems (one per GCM grid cell for MULTI_QP) */
+	size_t nsub() const { return subs.size(); }
+
+	/** Regrids one field from the interpolation grid to elevation points.
+	@param f4s Field on each ice sheet's interpolation grid (by sheet index).
+	@param initial3 Initial guess [n3]; or empty to start from 0.
+	@param nthread Number of threads to solve subproblems on. */
+	giss::CooVector<int, double> solve(
+		std::map<int, blitz::Array<double,1>> const &f4s,
+		blitz::Array<double,1> const &initial3,
+		int nthread = 1);
+
+	/** Regrids several fields at once.  Each subproblem is solved for
+	all fields in turn, while its factorization is at hand.
+	@param f4s_list One set of fields (as in solve() above) per field.
+	@param initial3s Initial guess for each field; or empty to start from 0. */
+	std::vector<giss::CooVector<int, double>> solve(
+		std::vector<std::map<int, blitz::Array<double,1>>> const &f4s_list,
+		std::vector<blitz::Array<double,1>> const &initial3s,
+		int nthread = 1);
+};
+
+}	// namespace glint2
@@ -17,6 +17,7 @@
  */
 
 #include <cmath>
+#include <ctime>
 #include <giss/CooVector.hpp>
 #include <giss/ncutil.hpp>
 #include <glint2/MatrixMaker.hpp>
@@ -27,6 +28,7 @@
 #include <galahad/eqp_c.hpp>
 #include <giss/ncutil.hpp>
 #include <giss/enum.hpp>
+#include <glint2/IceToHPSolver.hpp>
 
 namespace glint2 {
 
@@ -38,10 +40,13 @@ void MatrixMaker::clear()
 	mask1.reset();
 	hpdefs.clear();
 	// hcmax.clear();
+	invalidate_matrices();
 }
 
 void MatrixMaker::realize() {
 
+	invalidate_matrices();
+
 	// ---------- Check array bounds
 	long n1 = grid1->ndata();
 	if (mask1.get() && mask1->extent(0) != n1) {
@@ -72,210 +77,209 @@ printf("MatrixMaker: %p.sheetno = %d\n", &*sheet, sheet->index);
 	
 	sheets_by_id.insert(std::make_pair(sheet->index, sheet.get()));
 	sheets.insert(sheet->name, std::move(sheet));
+	invalidate_matrices();
 	return index;
 }
 
 // --------------------------------------------------------------
-/** NOTE: Allows for multiple ice sheets overlapping the same grid cell (as long as they do not overlap each other, which would make no physical sense). */
-void MatrixMaker::fgice(giss::CooVector<int,double> &fgice1)
-{
-
-	// Accumulate areas over all ice sheets
-	giss::SparseAccumulator<int,double> area1_m_hc;
-	fgice1.clear();
-	for (auto sheet = sheets.begin(); sheet != sheets.end(); ++sheet) {
+// The matrix cache
 
-		// Local area1_m just for this ice sheet
-		giss::SparseAccumulator<int,double> area1_m;
-		sheet->accum_areas(area1_m);
-
-		// Use the local area1_m to contribute to fgice1
-		giss::Proj2 proj;
-		grid1->get_ll_to_xy(proj, sheet->grid2->sproj);
-		for (auto ii = area1_m.begin(); ii != area1_m.end(); ++ii) {
-			int const i1 = ii->first;
-			double ice_covered_area = ii->second;
-			Cell *cell = grid1->get_cell(i1);
-			if (!cell) continue;	// Ignore cells in the halo
-			double area1 = area_of_proj_polygon(*cell, proj);
-			fgice1.add(i1, ice_covered_area / area1);
+/** FNV-1a hash, accumulated over a series of values. */
+class Fingerprint {
+	size_t _h;
+public:
+	Fingerprint() : _h(14695981039346656037ULL) {}
 
+	void add_bytes(void const *p, size_t n) {
+		unsigned char const *c = (unsigned char const *)p;
+		for (size_t i=0; i<n; ++i) {
+			_h ^= c[i];
+			_h *= 1099511628211ULL;
 		}
 	}
-	fgice1.sort();
-}
-
-// --------------------------------------------------------------
-/** Change this to a boost function later
-@param trans_2_2p Tells us which columns of conserv (i2) are active,
-       after masking with mask1, mask1h and mask2.
-*/
-static std::unique_ptr<giss::VectorSparseMatrix> remove_small_constraints(
-giss::VectorSparseMatrix const &in_constraints_const,
-int min_row_count)
-{
-	// Const cast because we don't know how to do const_iterator() right in VectorSparseMatrix
-	auto in_constraints(const_cast<giss::VectorSparseMatrix &>(in_constraints_const));
-
-	std::set<int> delete_row;		// Rows to delete
-	std::set<int> delete_col;		// Cols to delete
-
-	// Make sure there are no constraints (rows) with too few variables (columns).
-	// Uses an iterative process
-	std::vector<int> row_count(in_constraints.nrow);
-	for (;;) {
-		// Count rows
-		row_count.clear(); row_count.resize(in_constraints.nrow);
-		for (auto oi = in_constraints.begin(); oi != in_constraints.end(); ++oi) {
-			int i2 = oi.col();
-
-			// Loop if it's already in our delete_row and delete_col sets
-			if (delete_row.find(oi.row()) != delete_row.end()) continue;
-			if (delete_col.find(i2) != delete_col.end()) continue;
-
-			++row_count[oi.row()];
-		}
 
+	template<class T>
+	void add(T const &val) { add_bytes(&val, sizeof(val)); }
 
-		// Add to our deletion set
-		int num_deleted = 0;
-		for (auto oi = in_constraints.begin(); oi != in_constraints.end(); ++oi) {
-			int i2 = oi.col();
+	/** Blitz++ arrays might not be contiguous, so go element by element */
+	template<class T>
+	void add(blitz::Array<T,1> const &arr) {
+		add(arr.extent(0));
+		for (int i=arr.lbound(0); i<=arr.ubound(0); ++i) add(arr(i));
+	}
 
-			// Loop if it's already in our delete_row and delete_col sets
-			if (delete_row.find(oi.row()) != delete_row.end()) continue;
-			if (delete_col.find(i2) != delete_col.end()) continue;
+	size_t value() const { return _h; }
+};
 
-			if (row_count[oi.row()] < min_row_count) {
-				++num_deleted;
-				delete_row.insert(oi.row());
-				delete_col.insert(i2);
-			}
+size_t MatrixMaker::matrix_fingerprint(IceSheet const *sheet, bool contents) const
+{
+	Fingerprint fp;
+	fp.add(correct_area1);
+	fp.add(_hc_index_type.index());
+	if (!contents) fp.add(grid1.get());
+	fp.add(hpdefs.size());
+	if (hpdefs.size() > 0) fp.add_bytes(&hpdefs[0], hpdefs.size() * sizeof(double));
+	fp.add(mask1.get() != NULL);
+	if (mask1.get()) fp.add(*mask1);
+
+	for (auto ii = sheets.begin(); ii != sheets.end(); ++ii) {
+		IceSheet const *sh = &*ii;
+		if (sheet && sh != sheet) continue;
+
+		fp.add(sh->interp_style.index());
+		fp.add(sh->mask2.get() != NULL);
+		if (sh->mask2.get()) fp.add(*sh->mask2);
+		if (contents) {
+			fp.add_bytes(sh->name.c_str(), sh->name.size() + 1);
+			fp.add(sh->elev2);
+		} else {
+			fp.add(sh);
+			fp.add(sh->grid2.get());
+			fp.add(sh->exgrid.get());
+			fp.add(sh->elev2.extent(0));
 		}
-
-		// Terminate if we didn't remove anything on this round
-printf("num_deleted = %d\n", num_deleted);
-		if (num_deleted == 0) break;
 	}
+	return fp.value();
+}
 
-
-	// Copy over the matrix, deleting rows and columns as planned
-	std::unique_ptr<giss::VectorSparseMatrix> out_constraints(
-		new giss::VectorSparseMatrix(giss::SparseDescr(in_constraints)));
-	for (auto oi = in_constraints.begin(); oi != in_constraints.end(); ++oi) {
-		int i2 = oi.col();
-
-		// Loop if it's already in our delete_row and delete_col sets
-		if (delete_row.find(oi.row()) != delete_row.end()) continue;
-		if (delete_col.find(i2) != delete_col.end()) continue;
-
-		out_constraints->set(oi.row(), i2, oi.val());
+std::map<int, long> MatrixMaker::elev2_versions(IceSheet const *sheet) const
+{
+	std::map<int, long> ret;
+	for (auto ii = sheets.begin(); ii != sheets.end(); ++ii) {
+		IceSheet const *sh = &*ii;
+		if (sheet && sh != sheet) continue;
+		ret[sh->index] = sh->elev2_version();
 	}
-	return out_constraints;
+	return ret;
 }
-// -------------------------------------------------------------
-/** Checksums an interpolation matrix, to ensure that the sume of weights
-for each output grid cell is 1.  This should always be the case, no
-matter what kind of interpolation is used. */
-static bool checksum_interp(giss::VectorSparseMatrix &mat, std::string const &name,
-double epsilon)
+
+void MatrixMaker::check_elev2_mask2(IceSheet const *sheet)
 {
-	bool ret = true;
-	auto rowsums(mat.sum_per_row_map());
-	for (auto ii = rowsums.begin(); ii != rowsums.end(); ++ii) {
-		int row = ii->first;
-		double sum = ii->second;
-		if (std::abs(sum - 1.0d) > epsilon) {
-			printf("rowsum != 1 at %s: %d %g\n", name.c_str(), row, sum);
-			ret = false;
-		}
+	for (auto ii = sheets.begin(); ii != sheets.end(); ++ii) {
+		if (sheet && &*ii != sheet) continue;
+		ii->check_elev2_mask2();
 	}
-	return false;
 }
-// -------------------------------------------------------------
-class I3XTranslator {
-	HCIndex *hc_index;
-	int nhc;
 
-public:
+void MatrixMaker::invalidate_matrices()
+{
+	_matrix_cache.clear();
+	_ice_to_hp_solver.reset();
+}
 
-	void init(HCIndex *_hc_index, int _nhc)
-	{
-		hc_index = _hc_index;
-		nhc = _nhc;
-	}
+MatrixMaker::CachedMatrix &MatrixMaker::cached_matrix(
+	IceSheet const *sheet, MatrixKind kind, int interp,
+	boost::function<void (CachedMatrix &)> const &compute,
+	boost::function<bool (CachedMatrix &)> const &patch)
+{
+	MatrixKey key(sheet ? sheet->index : -1, kind.index(), interp);
+	check_elev2_mask2(sheet);
+	// The fingerprint covers mask2 by value; elev2 is covered by the
+	// versions, which check_elev2_mask2() has just made current.
+	size_t fingerprint = matrix_fingerprint(sheet, false);
+	std::map<int, long> versions(elev2_versions(sheet));
+
+	auto ii(_matrix_cache.find(key));
+	if (ii != _matrix_cache.end() && ii->second.fingerprint == fingerprint) {
+		CachedMatrix &entry(ii->second);
+		if (entry.elev2_versions == versions) {
+			++matrix_cache_stats.hits;
+			return entry;
+		}
 
-	// Identity Transformation
-	void init_identity() {
-		hc_index = 0;
-		nhc = -1;
+		// Only elev2 has changed: patch the matrix (a copy of it,
+		// if callers still hold the old one)
+		if (entry.M.use_count() > 1)
+			entry.M.reset(new giss::VectorSparseMatrix(*entry.M));
+		if (patch && patch(entry)) {
+			entry.elev2_versions = std::move(versions);
+			++matrix_cache_stats.hits;
+			++matrix_cache_stats.patches;
+			return entry;
+		}
 	}
 
-	I3XTranslator() : hc_index(0), nhc(-1) {}
+	++matrix_cache_stats.misses;
+	CachedMatrix entry;
+	compute(entry);
+	entry.fingerprint = fingerprint;
+	entry.elev2_versions = std::move(versions);
 
-	int i3x_to_i3(int i3x)
-	{
-		if (!hc_index) return i3x;		// Identity
-
-		int i1 = i3x / nhc;
-		int k = i3x - i1 * nhc;
-		return hc_index->ik_to_index(i1, k);
-	}
+	CachedMatrix &ret(_matrix_cache[key]);
+	ret = std::move(entry);
+	return ret;
+}
 
-	int i3_to_i3x(int i3)
-	{
-		if (!hc_index) return i3;		// Identity
+std::shared_ptr<giss::VectorSparseMatrix const> MatrixMaker::hp_to_iceinterp(
+	IceSheet *sheet, IceInterp dest)
+{
+	return cached_matrix(sheet, MatrixKind::HP_TO_ICEINTERP, dest.index(),
+		[&](CachedMatrix &e)
+			{ e.M = sheet->hp_to_iceinterp(dest); },
+		[&](CachedMatrix &e) -> bool
+			{ return sheet->patch_hp_to_iceinterp(*e.M, dest, e.elev2_versions.at(sheet->index)); }
+		).M;
+}
 
-		int i1, k;
-		hc_index->index_to_ik(i3, i1, k);
-		int i3x = i1 * nhc + k;
-	//printf("i3=%d (%d, %d) --> i3x=%d\n", i3, i1, k, i3x);
-		return i3x;
-	}
-};
-// -------------------------------------------------------------
-struct UsedAll {
-	std::set<int> used1;
-	std::set<std::pair<int,int>> used4;
-	std::set<int> used3;
-	std::set<int> used3x;
-	giss::IndexTranslator trans_1_1p;
-	giss::IndexTranslator2 trans_4_4p;
-	giss::IndexTranslator trans_3x_3p;
-
-	std::unique_ptr<giss::VectorSparseMatrix> RMp;
-	std::unique_ptr<giss::VectorSparseMatrix> Sp;
-	std::unique_ptr<giss::VectorSparseMatrix> XMp;
-	blitz::Array<double,1> area1p_inv;
-
-	UsedAll() :
-		trans_1_1p("trans_1_1p"),
-		trans_4_4p("trans_4_4p"),
-		trans_3x_3p("trans_3x_3p") {}
+std::shared_ptr<giss::VectorSparseMatrix const> MatrixMaker::iceinterp_to_projatm(
+	IceSheet *sheet,
+	giss::DenseAccumulator<int,double> &area1_m,
+	IceInterp src)
+{
+	CachedMatrix &entry(cached_matrix(sheet, MatrixKind::ICEINTERP_TO_PROJATM, src.index(),
+		[&](CachedMatrix &e)
+		{
+			e.area1_m = giss::DenseAccumulator<int,double>(n1());
+			e.M = sheet->iceinterp_to_projatm(e.area1_m, src);
+		},
+		// Does not depend on elev2
+		[](CachedMatrix &e) -> bool { return true; }
+		));
+	for (auto ii = entry.area1_m.begin(); ii != entry.area1_m.end(); ++ii)
+		area1_m.add(ii->first, ii->second);
+	return entry.M;
+}
 
-};
+// --------------------------------------------------------------
+/** NOTE: Allows for multiple ice sheets overlapping the same grid cell (as long as they do not overlap each other, which would make no physical sense). */
+void MatrixMaker::fgice(giss::CooVector<int,double> &fgice1)
+{
 
-class GetSubID {
-	QPAlgorithm _qp_algorithm;
-public:
-	GetSubID(QPAlgorithm qp_algorithm) : _qp_algorithm(qp_algorithm) {}
-	int operator()(int i1) {
-		if (_qp_algorithm == QPAlgorithm::SINGLE_QP) return 0;
-		return i1;
-	}
-};
+	// Accumulate areas over all ice sheets
+	giss::DenseAccumulator<int,double> area1_m_hc;
+	giss::DenseAccumulator<int,double> area1_m(n1());
+	fgice1.clear();
+	for (auto sheet = sheets.begin(); sheet != sheets.end(); ++sheet) {
 
-static int get_subid(int i1) { return i1; }
+		// Local area1_m just for this ice sheet
+		area1_m.clear();
+		sheet->accum_areas(area1_m);
 
+		// Use the local area1_m to contribute to fgice1
+		giss::Proj2 proj;
+		grid1->get_ll_to_xy(proj, sheet->grid2->sproj);
+		for (auto ii = area1_m.begin(); ii != area1_m.end(); ++ii) {
+			int const i1 = ii->first;
+			double ice_covered_area = ii->second;
+			Cell *cell = grid1->get_cell(i1);
+			if (!cell) continue;	// Ignore cells in the halo
+			double area1 = area_of_proj_polygon(*cell, proj);
+			fgice1.add(i1, ice_covered_area / area1);
 
+		}
+	}
+	fgice1.sort();
+}
 
+// --------------------------------------------------------------
 /** @params f2 Some field on each ice grid (referenced by ID).  Do not have to be complete. */
 giss::CooVector<int, double>
 MatrixMaker::iceinterp_to_hp(
 std::map<int, blitz::Array<double,1>> &f2_or_4s,		// Actually f2 or f4
 blitz::Array<double,1> initial3,
 IceInterp src,
-QPAlgorithm qp_algorithm)
+QPAlgorithm qp_algorithm,
+int nthread)
 {
 printf("BEGIN MatrixMaker::iceinterp_to_hp()\n");
 
@@ -296,345 +300,47 @@ printf("BEGIN MatrixMaker::iceinterp_to_hp()\n");
 	}
 
 
-	bool const convert_3_3x = false;		// Didn't seem to help
-
-	// =============== Partition big QP problems into many little ones
-	// (if caller requested)
-	GetSubID get_subid(qp_algorithm);
-	// Temporary variables required on a per-sub-problem basis
-	giss::MapDict_Create<int, UsedAll> used;		// subid -> A bunch of used sets
-
-	// =============== Set up basic vector spaces for optimization problem
-
-	// Used in constraints
-	std::unique_ptr<giss::VectorSparseMatrix> RM0(hp_to_atm());	// 3->1
-	for (auto ii = RM0->begin(); ii != RM0->end(); ++ii) {
-		int i1 = ii.row();
-		UsedAll &ua(*used[get_subid(i1)]);
-
-		// Check RM is local for MULTI_QP algorithm
-		int i3 = ii.col();
-		if (qp_algorithm == QPAlgorithm::MULTI_QP) {
-			int i1b, k;
-			hc_index->index_to_ik(i3, i1b, k);
-			if (i1b != i1) {
-				fprintf(stderr, "RM (hp2atm) matrix is non-local!\n");
-				throw std::exception();
-			}
-		}
-
-		ua.used1.insert(i1);
-		ua.used3.insert(i3);
-	}
-
-// In some cases in the past, QP optimization has not worked well
-// when there are grid cells with very few entries in the
-// constraints matrix.  Not an issue here now.
-#if 0
-	std::unique_ptr<giss::VectorSparseMatrix> RM(
-		remove_small_constraints(*RM0, 2));
-	RM0.reset();
-#else
-	std::unique_ptr<giss::VectorSparseMatrix> RM(std::move(RM0));
-#endif
-
-	giss::SparseAccumulator<int,double> area1;
-	giss::MapDict<int, giss::VectorSparseMatrix> Ss;
-	giss::MapDict<int, giss::VectorSparseMatrix> XMs;
-	std::map<int, size_t> size4;	// Size of each ice vector space
-	for (auto f4i=f4s->begin(); f4i != f4s->end(); ++f4i) {
-		IceSheet *sheet = (*this)[f4i->first];
-
-		std::unique_ptr<giss::VectorSparseMatrix> S(
-			sheet->iceinterp_to_projatm(area1, IceInterp::INTERP));		// 4 -> 1
-		if (correct_area1) S = multiply(
-			*sheet->atm_proj_correct(ProjCorrect::PROJ_TO_NATIVE),
-			*S);
-		for (auto ii = S->begin(); ii != S->end(); ++ii) {
-			int i1 = ii.row();
-			UsedAll &ua(*used[get_subid(i1)]);
-			ua.used1.insert(i1);
-			ua.used4.insert(std::make_pair(sheet->index, ii.col()));
-		}
-
-		std::unique_ptr<giss::VectorSparseMatrix> XM(
-			sheet->hp_to_iceinterp(IceInterp::INTERP));				// 3 -> 4
-//		checksum_interp(*XM, "XM");
-
-		for (auto ii = XM->begin(); ii != XM->end(); ++ii) {
-			int i4 = ii.row();
-
-			int i3 = ii.col();
-			int i1, k;
-			hc_index->index_to_ik(i3, i1, k);
-
-			UsedAll &ua(*used[get_subid(i1)]);
-			ua.used4.insert(std::make_pair(sheet->index, i4));
-			ua.used3.insert(i3);
-		}
-printf("MatrixMaker::ice_to_hp() 4\n");
-
-		size4[sheet->index] = sheet->n4();
-
-		// Store away for later reference
-		Ss.insert(sheet->index, std::move(S));
-		XMs.insert(sheet->index, std::move(XM));
-	}
-
-
-	// -------- Set up the i3 <-> i3x transformation (if we want to)
-	I3XTranslator trans_3_3x;
-	if (convert_3_3x) {
-		int max_k = 0;		// Maximum height class index
-		for (auto ua = used.begin(); ua != used.end(); ++ua) {
-
-			// Convert from i3 to i3x (renumbered height class indices)
-			for (auto p3 = ua->used3.begin(); p3 != ua->used3.end(); ++p3) {
-				int i1, k;
-				hc_index->index_to_ik(*p3, i1, k);
-				max_k = std::max(k, max_k);
-			}
-		}
-
-		trans_3_3x.init(&*hc_index, max_k + 1);
-
-		for (auto ua = used.begin(); ua != used.end(); ++ua) {
-
-			for (auto p3 = ua->used3.begin(); p3 != ua->used3.end(); ++p3) {
-				int i3x = trans_3_3x.i3_to_i3x(*p3);
-				ua->used3x.insert(i3x);
-			}
-			ua->used3.clear();		// No longer needed
-		}
-	} else {
-		trans_3_3x.init_identity();
-		for (auto ua = used.begin(); ua != used.end(); ++ua) {
-			ua->used3x = std::move(ua->used3);
-		}
-	}
-
-
-	// -------------- Set up destination renumbered matrices
-	for (auto ua = used.begin(); ua != used.end(); ++ua) {
-		ua->trans_1_1p.init(n1(), ua->used1);
-		ua->trans_4_4p.init(&size4, ua->used4);
-		ua->trans_3x_3p.init(n3(), ua->used3x);
-
-		int n1p = ua->trans_1_1p.nb();
-		int n4p = ua->trans_4_4p.nb();
-		int n3p = ua->trans_3x_3p.nb();
-
-		// Translate to new matrices
-		ua->RMp.reset(new giss::VectorSparseMatrix(giss::SparseDescr(n1p, n3p)));
-		ua->Sp .reset(new giss::VectorSparseMatrix(giss::SparseDescr(n1p, n4p)));
-		ua->XMp.reset(new giss::VectorSparseMatrix(giss::SparseDescr(n4p, n3p)));
-		ua->area1p_inv.resize(n1p);
-	}
-
-	// ----------------- Copy data into those matrices
-printf("Translating RM\n");
-	for (auto ii = RM->begin(); ii != RM->end(); ++ii) {
-		int i1 = ii.row();
-		UsedAll *ua(used[get_subid(i1)]);
-
-		int i3x = trans_3_3x.i3_to_i3x(ii.col());
-		ua->RMp->add(
-			ua->trans_1_1p.a2b(i1),
-			ua->trans_3x_3p.a2b(i3x), ii.val());
-	}
-
-
-	for (auto f4i=f4s->begin(); f4i != f4s->end(); ++f4i) {
-		int const index = f4i->first;
-		IceSheet *sheet = (*this)[index];
-
-		// Source matrices
-		giss::VectorSparseMatrix *S(Ss[index]);
-		giss::VectorSparseMatrix *XM(XMs[index]);
-
-printf("Translating S: %d\n", index);
-		for (auto ii = S->begin(); ii != S->end(); ++ii) {
-			int i1 = ii.row();
-			UsedAll *ua(used[get_subid(i1)]);
-			ua->Sp->add(
-				ua->trans_1_1p.a2b(i1),
-				ua->trans_4_4p.a2b(std::make_pair(index, ii.col())),
-				ii.val());
-		}
-
-printf("Translating XM: %d\n", index);
-		for (auto ii = XM->begin(); ii != XM->end(); ++ii) {
-			int i4 = ii.row();
-
-			int i3 = ii.col();
-			int i3x = trans_3_3x.i3_to_i3x(i3);
-			int i1, k;
-			hc_index->index_to_ik(i3, i1, k);
-			UsedAll *ua(used[get_subid(i1)]);
-
-			ua->XMp->add(
-				ua->trans_4_4p.a2b(std::make_pair(index, ii.row())),
-				ua->trans_3x_3p.a2b(i3x),
-				ii.val());
-		}
-	}
-
-	// ----------- Translate area1 -> area1p
-	for (auto ua = used.begin(); ua != used.end(); ++ua) {
-		int n1p = ua->trans_1_1p.nb();
-
-		ua->area1p_inv.resize(n1p);
-		ua->area1p_inv = 0;
-	}
-
-	for (auto ii = area1.begin(); ii != area1.end(); ++ii) {
-		int i1 = ii->first;
-		UsedAll *ua(used[get_subid(i1)]);
-		int i1p = ua->trans_1_1p.a2b(i1);
-		ua->area1p_inv(i1p) += ii->second;
-	}
-
-	for (auto ua = used.begin(); ua != used.end(); ++ua) {
-		int n1p = ua->trans_1_1p.nb();
-
-		for (int i1p=0; i1p<n1p; ++i1p) {
-			if (ua->area1p_inv(i1p) != 0) ua->area1p_inv(i1p) = 1.0d / ua->area1p_inv(i1p);
-		}
-
-		// ---------- Divide Sp by area1p to complete the regridding matrix
-		for (auto ii = ua->Sp->begin(); ii != ua->Sp->end(); ++ii) {
-			int i1p = ii.row();
-			ii.val() *= ua->area1p_inv(i1p);
-		}
-	}
-
-	giss::CooVector<int, double> ret3;		// Function return value
-	for (auto ua = used.begin(); ua != used.end(); ++ua) {
-		int n1p = ua->trans_1_1p.nb();
-		int n4p = ua->trans_4_4p.nb();
-		int n3p = ua->trans_3x_3p.nb();
-printf("--------------------- QP %d: n1p=%d, n4p=%d, n3p=%d\n", ua.key(), n1p, n4p, n3p);
-
-		// -------- Translate f4 -> f4p
-		// Ignore elements NOT listed in the translation
-		blitz::Array<double,1> f4p(n4p);
-		f4p = 0;
-		for (int i4p = 0; i4p < n4p; ++i4p) {
-			std::pair<int,int> const &a(ua->trans_4_4p.b2a(i4p));
-			int index = a.first;
-			int i4 = a.second;
-			f4p(i4p) = (*f4s)[index](i4);
-		}
-
-
-	 	// ---------- Allocate the QPT problem
-		// m = # constraints = n1p (size of atmosphere grid)
-		// n = # variabeles = n3p
-		galahad::qpt_problem_c qpt(n1p, n3p, true);
-
-		// ================ Objective Function
-		// 1/2 (XM F_E - F_I)^2    where XM = (Ice->Exch)(Elev->Ice)
-		// qpt%H = (XM)^T (XM),    qpt%G = f_I \cdot (XM),        qpt%f = f_I \cdot f_I
-
-		// -------- H = 2 * XMp^T XMp
-		giss::VectorSparseMatrix XMp_T(giss::SparseDescr(ua->XMp->ncol, ua->XMp->nrow));
-		transpose(*ua->XMp, XMp_T);
-		std::unique_ptr<giss::VectorSparseMatrix> H(multiply(XMp_T, *ua->XMp));	// n3xn3
-
-		// Count items in H lower triangle
-		size_t ltri = 0;
-		for (auto ii = H->begin(); ii != H->end(); ++ii)
-			if (ii.row() >= ii.col()) ++ltri;
-
-		// Copy ONLY the lower triangle items to GALAHAD
-		// (otherwise, GALAHAD won't work)
-printf("qpt.alloc_H(%d)\n", ltri);
-		qpt.alloc_H(ltri);
-		giss::ZD11SparseMatrix H_zd11(qpt.H, 0);
-		for (auto ii = H->begin(); ii != H->end(); ++ii) {
-			if (ii.row() >= ii.col()) {
-				H_zd11.add(ii.row(), ii.col(), 2.0d * ii.val());
-			}
-		}
-
-printf("AA1 Done\n");
-		// -------- Linear term of obj function
-		// G = -2*f4p \cdot XMp
-		for (int i=0; i < qpt.n; ++i) qpt.G[i] = 0;
-		for (auto ii = ua->XMp->begin(); ii != ua->XMp->end(); ++ii) {
-			qpt.G[ii.col()] -= 2.0d * f4p(ii.row()) * ii.val();
-		}
-
-		// --------- Constant term of objective function
-		// f = f4p \cdot f4p
-		qpt.f = 0;
-		for (int i4p=0; i4p<n4p; ++i4p) {
-			qpt.f += f4p(i4p) * f4p(i4p);
-		}
-
-		// De-allocate...
-//		H.reset();
-//		ua->XMp->clear();
-//		XMp_T.clear();
+	std::vector<int> sheet_ids;
+	for (auto f4i=f4s->begin(); f4i != f4s->end(); ++f4i)
+		sheet_ids.push_back(f4i->first);
 
-		// ============================ Constraints
-		// RM x = Sp f4p
-
-		// qpt.A = constraints matrix = RMp
-		qpt.alloc_A(ua->RMp->size());
-		giss::ZD11SparseMatrix A_zd11(qpt.A, 0);
-		copy(*ua->RMp, A_zd11);
+	return ice_to_hp_solver(sheet_ids, qp_algorithm).solve(*f4s, initial3, nthread);
+}
 
-		// Constraints: Ax + C = 0
-		// qpt.C = equality constraints RHS = Sp * f4p
-		for (int i=0; i<n1p; ++i) qpt.C[i] = 0;
-		for (auto ii = ua->Sp->begin(); ii != ua->Sp->end(); ++ii) {
-			int i1p = ii.row();		// Atm
-			int i4p = ii.col();		// Ice
-			qpt.C[i1p] -= f4p(i4p) * ii.val();
+IceToHPSolver &MatrixMaker::ice_to_hp_solver(
+	std::vector<int> const &sheet_ids,
+	QPAlgorithm qp_algorithm)
+{
+	check_elev2_mask2(NULL);
+	size_t fingerprint = matrix_fingerprint(NULL, false);
+	std::map<int, long> versions(elev2_versions(NULL));
+	if (_ice_to_hp_solver.get()
+		&& _ice_to_hp_fingerprint == fingerprint
+		&& _ice_to_hp_solver->sheet_ids == sheet_ids
+		&& _ice_to_hp_solver->qp_algorithm == qp_algorithm)
+	{
+		if (_ice_to_hp_versions == versions) return *_ice_to_hp_solver;
+
+		// Only elev2 has changed: rebuild the subproblems it touches
+		std::vector<int> i1s;
+		bool ok = true;
+		for (auto sheet = sheets.begin(); ok && sheet != sheets.end(); ++sheet) {
+			long since = _ice_to_hp_versions.at(sheet->index);
+			if (since != sheet->elev2_version())
+				ok = sheet->changed_cells1(since, i1s);
 		}
-
-		// De-allocate
-//		ua->RMp.reset();	// ->clear();
-
-		// =========================== Initial guess at solution
-		bool nanerr = false;
-		bool zero_initial(initial3.size() == 0);
-		for (int i3p=0; i3p<n3p; ++i3p) {
-			if (zero_initial) {
-				// No initial guess, start at 0
-				qpt.X[i3p] = 0;
-			} else {
-				// Use initial guess supplied by user
-				int i3x = ua->trans_3x_3p.b2a(i3p);
-				int i3 = trans_3_3x.i3x_to_i3(i3x);
-				double val = initial3(i3);
-				if (std::isnan(val)) {
-					fprintf(stderr, "ERROR: ice_to_hp(), NaN in initial guess, i3=%d\n", i3);
-					nanerr = true;
-					qpt.X[i3p] = 0;
-				} else {
-					qpt.X[i3p] = val;
-				}
-			}
-		}
-
-		// =========================== Solve the Problem!
-		double infinity = 1e20;
-		eqp_solve_simple(qpt.this_f, infinity);
-
-		// ========================================================
-		// ========================================================
-
-		// --------- Pick out the answer and convert back to standard vector space
-		for (int i3p=0; i3p<n3p; ++i3p) {
-			int i3x = ua->trans_3x_3p.b2a(i3p);
-			int i3 = trans_3_3x.i3x_to_i3(i3x);
-			ret3.add(i3, qpt.X[i3p]);
+		if (ok) {
+			_ice_to_hp_solver->update(this, i1s);
+			_ice_to_hp_versions = std::move(versions);
+			return *_ice_to_hp_solver;
 		}
 	}
 
-	return ret3;
+	_ice_to_hp_solver.reset();		// Free memory before making a new one
+	_ice_to_hp_solver.reset(new IceToHPSolver(this, sheet_ids, qp_algorithm));
+	_ice_to_hp_fingerprint = fingerprint;
+	_ice_to_hp_versions = std::move(versions);
+	return *_ice_to_hp_solver;
 }
 
 
@@ -643,16 +349,17 @@ printf("AA1 Done\n");
            the physicaly most correct answer.
 */
 giss::CooVector<int, double> MatrixMaker::atm_to_hp(blitz::Array<double,1> f1,
-bool force_lambda)
+bool force_lambda,
+AtmToHPAlgorithm algorithm)
 {
 	// RM = hp --> atm conversion
-	std::unique_ptr<giss::VectorSparseMatrix> RM0(hp_to_atm());	// 3->1
+	std::shared_ptr<giss::VectorSparseMatrix const> RM0(hp_to_atm());	// 3->1
 
 	// Find non-zero rows and columns of RM.
 	// Also see if RM is local (which eliminates need for quad opt)
 	std::unordered_map<int,double> sum1;	// Sum of RM elements
-	std::set<int> used1;
-	std::set<int> used3;
+	std::vector<int> used1;
+	std::vector<int> used3;
 	bool rm_local = true;
 	for (auto ii = RM0->begin(); ii != RM0->end(); ++ii) {
 		int i1 = ii.row();
@@ -667,9 +374,10 @@ bool force_lambda)
 		}
 
 		sum1[i1] += ii.val();
-		used1.insert(i1);
-		used3.insert(i3);
+		used1.push_back(i1);
+		used3.push_back(i3);
 	}
+	giss::compact_indices(n3(), used3);
 
 	// Compute 1 / sum1, this is the factor to multiply by.
 	// sum1(RM) = x means that height point = 1 gets scaled to x in atm grid.
@@ -699,84 +407,152 @@ printf("atm_to_hp: rm_local = %d\n", rm_local);
 
 	// -------- Create new vector spaces without the nullspace
 	giss::IndexTranslator trans_1_1p("trans_1_1p");
-	trans_1_1p.init(n1(), used1);
+	trans_1_1p.init(n1(), std::move(used1));
 	int n1p = trans_1_1p.nb();
 
 	giss::IndexTranslator trans_3_3p("trans_3_3p");
-	trans_3_3p.init(n3(), used3);
+	trans_3_3p.init(n3(), std::move(used3));
 	int n3p = trans_3_3p.nb();
 
 printf("n1p=%d, n3p=%d\n", n1p, n3p);
 
-	// Allocate optimization problem
-//	galahad::qpt_problem_c qpt(n1p, n3p, true, 1);	// Hessian_kind = 1
-	galahad::qpt_problem_c qpt(n1p, n3p, true);	// m, n, eqp
-
 	// ================== Constraints: RM f3 = f1
-	// qpt.A = constraints matrix = RMp
-
-	// LHS of constraints = RMp
 	// Translate RM matrix while copying
-	qpt.alloc_A(RM0->size());
-	giss::ZD11SparseMatrix A_zd11(qpt.A, 0);
+	giss::VectorSparseMatrix RMp(giss::SparseDescr(n1p, n3p));
+	RMp.reserve(RM0->size());
 	for (auto ii = RM0->begin(); ii != RM0->end(); ++ii) {
 		int i1 = ii.row();
 		int i3 = ii.col();
 
-		A_zd11.add(
-			trans_1_1p.a2b(i1),
-			trans_3_3p.a2b(i3),
+		RMp.add(
+			trans_1_1p.a2b_unchecked(i1),
+			trans_3_3p.a2b_unchecked(i3),
 			ii.val());
 	}
 
-	// Constraints: Ax + C = 0
-	// Constraints RHS = f1p (rescaled)
+	// RHS of constraints = f1p (rescaled)
+	blitz::Array<double,1> f1p(n1p);
 	for (int i1p=0; i1p<n1p; ++i1p) {
 		int i1 = trans_1_1p.b2a(i1p);
-		qpt.C[i1p] = -f1(i1) * sum1_inv[i1];
+		f1p(i1p) = f1(i1) * sum1_inv[i1];
 	}
 
-	// ================== Objective Function
-	// Remember: qpt.Hessian_kind = -1;
-
-	// H = 2 I
-	qpt.alloc_H(n3p);
-	giss::ZD11SparseMatrix H_zd11(qpt.H, 0);
-	for (int i3p=0; i3p<n3p; ++i3p) {
-		H_zd11.add(i3p, i3p, 2.0d);
-	}
-printf("CC1\n");
-	// Fill in qpt.X0 = \Lambda f1
-	qpt.f = 0;
+	// x0 = \Lambda f1
+	blitz::Array<double,1> x0(n3p);
 	for (int i3p=0; i3p<n3p; ++i3p) {
 		int i3 = trans_3_3p.b2a(i3p);
 
 		int i1, k;
 		hc_index->index_to_ik(i3, i1, k);
-		double hval = f1(i1) * sum1_inv[i1];
-//		qpt.X0[i3p] = hval;
-		qpt.X[i3p] = hval;		// Starting value
-		qpt.G[i3p] = -2.0d * hval;		// G = -2X0
-		qpt.f += hval * hval;			// f = x0 . x0
+		x0(i3p) = f1(i1) * sum1_inv[i1];
+	}
+
+	// ================== Minimize |x - x0|^2 subject to RMp x = f1p
+	blitz::Array<double,1> x3p(n3p);
+	bool use_qp = (algorithm != AtmToHPAlgorithm::MIN_NORM);
+	if (!use_qp) {
+		// Closed form: x = x0 + RMp^T (RMp RMp^T)^-1 (f1p - RMp x0)
+		clock_t t0 = clock();
+		x3p = x0;
+		try {
+			int iter = min_norm_project(RMp, f1p, x3p);
+			printf("atm_to_hp: min_norm_project took %d CG iterations, %g seconds\n",
+				iter, (double)(clock() - t0) / CLOCKS_PER_SEC);
+		} catch(std::exception const &e) {
+			fprintf(stderr, "atm_to_hp: min_norm_project failed, falling back to QP\n");
+			use_qp = true;
+		}
 	}
+	if (use_qp) {
+		// General QP, solved by GALAHAD
+		galahad::qpt_problem_c qpt(n1p, n3p, true);	// m, n, eqp
+
+		// qpt.A = constraints matrix = RMp
+		qpt.alloc_A(RMp.size());
+		giss::ZD11SparseMatrix A_zd11(qpt.A, 0);
+		A_zd11.append_bulk(RMp);
 
-printf("CC2\n");
+		// Constraints: Ax + C = 0
+		for (int i1p=0; i1p<n1p; ++i1p) qpt.C[i1p] = -f1p(i1p);
+
+		// ================== Objective Function
+		// Remember: qpt.Hessian_kind = -1;
 
-	// Solve it!
-	double infinity = 1e20;
-	eqp_solve_simple(qpt.this_f, infinity);
+		// H = 2 I
+		std::vector<int> diag(n3p);
+		for (int i3p=0; i3p<n3p; ++i3p) diag[i3p] = i3p;
+		std::vector<double> two(n3p, 2.0d);
+		qpt.set_H(n3p, &diag[0], &diag[0], &two[0]);
+
+		qpt.f = 0;
+		for (int i3p=0; i3p<n3p; ++i3p) {
+			double hval = x0(i3p);
+			qpt.X[i3p] = hval;		// Starting value
+			qpt.G[i3p] = -2.0d * hval;		// G = -2X0
+			qpt.f += hval * hval;			// f = x0 . x0
+		}
+
+		// Solve it!
+		double infinity = 1e20;
+		eqp_solve_simple(qpt.this_f, infinity);
+
+		for (int i3p=0; i3p<n3p; ++i3p) x3p(i3p) = qpt.X[i3p];
+	}
 
 	// --------- Pick out the answer and convert back to standard vector space
 	giss::CooVector<int, double> ret3;		// Function return value
 	for (int i3p=0; i3p<n3p; ++i3p) {
 		int i3 = trans_3_3p.b2a(i3p);
-		ret3.add(i3, qpt.X[i3p]);
+		ret3.add(i3, x3p(i3p));
 	}
 	return ret3;
 }
 // --------------------------------------------------------------
 /** TODO: This doesn't account for spherical earth */
-std::unique_ptr<giss::VectorSparseMatrix> MatrixMaker::hp_to_atm()
+std::shared_ptr<giss::VectorSparseMatrix const> MatrixMaker::hp_to_atm()
+{
+	return cached_matrix(NULL, MatrixKind::HP_TO_ATM, -1,
+		[&](CachedMatrix &e)
+			{ e.M = compute_hp_to_atm(e.rowscales); },
+		[&](CachedMatrix &e) -> bool
+			{ return patch_hp_to_atm(e); }
+		).M;
+}
+
+bool MatrixMaker::patch_hp_to_atm(CachedMatrix &e)
+{
+	// GCM cells under ice whose elev2 changed
+	std::vector<int> i1s;
+	for (auto sheet = sheets.begin(); sheet != sheets.end(); ++sheet) {
+		long since = e.elev2_versions.at(sheet->index);
+		if (since == sheet->elev2_version()) continue;
+		if (!sheet->changed_cells1(since, i1s)) return false;
+	}
+	std::vector<char> rows1(n1(), 0);
+	for (auto ii = i1s.begin(); ii != i1s.end(); ++ii) rows1[*ii] = 1;
+
+	// Recompute those rows just as compute_hp_to_atm() would.  (Adding
+	// differences instead would leave roundoff where entries should
+	// have gone away, and let it build up over many patches.)
+	// The row scaling depends on masks, not elev2, so it is unchanged.
+	giss::VectorSparseMatrix rows(giss::SparseDescr(*e.M));
+	for (auto sheet = sheets.begin(); sheet != sheets.end(); ++sheet) {
+		giss::VectorSparseMatrix sheet_rows(giss::SparseDescr(*e.M));
+		if (!sheet->hp_to_projatm_rows(rows1,
+			[&](int i1, int i3, double val) { sheet_rows.add(i1, i3, val); }))
+			return false;
+		sheet_rows.sum_duplicates();
+		giss::scale_rows(e.rowscales.at(sheet->index), sheet_rows);
+		rows.append(sheet_rows);
+	}
+	rows.sum_duplicates();
+
+	e.M->replace_rows(rows1, rows);
+	return true;
+}
+
+std::unique_ptr<giss::VectorSparseMatrix> MatrixMaker::compute_hp_to_atm(
+	std::map<int, giss::DiagonalMatrix> &rowscales)
 {
 //	int n1 = grid1->ndata();
 printf("BEGIN hp_to_atm() %d %d\n", n1(), n3());
@@ -786,17 +562,27 @@ printf("BEGIN hp_to_atm() %d %d\n", n1(), n3());
 
 	// Compute the hp->ice and ice->hc transformations for each ice sheet
 	// and combine into one hp->hc matrix for all ice sheets.
-	giss::SparseAccumulator<int,double> area1_m;
-	for (auto sheet = sheets.begin(); sheet != sheets.end(); ++sheet) {
-		auto hp2proj(sheet->hp_to_projatm(area1_m));
-		if (correct_area1) hp2proj = multiply(
-			*sheet->atm_proj_correct(ProjCorrect::PROJ_TO_NATIVE),
-			*hp2proj);
-		ret->append(*hp2proj);
+	giss::DenseAccumulator<int,double> area1_m(n1());
+	std::vector<std::unique_ptr<giss::VectorSparseMatrix>> hp2projs;
+	for (auto sheet = sheets.begin(); sheet != sheets.end(); ++sheet)
+		hp2projs.push_back(sheet->hp_to_projatm(area1_m));
+
+	// Now that area1_m is complete, scale each sheet's rows by
+	// (projection correction / area1_m), in place, and combine.
+	giss::DiagonalMatrix const area1_m_inv(area_inv_diag(n1(), area1_m));
+	auto hp2proj(hp2projs.begin());
+	for (auto sheet = sheets.begin(); sheet != sheets.end(); ++sheet, ++hp2proj) {
+		giss::DiagonalMatrix &scale(rowscales[sheet->index]);
+		if (correct_area1) {
+			scale = sheet->atm_proj_correct(ProjCorrect::PROJ_TO_NATIVE);
+			scale *= area1_m_inv;
+		} else {
+			scale = area1_m_inv;
+		}
+		giss::scale_rows(scale, **hp2proj);
+		ret->append(**hp2proj);
+		hp2proj->reset();
 	}
-
-	giss::SparseAccumulator<int,double> area1_m_inv;
-	divide_by(*ret, area1_m, area1_m_inv);
 	ret->sum_duplicates();
 
 printf("END hp_to_atm()\n");
@@ -863,7 +649,8 @@ static std::vector<std::string> parse_comma_list(std::string list)
 	return result;
 }
 
-std::unique_ptr<IceSheet> read_icesheet(NcFile &nc, std::string const &vname)
+std::unique_ptr<IceSheet> read_icesheet(NcFile &nc, std::string const &vname,
+	boost::function<bool (int)> const &include_cell1)
 {
 	auto info_var = nc.get_var((vname + ".info").c_str());
 	std::string stype(giss::get_att(info_var, "parameterization")->as_string(0));
@@ -878,7 +665,7 @@ std::unique_ptr<IceSheet> read_icesheet(NcFile &nc, std::string const &vname)
 	}
 #endif
 
-	sheet->read_from_netcdf(nc, vname);
+	sheet->read_from_netcdf(nc, vname, include_cell1);
 	printf("read_icesheet(%s) END\n", vname.c_str());
 	return sheet;
 
@@ -889,8 +676,12 @@ void MatrixMaker::read_from_netcdf(NcFile &nc, std::string const &vname)
 {
 	clear();
 
+	// Only read the cells that are part of this domain.
+	boost::function<bool (int)> include_cell1(domain->get_in_halo2());
+
 	printf("MatrixMaker::read_from_netcdf(%s) 1\n", vname.c_str());
-	grid1.reset(read_grid(nc, vname + ".grid1").release());
+	grid1.reset(read_grid(nc, vname + ".grid1",
+		cell_index_filter(include_cell1)).release());
 	if (giss::get_var_safe(nc, vname + ".mask1")) {
 		mask1.reset(new blitz::Array<int,1>(
 		giss::read_blitz<int,1>(nc, vname + ".mask1")));
@@ -917,19 +708,8 @@ printf("2 Set mask1 = %p\n", mask1.get());
 		std::string var_name(vname + "." + *sname);
 		printf("MatrixMaker::read_from_netcdf(%s) %s 3\n",
 			vname.c_str(), var_name.c_str());
-		add_ice_sheet(read_icesheet(nc, var_name));
+		add_ice_sheet(read_icesheet(nc, var_name, include_cell1));
 	}
-
-	// Remove grid cells that are not part of this domain.
-	// TODO: This should be done while reading the cells in the first place.
-	boost::function<bool (int)> include_cell1(domain->get_in_halo2());
-	grid1->filter_cells(include_cell1);
-
-	// Now remove cells from the exgrids and grid2s that interacted with grid1
-	for (auto sheet=sheets.begin(); sheet != sheets.end(); ++sheet) {
-		sheet->filter_cells1(include_cell1);
-	}
-
 }
 
 std::unique_ptr<IceSheet> new_ice_sheet(Grid::Parameterization parameterization)
@@ -19,6 +19,8 @@
 #pragma once
 
 #include <memory>
+#include <map>
+#include <tuple>
 #include <giss/CooVector.hpp>
 #include <glint2/Grid.hpp>
 #include <glint2/matrix_ops.hpp>
@@ -40,11 +42,35 @@ namespace glint2 {
 
 typedef giss::SparseAccumulator<std::pair<int,int>, double, giss::HashPair<int,int>> SparseAccumulator1hc;
 
+class IceToHPSolver;
+
 BOOST_ENUM_VALUES( QPAlgorithm, int,
 	(SINGLE_QP)		(0)
 	(MULTI_QP)		(1)
 )
 
+/** How atm_to_hp() solves its (non-local) least-squares problem */
+BOOST_ENUM_VALUES( AtmToHPAlgorithm, int,
+	(QP)			(0)		/// General equality-constrained QP (GALAHAD)
+	(MIN_NORM)		(1)		/// Closed-form projection, CG on RM RM^T
+)
+
+/** Kinds of regridding matrix held in the MatrixMaker's matrix cache */
+BOOST_ENUM_VALUES( MatrixKind, int,
+	(HP_TO_ATM)				(0)
+	(HP_TO_ICEINTERP)		(1)
+	(ICEINTERP_TO_PROJATM)	(2)
+)
+
+/** Hit/miss counts for the MatrixMaker's matrix cache */
+struct MatrixCacheStats {
+	long hits;
+	long misses;
+	long patches;	/// Hits that were patched for a change in elev2
+
+	MatrixCacheStats() : hits(0), misses(0), patches(0) {}
+};
+
 /** Generates the matrices required in the GCM */
 class MatrixMaker
 {
@@ -55,7 +81,65 @@ public:
 protected:
 	int _next_sheet_index;
 	std::unique_ptr<GridDomain> domain;
+
+	/** One entry in the matrix cache */
+	struct CachedMatrix {
+		/** matrix_fingerprint(sheet, false) of the inputs the matrix
+		was computed from */
+		size_t fingerprint;
+		/** elev2_version() of each ice sheet M is up to date with */
+		std::map<int, long> elev2_versions;
+		std::shared_ptr<giss::VectorSparseMatrix> M;
+		/** Area accumulated while computing M (ICEINTERP_TO_PROJATM only) */
+		giss::DenseAccumulator<int,double> area1_m;
+		/** Row scaling applied to each sheet's part of M (HP_TO_ATM only) */
+		std::map<int, giss::DiagonalMatrix> rowscales;
+	};
+
+	/** (sheet index or -1, MatrixKind, IceInterp or -1) --> matrix */
+	typedef std::tuple<int,int,int> MatrixKey;
+	std::map<MatrixKey, CachedMatrix> _matrix_cache;
+
+	/** @return elev2_version() of one ice sheet (or all, if sheet is NULL) */
+	std::map<int, long> elev2_versions(IceSheet const *sheet) const;
+
+	/** Calls IceSheet::check_elev2_mask2() on one ice sheet (or all, if
+	sheet is NULL), so the version counters cover changes to elev2
+	and mask2 made in place without elev2_mask2_changed(). */
+	void check_elev2_mask2(IceSheet const *sheet);
+
+	/** Looks up a matrix in the cache, computing it on a miss.
+	@param sheet The ice sheet the matrix belongs to; or NULL for
+		matrices that depend on all ice sheets.
+	@param compute Fills in the M (and area1_m, rowscales) fields of a
+		cache entry.
+	@param patch Brings the M of an entry up to date, if only elev2
+		has changed since it was computed (entry.elev2_versions tells
+		since when).  Returns false if it cannot; then compute is used. */
+	CachedMatrix &cached_matrix(
+		IceSheet const *sheet, MatrixKind kind, int interp,
+		boost::function<void (CachedMatrix &)> const &compute,
+		boost::function<bool (CachedMatrix &)> const &patch);
+
+	/** Computes hp_to_atm() from scratch.
+	@param rowscales Set to the row scaling used for each sheet. */
+	std::unique_ptr<giss::VectorSparseMatrix> compute_hp_to_atm(
+		std::map<int, giss::DiagonalMatrix> &rowscales);
+
+	/** Brings a cached hp_to_atm() up to date after elev2 changes, by
+	recomputing the rows of the GCM cells affected.
+	@return false if it cannot; then it must be recomputed. */
+	bool patch_hp_to_atm(CachedMatrix &e);
+
+	/** Solver used by iceinterp_to_hp(); kept between calls.
+	(shared_ptr because IceToHPSolver is incomplete here) */
+	std::shared_ptr<IceToHPSolver> _ice_to_hp_solver;
+	size_t _ice_to_hp_fingerprint;	/// matrix_fingerprint(NULL, false) it was built for
+	std::map<int, long> _ice_to_hp_versions;	/// elev2_versions(NULL) it is up to date with
 public:
+	/** Hits and misses of the matrix cache since construction. */
+	MatrixCacheStats matrix_cache_stats;
+
 	bool const correct_area1;		/// Should we correct for projection and geometric error?
 	HCIndex::Type _hc_index_type;
 	MatrixMaker(
@@ -115,25 +199,77 @@ public:
 	guaranteed that ice-filled grid cells will never overlap). */
 	void fgice(giss::CooVector<int,double> &fgice1);
 
-	std::unique_ptr<giss::VectorSparseMatrix> hp_to_atm();
+	/** Hashes what the regridding matrices are computed from.
+	@param sheet Sheet to fingerprint, or NULL for all sheets.
+	@param contents If true, hashes only values (elev2 and mask2
+		element by element, but no pointers), so any process that
+		reads and realizes the same inputs gets the same fingerprint
+		(see write_maker_bundle()).  If false, the grids and ice sheets
+		are identified by address and elev2 is left out, so the
+		matrix cache can patch for changes in elev2 (it tracks them
+		with IceSheet::elev2_version(), after calling
+		check_elev2_mask2()).  mask2 is hashed by value either way. */
+	size_t matrix_fingerprint(IceSheet const *sheet, bool contents = true) const;
+
+	/** Matrices returned by hp_to_atm(), hp_to_iceinterp() and
+	iceinterp_to_projatm() are cached, and shared between callers.
+	Entries are dropped by realize(), and recomputed whenever mask1,
+	hpdefs or an ice sheet's mask2 have changed since they were
+	computed.  After a change in elev2 only, they are patched (for the
+	ice cells that changed) instead.  Changes to elev2 / mask2 are found
+	by checksum before each use of the cache, even if they were made in
+	place; reporting them with IceSheet::elev2_mask2_changed() just
+	saves comparing every ice cell against its old value.  Callers that change anything else
+	the matrices depend on must call invalidate_matrices(). */
+	void invalidate_matrices();
+
+	std::shared_ptr<giss::VectorSparseMatrix const> hp_to_atm();
+
+	/** Cached version of IceSheet::hp_to_iceinterp() */
+	std::shared_ptr<giss::VectorSparseMatrix const> hp_to_iceinterp(
+		IceSheet *sheet, IceInterp dest);
+
+	/** Cached version of IceSheet::iceinterp_to_projatm().
+	@param area1_m The sheet's contribution to area1_m is added to this,
+		just as if the matrix had been recomputed. */
+	std::shared_ptr<giss::VectorSparseMatrix const> iceinterp_to_projatm(
+		IceSheet *sheet,
+		giss::DenseAccumulator<int,double> &area1_m,
+		IceInterp src);
 
 	/** @params f2 Some field on each ice grid (referenced by ID)
+	@param nthread Number of threads used to solve the QP subproblems
+		(only useful with MULTI_QP, which has one subproblem per GCM
+		grid cell).  The answer does not depend on nthread.
 	TODO: This only works on one ice sheet.  Will need to be extended
 	for multiple ice sheets. */
 	giss::CooVector<int, double> iceinterp_to_hp(
 		std::map<int, blitz::Array<double,1>> &f4s,
 		blitz::Array<double,1> initial3,
 		IceInterp src,
+		QPAlgorithm qp_algorithm = QPAlgorithm::SINGLE_QP,
+		int nthread = 1);
+
+	/** @return Persistent solver behind iceinterp_to_hp().  It is
+	set up (and its QP problems factorized) once, then reused until the
+	matrix cache is invalidated or its inputs change.  Use it directly
+	to regrid several fields at once.
+	@param sheet_ids Indices of the ice sheets fields will be given for. */
+	IceToHPSolver &ice_to_hp_solver(
+		std::vector<int> const &sheet_ids,
 		QPAlgorithm qp_algorithm = QPAlgorithm::SINGLE_QP);
 
 
 
 	/** @params f2 Some field on each ice grid (referenced by ID)
+	@param algorithm How to solve when RM is non-local.  If MIN_NORM
+		fails to converge, QP is used instead.
 	TODO: This only works on one ice sheet.  Will need to be extended
 	for multiple ice sheets. */
 	giss::CooVector<int, double> atm_to_hp(
 		blitz::Array<double,1> f1,
-		bool force_lambda = false);
+		bool force_lambda = false,
+		AtmToHPAlgorithm algorithm = AtmToHPAlgorithm::QP);
 
 
 
@@ -0,0 +1,227 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <glint2/clip_convex.hpp>
+
+namespace glint2 {
+
+// =======================================================================
+// Exact orientation predicate
+// See: J. R. Shewchuk, "Adaptive Precision Floating-Point Arithmetic
+// and Fast Robust Geometric Predicates", 1997.
+
+/** x + y = a + b exactly */
+static inline void two_sum(double a, double b, double &x, double &y)
+{
+	x = a + b;
+	double bvirt = x - a;
+	double avirt = x - bvirt;
+	y = (a - avirt) + (b - bvirt);
+}
+
+/** x + y = a * b exactly */
+static inline void two_product(double a, double b, double &x, double &y)
+{
+	x = a * b;
+	y = std::fma(a, b, -x);
+}
+
+/** Adds b to the nonoverlapping expansion e[0..n) (in place),
+eliminating zero components.
+@return New length of the expansion. */
+static int grow_expansion(int n, double *e, double b)
+{
+	double Q = b;
+	int m = 0;
+	for (int i=0; i<n; ++i) {
+		double Qnew, h;
+		two_sum(Q, e[i], Qnew, h);
+		Q = Qnew;
+		if (h != 0) e[m++] = h;
+	}
+	if (Q != 0 || m == 0) e[m++] = Q;
+	return m;
+}
+
+/** Exact sign of (a-c) x (b-c) */
+static int orient2d_exact(DPoint const &a, DPoint const &b, DPoint const &c)
+{
+	// (ax-cx)(by-cy) - (ay-cy)(bx-cx), multiplied out
+	double const prods[6][2] = {
+		{ a.x,  b.y}, {-a.x,  c.y}, {-c.x,  b.y},
+		{-a.y,  b.x}, { a.y,  c.x}, { c.y,  b.x}};
+
+	double e[12];
+	int n = 0;
+	for (int i=0; i<6; ++i) {
+		double x, y;
+		two_product(prods[i][0], prods[i][1], x, y);
+		n = grow_expansion(n, e, y);
+		n = grow_expansion(n, e, x);
+	}
+
+	// The most significant component gives the sign
+	double const top = e[n-1];
+	return (top > 0 ? 1 : (top < 0 ? -1 : 0));
+}
+
+int orient2d(DPoint const &a, DPoint const &b, DPoint const &c)
+{
+	// Error bound for the floating-point determinant
+	static double const epsilon = std::ldexp(1.0, -53);
+	static double const ccwerrboundA = (3.0 + 16.0 * epsilon) * epsilon;
+
+	double detleft = (a.x - c.x) * (b.y - c.y);
+	double detright = (a.y - c.y) * (b.x - c.x);
+	double det = detleft - detright;
+
+	double errbound = ccwerrboundA * (std::abs(detleft) + std::abs(detright));
+	if (det > errbound) return 1;
+	if (-det > errbound) return -1;
+
+	return orient2d_exact(a, b, c);
+}
+// -----------------------------------------------------------------------
+double signed_area(std::vector<DPoint> const &poly)
+{
+	double ret = 0;
+	size_t n = poly.size();
+	for (size_t i=0, j=n-1; i<n; j=i++)
+		ret += poly[j].x * poly[i].y - poly[i].x * poly[j].y;
+	return .5 * ret;
+}
+
+bool is_convex_ccw(std::vector<DPoint> const &poly)
+{
+	size_t n = poly.size();
+	if (n < 3) return false;
+
+	bool has_left = false;
+	for (size_t i=0; i<n; ++i) {
+		DPoint const &p0(poly[i]);
+		DPoint const &p1(poly[(i+1)%n]);
+		DPoint const &p2(poly[(i+2)%n]);
+		if (p0 == p1) return false;
+
+		int o = orient2d(p0, p1, p2);
+		if (o < 0) return false;
+		if (o > 0) has_left = true;
+
+		// Fan from vertex 0 must be CCW too, or the
+		// polygon winds more than once (eg: a pentagram).
+		if (i > 0 && i < n-1 && orient2d(poly[0], p0, p1) < 0) return false;
+	}
+	return has_left;
+}
+// -----------------------------------------------------------------------
+/** Clips a polygon against the half-plane to the left of (a,b).
+@param computed Set if any intersection points had to be computed (rounded).
+@return false if a degeneracy was found. */
+static bool clip_halfplane(
+	std::vector<DPoint> const &in,
+	DPoint const &a, DPoint const &b,
+	std::vector<DPoint> &out,
+	bool &computed)
+{
+	out.clear();
+	size_t n = in.size();
+	if (n == 0) return true;
+
+	DPoint const *s = &in[n-1];
+	int ss = orient2d(a, b, *s);
+	for (size_t i=0; i<n; ++i) {
+		DPoint const *e = &in[i];
+		int se = orient2d(a, b, *e);
+
+		if ((ss > 0 && se < 0) || (ss < 0 && se > 0)) {
+			// Strictly crosses the line: compute intersection
+			double const dx = b.x - a.x;
+			double const dy = b.y - a.y;
+			double ds = dx * (s->y - a.y) - dy * (s->x - a.x);
+			double de = dx * (e->y - a.y) - dy * (e->x - a.x);
+
+			// Rounded values must agree with the exact signs
+			if (ds * ss <= 0 || de * se <= 0) return false;
+
+			double t = ds / (ds - de);
+			out.push_back(DPoint(
+				s->x + t * (e->x - s->x),
+				s->y + t * (e->y - s->y)));
+			computed = true;
+		}
+		if (se >= 0) out.push_back(*e);
+
+		s = e;
+		ss = se;
+	}
+	return true;
+}
+
+ClipResult clip_convex(
+	std::vector<DPoint> const &P, double P_area,
+	std::vector<DPoint> const &Q, double Q_area,
+	std::vector<DPoint> &out)
+{
+	// Relative area below which we don't trust the answer
+	double const sliver = 1e-10;
+
+	std::vector<DPoint> tmp;
+	tmp.reserve(P.size() + Q.size());
+	out.reserve(P.size() + Q.size());
+	out = P;
+
+	bool computed = false;
+	size_t nq = Q.size();
+	for (size_t i=0, j=nq-1; i<nq; j=i++) {
+		out.swap(tmp);
+		if (!clip_halfplane(tmp, Q[j], Q[i], out, computed))
+			return ClipResult::DEGENERATE;
+		if (out.size() == 0) return ClipResult::EMPTY;
+	}
+
+	// Remove repeated vertices
+	auto last = std::unique(out.begin(), out.end());
+	out.erase(last, out.end());
+	while (out.size() > 1 && out.front() == out.back()) out.pop_back();
+
+	if (out.size() < 3) {
+		// Exact vertices: polygons just touch
+		// Computed vertices: maybe a very small overlap
+		return (computed ? ClipResult::DEGENERATE : ClipResult::EMPTY);
+	}
+
+	double area = signed_area(out);
+	if (area > sliver * std::min(P_area, Q_area)) return ClipResult::OVERLAP;
+
+	// Zero-area overlap along a shared edge
+	if (!computed) {
+		bool collinear = true;
+		for (size_t i=2; i<out.size(); ++i) {
+			if (orient2d(out[0], out[1], out[i]) != 0) {
+				collinear = false;
+				break;
+			}
+		}
+		if (collinear) return ClipResult::EMPTY;
+	}
+	return ClipResult::DEGENERATE;
+}
+
+}	// namespace glint2
@@ -0,0 +1,77 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+
+namespace glint2 {
+
+/** A point in the plane, in plain double precision.
+Used by the fast (non-CGAL) overlap code. */
+struct DPoint {
+	double x, y;
+
+	DPoint() {}
+	DPoint(double _x, double _y) : x(_x), y(_y) {}
+
+	bool operator==(DPoint const &b) const
+		{ return x == b.x && y == b.y; }
+	bool operator!=(DPoint const &b) const
+		{ return !(*this == b); }
+};
+
+/** Exact orientation predicate.  A fast floating-point test is used
+when its error bound allows; otherwise the determinant is evaluated
+exactly with floating-point expansions (Shewchuk 1997).
+@return +1 if (a,b,c) make a left (counter-clockwise) turn,
+	-1 for a right turn, 0 if they are collinear. */
+int orient2d(DPoint const &a, DPoint const &b, DPoint const &c);
+
+/** @return Signed area of a polygon (positive for counter-clockwise). */
+double signed_area(std::vector<DPoint> const &poly);
+
+/** Determines (exactly) whether a polygon is convex, counter-clockwise
+and winds only once.  Collinear consecutive vertices are allowed,
+repeated vertices are not. */
+bool is_convex_ccw(std::vector<DPoint> const &poly);
+
+/** Result of clip_convex() */
+enum class ClipResult {
+	EMPTY,			/// Polygons do not overlap (or overlap with zero area)
+	OVERLAP,		/// Overlap polygon was computed
+	DEGENERATE		/// Can't decide in floating point; use an exact method instead
+};
+
+/** Computes the overlap of two convex, counter-clockwise polygons
+(see is_convex_ccw()), by Sutherland-Hodgman clipping on doubles.
+Inside/outside decisions use the exact orient2d(); only the
+intersection points are rounded.  Cases in which that rounding could
+change the answer (touching polygons, tiny slivers) are reported as
+DEGENERATE, so the caller can fall back on CGAL.
+@param P Polygon to be clipped.
+@param P_area Area of P (from signed_area()).
+@param Q Clip polygon.
+@param Q_area Area of Q (from signed_area()).
+@param out The overlap polygon, counter-clockwise, if OVERLAP is returned. */
+ClipResult clip_convex(
+	std::vector<DPoint> const &P, double P_area,
+	std::vector<DPoint> const &Q, double Q_area,
+	std::vector<DPoint> &out);
+
+}	// namespace glint2
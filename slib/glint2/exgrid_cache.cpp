@@ -0,0 +1,173 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include <giss/memory.hpp>
+#include <giss/ncutil.hpp>
+#include <glint2/exgrid_cache.hpp>
+
+namespace glint2 {
+
+/** Change this when ExchangeGrid changes its output, to
+invalidate old cache files. */
+static int const EXGRID_CACHE_VERSION = 1;
+
+// --------------------------------------------------------------------
+/** 128-bit hash (two FNV streams).  Unlike std::hash, this is stable
+between runs, which is required for keys of on-disk files. */
+class GeometryHash {
+	uint64_t h0, h1;
+public:
+	GeometryHash() : h0(14695981039346656037ULL), h1(0x84222325cbf29ce4ULL) {}
+
+	void add(void const *data, size_t n) {
+		static uint64_t const prime = 1099511628211ULL;
+		unsigned char const *bytes = (unsigned char const *)data;
+		for (size_t i=0; i<n; ++i) {
+			h0 = (h0 ^ bytes[i]) * prime;		// FNV-1a
+			h1 = (h1 * prime) ^ bytes[i];		// FNV-1
+		}
+	}
+
+	template<class T>
+	void add(T const &val) { add(&val, sizeof(T)); }
+
+	void add(std::string const &str) {
+		add((long)str.size());
+		add(str.data(), str.size());
+	}
+
+	std::string hex() const {
+		char buf[33];
+		snprintf(buf, sizeof(buf), "%016llx%016llx",
+			(unsigned long long)h0, (unsigned long long)h1);
+		return std::string(buf);
+	}
+};
+
+static void hash_grid(GeometryHash &hash, Grid const &grid)
+{
+	hash.add((int)grid.type.index());
+	hash.add((int)grid.coordinates.index());
+	hash.add((int)grid.parameterization.index());
+	hash.add(grid.name);
+	hash.add(grid.sproj);
+	hash.add(grid.ncells_full());
+	hash.add(grid.nvertices_full());
+
+	// Cells come out sorted by index
+	hash.add(grid.ncells_realized());
+	for (auto cell = grid.cells_begin(); cell != grid.cells_end(); ++cell) {
+		hash.add(cell->index);
+		hash.add(cell->i);
+		hash.add(cell->j);
+		hash.add(cell->k);
+		hash.add(cell->size());
+		for (auto vertex = cell->begin(); vertex != cell->end(); ++vertex) {
+			hash.add(vertex->index);
+			hash.add(vertex->x);
+			hash.add(vertex->y);
+		}
+	}
+}
+
+std::string exchange_grid_key(Grid const &grid1, Grid const &grid2,
+	std::string const &sproj)
+{
+	GeometryHash hash;
+	hash.add(EXGRID_CACHE_VERSION);
+	hash_grid(hash, grid1);
+	hash_grid(hash, grid2);
+	hash.add(sproj);
+	return hash.hex();
+}
+// --------------------------------------------------------------------
+
+std::unique_ptr<ExchangeGrid> cached_exchange_grid(
+	Grid const &grid1, Grid const &grid2,
+	std::string const &sproj,
+	std::string cache_dir,
+	int nthread)
+{
+	if (cache_dir == "") {
+		char const *env = getenv("GLINT2_EXGRID_CACHE");
+		if (env) cache_dir = env;
+	}
+	if (cache_dir == "") {
+		return std::unique_ptr<ExchangeGrid>(
+			new ExchangeGrid(grid1, grid2, sproj, nthread));
+	}
+
+	std::string key(exchange_grid_key(grid1, grid2, sproj));
+	boost::filesystem::path fname(
+		boost::filesystem::path(cache_dir) / ("exgrid-" + key + ".nc"));
+
+	// Cache hit
+	if (boost::filesystem::exists(fname)) {
+		printf("Reading cached exchange grid %s\n", fname.c_str());
+		NcFile nc(fname.c_str());
+		auto exgrid(giss::unique_cast<ExchangeGrid, Grid>(read_grid(nc, "grid")));
+
+		NcVar *info_var = nc.get_var("grid.info");
+		std::string file_key(giss::get_att(info_var, "cache_key")->as_string(0));
+		nc.close();
+		if (file_key != key) {
+			fprintf(stderr, "Cache file %s has key %s, expected %s\n",
+				fname.c_str(), file_key.c_str(), key.c_str());
+			throw std::exception();
+		}
+		return exgrid;
+	}
+
+	// Cache miss: compute and store
+	std::unique_ptr<ExchangeGrid> exgrid(
+		new ExchangeGrid(grid1, grid2, sproj, nthread));
+
+	boost::filesystem::create_directories(cache_dir);
+	// The cache may be on a filesystem shared between nodes, where
+	// PIDs are not unique: name the temporary file by host as well,
+	// plus a random part.
+	char host[256];
+	if (gethostname(host, sizeof(host)) != 0) strcpy(host, "unknown");
+	host[sizeof(host)-1] = '\0';
+	char suffix[300];
+	snprintf(suffix, sizeof(suffix), ".tmp.%s.%ld.", host, (long)getpid());
+	boost::filesystem::path tmpname(fname.string() + suffix +
+		boost::filesystem::unique_path("%%%%%%%%").string());
+
+	printf("Writing exchange grid to cache %s\n", fname.c_str());
+	{
+		NcFile nc(tmpname.c_str(), NcFile::Replace);
+		auto gridd = exgrid->netcdf_define(nc, "grid");
+		NcVar *info_var = nc.get_var("grid.info");
+		info_var->add_att("cache_key", key.c_str());
+		gridd();
+		nc.close();
+	}
+
+	// Atomic, in case someone else is writing the same file
+	boost::filesystem::rename(tmpname, fname);
+
+	return exgrid;
+}
+
+}	// namespace glint2
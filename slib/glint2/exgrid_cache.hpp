@@ -0,0 +1,49 @@
+/*
+ * GLINT2: A Coupling Library for Ice Models and GCMs
+ * Copyright (c) 2013 by Robert Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <glint2/ExchangeGrid.hpp>
+
+namespace glint2 {
+
+/** Computes a key identifying the exchange grid between two grids.
+The key is a hash of everything ExchangeGrid uses: grid types,
+coordinates, projections and the geometry of every realized cell.
+@return 32 hex digits. */
+std::string exchange_grid_key(Grid const &grid1, Grid const &grid2,
+	std::string const &sproj = "");
+
+/** Returns the exchange grid between grid1 and grid2, reading it from
+an on-disk cache if it has been computed before.  Otherwise it is
+computed, and stored in the cache for next time.
+Cache files are named exgrid-<key>.nc (see exchange_grid_key()), and
+are written atomically, so several processes may share a cache directory.
+@param cache_dir Directory for cache files.  If empty, uses the
+	environment variable GLINT2_EXGRID_CACHE.  If that is not set either,
+	the exchange grid is just computed (no caching).
+@param sproj, nthread Passed on to ExchangeGrid::ExchangeGrid() */
+std::unique_ptr<ExchangeGrid> cached_exchange_grid(
+	Grid const &grid1, Grid const &grid2,
+	std::string const &sproj = "",
+	std::string cache_dir = "",
+	int nthread = 1);
+
+}	// namespace glint2
@@ -17,11 +17,13 @@
  */
 
 #include <cstdio>
+#include <cmath>
 #include <giss/Proj.hpp>
 #include <glint2/matrix_ops.hpp>
 #include <glint2/util.hpp>
 #include <glint2/HCIndex.hpp>
 #include <giss/constant.hpp>
+#include <giss/CsrSparseMatrix.hpp>
 
 namespace glint2 {
 
@@ -29,8 +31,8 @@ namespace glint2 {
 @param area (IN) Vector to divide by.  Value is moved out of this.
 @param area_inv (OUT) 1/area */
 void divide_by(giss::VectorSparseMatrix &mat,
-	giss::SparseAccumulator<int,double> &area,
-	giss::SparseAccumulator<int,double> &area_inv)
+	giss::DenseAccumulator<int,double> &area,
+	giss::DenseAccumulator<int,double> &area_inv)
 {
 	// Compute 1 / area
 	for (auto ii = area.begin(); ii != area.end(); ++ii)
@@ -42,7 +44,100 @@ void divide_by(giss::VectorSparseMatrix &mat,
 		ii.val() *= area_inv[ii.row()];
 }
 
+giss::DiagonalMatrix area_inv_diag(int n,
+	giss::DenseAccumulator<int,double> const &area)
+{
+	giss::DiagonalMatrix ret(n, 0.0);
+	for (auto ii = area.begin(); ii != area.end(); ++ii)
+		ret(ii->first) = ii->second;
+	ret.invert();
+	return ret;
+}
+
+static inline double dot(std::vector<double> const &a, std::vector<double> const &b)
+{
+	double ret = 0;
+	for (size_t i=0; i<a.size(); ++i) ret += a[i] * b[i];
+	return ret;
+}
+
+int min_norm_project(giss::VectorSparseMatrix const &A,
+	blitz::Array<double,1> const &b,
+	blitz::Array<double,1> &x,
+	double rtol, int max_iter)
+{
+	int const m = A.nrow;
+	int const n = A.ncol;
+	if (m == 0) return 0;
+
+	// Both A and A^T in CSR, so every product is a row-wise gather
+	giss::CsrSparseMatrix const Ac(A);
+	std::unique_ptr<giss::CsrSparseMatrix> AT(Ac.transpose());
 
+	// Jacobi preconditioner: diag(A A^T) = sum of squares of each row
+	std::vector<double> dinv(m, 0);
+	for (auto ii = Ac.begin(); ii != Ac.end(); ++ii)
+		dinv[ii.row()] += ii.val() * ii.val();
+	for (int i=0; i<m; ++i) {
+		if (dinv[i] == 0) {
+			fprintf(stderr, "min_norm_project(): Row %d of constraints is empty\n", i);
+			throw std::exception();
+		}
+		dinv[i] = 1.0d / dinv[i];
+	}
+
+	// r = b - A x0
+	std::vector<double> r(m);
+	Ac.multiply(x.data(), &r[0]);
+	for (int i=0; i<m; ++i) r[i] = b(i) - r[i];
+
+	// Solve (A A^T) y = r by PCG
+	std::vector<double> y(m, 0), z(m), p(m), q(m), w(n);
+	for (int i=0; i<m; ++i) z[i] = dinv[i] * r[i];
+	p = z;
+	double rz = dot(r, z);
+	double const r0norm = std::sqrt(dot(r, r));
+	double const stop = rtol * r0norm;
+
+	int iter = 0;
+	for (; iter < max_iter; ++iter) {
+		if (std::sqrt(dot(r, r)) <= stop) break;
+
+		// q = A A^T p
+		AT->multiply(&p[0], &w[0]);
+		Ac.multiply(&w[0], &q[0]);
+
+		// A A^T is positive semi-definite; pq <= 0 means it is
+		// singular here (eg: dependent constraints), or roundoff
+		// has taken over.
+		double const pq = dot(p, q);
+		if (!(pq > 0)) {
+			fprintf(stderr, "min_norm_project(): CG broke down after %d iterations (p.q = %g), |r|/|r0| = %g\n",
+				iter, pq, std::sqrt(dot(r, r)) / r0norm);
+			throw std::exception();
+		}
+		double const alpha = rz / pq;
+		for (int i=0; i<m; ++i) {
+			y[i] += alpha * p[i];
+			r[i] -= alpha * q[i];
+			z[i] = dinv[i] * r[i];
+		}
+
+		double const rz_new = dot(r, z);
+		double const beta = rz_new / rz;
+		for (int i=0; i<m; ++i) p[i] = z[i] + beta * p[i];
+		rz = rz_new;
+	}
+	if (iter == max_iter && std::sqrt(dot(r, r)) > stop) {
+		fprintf(stderr, "min_norm_project(): No convergence after %d iterations, |r|/|r0| = %g\n",
+			iter, std::sqrt(dot(r, r)) / r0norm);
+		throw std::exception();
+	}
+
+	// x = x0 + A^T y
+	AT->multiply(&y[0], x.data(), false);
+	return iter;
+}
 
 
 } // namespace glint2
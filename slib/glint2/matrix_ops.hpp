@@ -29,8 +29,29 @@
 namespace glint2 {
 
 void divide_by(giss::VectorSparseMatrix &mat,
-	giss::SparseAccumulator<int,double> &area,
-	giss::SparseAccumulator<int,double> &area_inv);
+	giss::DenseAccumulator<int,double> &area,
+	giss::DenseAccumulator<int,double> &area_inv);
+
+/** @return Diagonal matrix [n] of 1/area, for dividing by area with
+giss::scale_rows().  Zero where no area was accumulated. */
+giss::DiagonalMatrix area_inv_diag(int n,
+	giss::DenseAccumulator<int,double> const &area);
+
+/** Projects x0 onto the affine space {x : A x = b}, giving the
+minimum-norm correction:
+	x = x0 + A^T (A A^T)^-1 (b - A x0)
+(A A^T)^-1 is applied by Jacobi-preconditioned conjugate gradients,
+without forming A A^T.  Rows of A must be non-empty.
+@param A m x n constraints matrix
+@param b [m] Right hand side of the constraints
+@param x [n] IN: x0.  OUT: The projection
+@param rtol Stop when |residual| <= rtol * |b - A x0|
+@return Number of CG iterations taken.  Throws if CG breaks down, or
+	does not converge in max_iter iterations (x is then unchanged). */
+int min_norm_project(giss::VectorSparseMatrix const &A,
+	blitz::Array<double,1> const &b,
+	blitz::Array<double,1> &x,
+	double rtol = 1e-12, int max_iter = 10000);
 
 
 
@@ -29,6 +29,52 @@ using namespace glint2;
 using namespace glint2::modele;
 
 // ---------------------------------------------------
+/** Opens the bundle of precomputed matrices for a GLINT2 config file,
+if there is one.  It is taken from $GLINT2_BUNDLE, or else
+<config file>.bundle.  Bundles built from different inputs, or that
+cannot be read, are ignored (with a warning).
+@param maker The realized MatrixMaker the bundle must match.
+@return The bundle, or NULL if none should be used. */
+static std::unique_ptr<Bundle> open_modele_bundle(
+	boost::filesystem::path const &glint2_config_rfname,
+	std::string const &maker_vname,
+	MatrixMaker const &maker)
+{
+	char const *env = getenv("GLINT2_BUNDLE");
+	std::string fname(env ? env : glint2_config_rfname.string() + ".bundle");
+	if (!boost::filesystem::exists(fname)) return std::unique_ptr<Bundle>();
+
+	// A bundle left over from an older version of GLINT2 (or a
+	// damaged one) is not worth aborting the run over.
+	std::unique_ptr<Bundle> bundle;
+	try {
+		bundle.reset(new Bundle(fname));
+		bundle->get_string("source");
+		bundle->get<int64_t>("fingerprint");
+	} catch(std::exception const &e) {
+		fprintf(stderr, "WARNING: Ignoring bundle %s, which could not be read (wrong version?)\n", fname.c_str());
+		return std::unique_ptr<Bundle>();
+	}
+
+	std::string source(bundle_source_stamp(glint2_config_rfname.string(), maker_vname));
+	if (bundle->get_string("source") != source) {
+		fprintf(stderr, "WARNING: Ignoring bundle %s, built from different inputs:\n    %s\n    (expected %s)\n",
+			fname.c_str(), bundle->get_string("source").c_str(), source.c_str());
+		return std::unique_ptr<Bundle>();
+	}
+
+	// elev2 / mask2 might have come from somewhere other than the
+	// config file (eg: PISM); then the matrices in the bundle are stale.
+	uint64_t fingerprint = maker.matrix_fingerprint(NULL);
+	uint64_t bundle_fingerprint = bundle->get<int64_t>("fingerprint")[0];
+	if (bundle_fingerprint != fingerprint) {
+		fprintf(stderr, "WARNING: Ignoring bundle %s, built from different elev2 / mask2 / mask1 / hpdefs (fingerprint %lx, expected %lx)\n",
+			fname.c_str(), (unsigned long)bundle_fingerprint, (unsigned long)fingerprint);
+		return std::unique_ptr<Bundle>();
+	}
+	printf("Using precomputed matrices from bundle %s\n", fname.c_str());
+	return bundle;
+}
 
 /** @param glint2_config_fname_f Name of GLINT2 configuration file */
 extern "C" glint2_modele *glint2_modele_new(
@@ -111,6 +157,8 @@ printf("iyear1 = %d\n", iyear1);
 	// PISM input file, and the version in the GLINT2 file will be ignored)
 	api->maker->realize();
 
+	// Use precomputed matrices, if we have them
+	api->bundle = open_modele_bundle(glint2_config_rfname, maker_vname, *api->maker);
 
 	// TODO: Test that im and jm are consistent with the grid read.
 #endif
@@ -186,7 +234,14 @@ std::cout << "fgice1_glint2_f: " << fgice1_glint2_f << std::endl;
 	// Get the sparse vector values
 	giss::CooVector<std::pair<int,int>,double> fhc1h_s;
 	giss::CooVector<int,double> fgice1_s;
-	api->maker->fgice(fgice1_s);
+	if (api->bundle.get()) {
+		auto index(api->bundle->get<int32_t>("fgice1.index"));
+		auto val(api->bundle->get<double>("fgice1.val"));
+		fgice1_s.reserve(index.size);
+		for (size_t i=0; i<index.size; ++i) fgice1_s.add(index[i], val[i]);
+	} else {
+		api->maker->fgice(fgice1_s);
+	}
 
 	// Translate the sparse vectors to the ModelE data structures
 	std::vector<std::tuple<int, int, double>> fgice1_vals;
@@ -281,6 +336,37 @@ printf("BEGIN global_to_local_hp %p %p %p %p\n", &grows[0], rows_i.data(), rows_
 printf("END global_to_local_hp\n");
 }
 // -----------------------------------------------------
+/** Adds one element of the hp_to_atm matrix to fhc1h,
+if it is in our domain. */
+static void add_hp_to_atm(
+	ModelEDomain &domain,
+	HCIndex const &hc_index,
+	blitz::Array<double,3> &fhc1h,
+	int i1a, int i3b, double val)
+{
+	// Input: HP space
+	int lindex[domain.num_local_indices];
+	int hp1b, i1b;
+	hc_index.index_to_ik(i3b, i1b, hp1b);
+	domain.global_to_local(i1b, lindex);
+	if (!domain.in_domain(lindex)) {
+		//printf("Not in domain: i3b=%d (%d, %d, %d)\n", i3b, lindex[0], lindex[1], hp1b);
+		return;
+	}
+
+	// Output: GCM grid
+	if (i1a != i1b) {
+		fprintf(stderr, "HP2ATM matrix is non-local!\n");
+		throw std::exception();
+	}
+
+	// Now fill in FHC
+	// +1 for C-to-Fortran conversion
+	// +1 because lowest HP/HC is reserved for non-model ice
+	fhc1h(lindex[0], lindex[1], hp1b+2) +=
+		val * (1.0d - fhc1h(lindex[0], lindex[1],1));
+}
+// -----------------------------------------------------
 /**
 @param zatmo1_f ZATMO from ModelE (Elevation of bottom of atmosphere * GRAV)
 @param BYGRAV 1/GRAV = 1/(9.8 m/s^2)
@@ -355,38 +441,19 @@ printf("init_landice_com_part2 2\n");
 printf("init_landice_com_part2 3\n");
 	// ======================= fhc(:,:,hp>1)
 	HCIndex &hc_index(*api->maker->hc_index);
-	std::unique_ptr<giss::VectorSparseMatrix> hp_to_atm(api->maker->hp_to_atm());
 	ModelEDomain &domain(*api->domain);
 
-	// Filter this array, and convert to fhc format
-	for (auto ii = hp_to_atm->begin(); ii != hp_to_atm->end(); ++ii) {
-		int lindex1a[domain.num_local_indices];
-
-		// Input: HP space
-		int lindex[domain.num_local_indices];
-		int hp1b, i1b;
-		int i3b = ii.col();
-		hc_index.index_to_ik(i3b, i1b, hp1b);
-		domain.global_to_local(i1b, lindex);
-		if (!domain.in_domain(lindex)) {
-			//printf("Not in domain: i3b=%d (%d, %d, %d)\n", i3b, lindex[0], lindex[1], hp1b);
-			continue;
-		}
-
-		// Output: GCM grid
-		int i1a = ii.row();
-		if (i1a != i1b) {
-			fprintf(stderr, "HP2ATM matrix is non-local!\n");
-			throw std::exception();
+	if (api->bundle.get()) {
+		BundleCsr hp_to_atm(api->bundle->get_csr("hp_to_atm"));
+		for (int i1a = 0; i1a < hp_to_atm.nrow; ++i1a) {
+			for (int k = hp_to_atm.rowptr[i1a]; k < hp_to_atm.rowptr[i1a+1]; ++k)
+				add_hp_to_atm(domain, hc_index, fhc1h, i1a, hp_to_atm.col[k], hp_to_atm.val[k]);
 		}
-
-		// Now fill in FHC
-		// +1 for C-to-Fortran conversion
-		// +1 because lowest HP/HC is reserved for non-model ice
-		fhc1h(lindex[0], lindex[1], hp1b+2) +=
-			ii.val() * (1.0d - fhc1h(lindex[0], lindex[1],1));
+	} else {
+		std::shared_ptr<giss::VectorSparseMatrix const> hp_to_atm(api->maker->hp_to_atm());
+		for (auto ii = hp_to_atm->begin(); ii != hp_to_atm->end(); ++ii)
+			add_hp_to_atm(domain, hc_index, fhc1h, ii.row(), ii.col(), ii.val());
 	}
-	hp_to_atm.release();
 
 printf("init_landice_com_part2 4\n");
 	// ====================== used
@@ -438,6 +505,30 @@ printf("init_landice_com_part2 4\n");
 printf("END glint2_modele_init_landice_com_part2\n");
 }
 
+/** Adds one element of an hp_to_iceinterp matrix to omat,
+if it is in our domain. */
+static void add_hp_to_ice(
+	ModelEDomain &domain,
+	HCIndex const &hc_index,
+	std::vector<hp_to_ice_rec> &omat,
+	int i2, int i3, double val)
+{
+	// Get index in HP space
+	int lindex[domain.num_local_indices];
+	int hp1, i1;
+	hc_index.index_to_ik(i3, i1, hp1);
+	domain.global_to_local(i1, lindex);
+	if (!domain.in_domain(lindex)) return;
+
+	// Write to output matrix
+	// +1 for C-to-Fortran conversion
+	// +1 because lowest HP/HC is reserved for non-model ice
+	omat.push_back(hp_to_ice_rec(
+		i2,
+		lindex[0], lindex[1], hp1+2,
+		val));
+}
+
 extern "C"
 void glint2_modele_init_hp_to_ices(glint2::modele::glint2_modele *api)
 {
@@ -449,29 +540,24 @@ printf("BEGIN glint2_modele_init_hp_to_ices\n");
 	api->hp_to_ices.clear();
 	for (auto sheet=api->maker->sheets.begin(); sheet != api->maker->sheets.end(); ++sheet) {
 
-		// Get matrix for HP2ICE
-		std::unique_ptr<giss::VectorSparseMatrix> imat(
-			sheet->hp_to_iceinterp(IceInterp::ICE));
-		if (imat->size() == 0) continue;
-
-		// Convert to GCM coordinates
+		// Get matrix for HP2ICE, and convert to GCM coordinates
 		std::vector<hp_to_ice_rec> omat;
-		omat.reserve(imat->size());
-		for (auto ii=imat->begin(); ii != imat->end(); ++ii) {
-			// Get index in HP space
-			int lindex[domain.num_local_indices];
-			int hp1, i1;
-			hc_index.index_to_ik(ii.col(), i1, hp1);
-			domain.global_to_local(i1, lindex);
-			if (!domain.in_domain(lindex)) continue;
-
-			// Write to output matrix
-			// +1 for C-to-Fortran conversion
-			// +1 because lowest HP/HC is reserved for non-model ice
-			omat.push_back(hp_to_ice_rec(
-				ii.row(),
-				lindex[0], lindex[1], hp1+2,
-				ii.val()));
+		std::string bname(sheet->name + ".hp_to_ice");
+		if (api->bundle.get() && api->bundle->has(bname + ".val")) {
+			BundleCsr imat(api->bundle->get_csr(bname));
+			if (imat.size() == 0) continue;
+			omat.reserve(imat.size());
+			for (int i2 = 0; i2 < imat.nrow; ++i2) {
+				for (int k = imat.rowptr[i2]; k < imat.rowptr[i2+1]; ++k)
+					add_hp_to_ice(domain, hc_index, omat, i2, imat.col[k], imat.val[k]);
+			}
+		} else {
+			std::shared_ptr<giss::VectorSparseMatrix const> imat(
+				api->maker->hp_to_iceinterp(&*sheet, IceInterp::ICE));
+			if (imat->size() == 0) continue;
+			omat.reserve(imat->size());
+			for (auto ii=imat->begin(); ii != imat->end(); ++ii)
+				add_hp_to_ice(domain, hc_index, omat, ii.row(), ii.col(), ii.val());
 		}
 
 		// Store away
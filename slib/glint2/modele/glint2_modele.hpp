@@ -23,6 +23,7 @@
 #include <giss/SparseMatrix.hpp>
 #include <glint2/MatrixMaker.hpp>
 #include <glint2/GCMCoupler.hpp>
+#include <glint2/Bundle.hpp>
 #include <glint2/modele/ModelEDomain.hpp>
 
 namespace glint2 {
@@ -51,6 +52,10 @@ struct glint2_modele {
 
 	std::map<int, std::vector<hp_to_ice_rec>> hp_to_ices;
 
+	/** Precomputed matrices (see write_maker_bundle()), if available.
+	Used instead of recomputing them from maker. */
+	std::unique_ptr<Bundle> bundle;
+
 };
 }}	// namespace glint2::modele
 // ================================================
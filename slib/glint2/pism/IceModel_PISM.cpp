@@ -138,16 +138,23 @@ printf("Opening PISM file for elev2 and mask2: %s\n", pism_i.c_str());
 
 	ncin.close();
 
-	// Transpose and copy the data
-	if (!sheet->mask2.get()) sheet->mask2.reset(
+	// Transpose and copy the data, noting which cells changed
+	bool const new_mask2 = !sheet->mask2.get();
+	if (new_mask2) sheet->mask2.reset(
 		new blitz::Array<int,1>(glint2_grid->ndata()));
+	std::vector<int> changed;
 	for (int i=0; i<nx; ++i) {
 	for (int j=0; j<ny; ++j) {
 		int ix2 = glint2_grid->ij_to_index(i, j);
-		sheet->elev2(ix2) = topg(i,j) + thk(i,j);
+		double const elev = topg(i,j) + thk(i,j);
 		// Mask uses same convention as MATPLOTLIB: 1 = masked out
-		(*sheet->mask2)(ix2) = (mask(i,j) == 2 ? 0 : 1);
+		int const m2 = (mask(i,j) == 2 ? 0 : 1);
+		if (new_mask2 || sheet->elev2(ix2) != elev || (*sheet->mask2)(ix2) != m2)
+			changed.push_back(ix2);
+		sheet->elev2(ix2) = elev;
+		(*sheet->mask2)(ix2) = m2;
 	}}
+	sheet->elev2_mask2_changed(new_mask2 ? NULL : &changed);
 
 	printf("END IceModel_PISM::update_ice_sheet()\n");
 }
@@ -28,7 +28,8 @@ namespace glint2 {
 
 /** @param fname Name of file to load from (eg, an overlap matrix file)
 @param vname Eg: "grid1" or "grid2" */
-std::unique_ptr<Grid> read_grid(NcFile &nc, std::string const &vname)
+std::unique_ptr<Grid> read_grid(NcFile &nc, std::string const &vname,
+	CellFilter const &include_cell)
 {
 	auto info_var = nc.get_var((vname + ".info").c_str());
 
@@ -52,7 +53,7 @@ printf("read_grid(type=%s)\n", type.str());
 			break;
 	}
 
-	grid->read_from_netcdf(nc, vname);
+	grid->read_from_netcdf(nc, vname, include_cell);
 	return grid;
 }
 